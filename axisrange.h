@@ -6,6 +6,7 @@
 #define SIMPLE_CAIRO_PLOT_AXIS_RANGE_H
 
 #include <cmath>
+#include <cstdint> //uint64_t, int64_t
 
 namespace SimpleCairoPlot
 {
@@ -54,15 +55,18 @@ private:
 class AxisValues
 {
 public:
-	AxisValues(ValueRange range, unsigned int divider, bool adjust = true);
+	// range can be relative to origin, to keep float precision of large values: ticks are
+	// placed at round values of origin + value, operator[] returns values relative to origin
+	AxisValues(ValueRange range, unsigned int divider, bool adjust = true, double origin = 0);
 	unsigned int count() const;
 	float operator[](unsigned int i) const;
+	double value(unsigned int i) const; //origin + operator[](i)
 	
 private:
 	enum {Cnt_Choices = 5};
 	const float Choices[Cnt_Choices] = {1, 2, 2.5, 5, 10};
 	
-	float val_first, cell_width;
+	double origin; float val_first, cell_width;
 	unsigned int cnt;
 };
 
@@ -70,46 +74,46 @@ class IndexRange
 {
 public:
 	IndexRange();
-	IndexRange(unsigned long int min, unsigned long int max);
+	IndexRange(uint64_t min, uint64_t max);
 	IndexRange(const ValueRange& ax);
 	
 	operator ValueRange() const;
-	ValueRange to_axis(long int offset = 0) const;
+	ValueRange to_axis(int64_t offset = 0) const;
 	
 	operator bool() const;
-	unsigned long int min() const;
-	unsigned long int max() const;
-	unsigned long int count() const;
-	unsigned long int length() const;
-	unsigned long int count_by_step(unsigned int step) const;
+	uint64_t min() const;
+	uint64_t max() const;
+	uint64_t count() const;
+	uint64_t length() const;
+	uint64_t count_by_step(unsigned int step) const;
 	
 	bool operator==(const IndexRange& range) const;
 	bool operator!=(const IndexRange& range) const;
 	
-	bool contain(unsigned long int i) const;
+	bool contain(uint64_t i) const;
 	bool contain(IndexRange range) const;
 	bool intersected_not_left_of(IndexRange range) const;
-	unsigned long int fit_index(unsigned long int index) const;
-	unsigned long int fit_value(unsigned long int val) const; //same as fit_index()
+	uint64_t fit_index(uint64_t index) const;
+	uint64_t fit_value(uint64_t val) const; //same as fit_index()
 	IndexRange cut_range(IndexRange range) const;
 	IndexRange fit_range(IndexRange range) const;
 	
-	float map(unsigned long int val, ValueRange range, bool reverse = false) const;
-	float map_reverse(unsigned long int val, ValueRange range) const;
+	float map(uint64_t val, ValueRange range, bool reverse = false) const;
+	float map_reverse(uint64_t val, ValueRange range) const;
 	
-	void set(unsigned long int min, unsigned long int max);
-	void move(long int offset);
-	void min_move_to(unsigned long int min); //min moves with max
-	void max_move_to(unsigned long int max); //max moves with min
+	void set(uint64_t min, uint64_t max);
+	void move(int64_t offset);
+	void min_move_to(uint64_t min); //min moves with max
+	void max_move_to(uint64_t max); //max moves with min
 	void fit_by_range(IndexRange range);
 	void step_align_with(IndexRange range, unsigned int step);
 
 private:
 	bool valid;
-	unsigned long int val_min, val_max, cnt;
+	uint64_t val_min, val_max, cnt;
 };
 
-long int subtract(unsigned long int a, unsigned long int b);
+int64_t subtract(uint64_t a, uint64_t b);
 IndexRange intersection(IndexRange range1, IndexRange range2);
 
 /*------------------------------ ValueRange functions ------------------------------*/
@@ -247,7 +251,8 @@ inline void ValueRange::scale(float factor)
 
 /*------------------------------ AxisValues functions ------------------------------*/
 
-inline AxisValues::AxisValues(ValueRange range, unsigned int divider, bool adjust)
+inline AxisValues::AxisValues(ValueRange range, unsigned int divider, bool adjust, double origin):
+	origin(origin)
 {
 	using namespace std;
 	if (divider == 0) divider = 1;
@@ -268,7 +273,7 @@ inline AxisValues::AxisValues(ValueRange range, unsigned int divider, bool adjus
 			}
 		
 		this->cell_width = Choices[i] * power;
-		this->val_first = ceil(range.min() / this->cell_width) * this->cell_width;
+		this->val_first = ceil((origin + range.min()) / this->cell_width) * this->cell_width - origin;
 		this->cnt = (range.max() - this->val_first + this->cell_width / 200.0) / this->cell_width + 1;
 	}
 	else {
@@ -288,14 +293,19 @@ inline float AxisValues::operator[](unsigned int i) const
 	return this->val_first + i*this->cell_width;
 }
 
+inline double AxisValues::value(unsigned int i) const
+{
+	return this->origin + this->val_first + (double)i*this->cell_width;
+}
+
 /*------------------------------ IndexRange functions ------------------------------*/
 
-inline long int subtract(unsigned long int a, unsigned long int b)
+inline int64_t subtract(uint64_t a, uint64_t b)
 {
 	if (a >= b)
 		return a - b;
 	else
-		return -(long int)(b - a);
+		return -(int64_t)(b - a);
 }
 
 inline IndexRange intersection(IndexRange range1, IndexRange range2)
@@ -309,7 +319,7 @@ inline IndexRange::IndexRange()
 	this->cnt = this->val_min = this->val_max = 0;
 }
 
-inline IndexRange::IndexRange(unsigned long int min, unsigned long int max)
+inline IndexRange::IndexRange(uint64_t min, uint64_t max)
 {
 	this->set(min, max);
 }
@@ -331,11 +341,11 @@ inline IndexRange::operator ValueRange() const
 	return this->to_axis();
 }
 
-inline ValueRange IndexRange::to_axis(long int offset) const
+inline ValueRange IndexRange::to_axis(int64_t offset) const
 {
 	if (! this->valid) return ValueRange(-1, -1);
-	return ValueRange((float)this->val_min + offset,
-	                  (float)this->val_max + offset);
+	return ValueRange((float)((int64_t)this->val_min + offset),
+	                  (float)((int64_t)this->val_max + offset));
 }
 
 inline IndexRange::operator bool() const
@@ -343,31 +353,31 @@ inline IndexRange::operator bool() const
 	return this->valid;
 }
 
-inline unsigned long int IndexRange::min() const
+inline uint64_t IndexRange::min() const
 {
 	return this->val_min;
 }
 
-inline unsigned long int IndexRange::max() const
+inline uint64_t IndexRange::max() const
 {
 	return this->val_max;
 }
 
-inline unsigned long int IndexRange::count() const
+inline uint64_t IndexRange::count() const
 {
 	return this->cnt;
 }
 
-inline unsigned long int IndexRange::length() const
+inline uint64_t IndexRange::length() const
 {
 	if (! this->valid) return 0;
 	return this->count() - 1;
 }
 
-inline unsigned long int IndexRange::count_by_step(unsigned int step) const
+inline uint64_t IndexRange::count_by_step(unsigned int step) const
 {
 	if (!this->valid || step == 0) return 0;
-	unsigned int quo = this->count() / step, rem = this->count() % step;
+	uint64_t quo = this->count() / step, rem = this->count() % step;
 	if (rem > 0) quo++; return quo;
 }
 
@@ -383,7 +393,7 @@ inline bool IndexRange::operator!=(const IndexRange& range) const
 	return !(*this == range);
 }
 
-inline bool IndexRange::contain(unsigned long int i) const
+inline bool IndexRange::contain(uint64_t i) const
 {
 	return this->valid && this->val_min <= i && i <= this->val_max;
 }
@@ -400,7 +410,7 @@ inline bool IndexRange::intersected_not_left_of(IndexRange range) const
 	return range.contain(this->val_min) && this->contain(range.max());
 }
 
-inline unsigned long int IndexRange::fit_index(unsigned long int index) const
+inline uint64_t IndexRange::fit_index(uint64_t index) const
 {
 	if (! this->valid) return 0;
 	if (index < this->val_min) return this->val_min;
@@ -408,7 +418,7 @@ inline unsigned long int IndexRange::fit_index(unsigned long int index) const
 	return index;
 }
 
-inline unsigned long int IndexRange::fit_value(unsigned long int val) const
+inline uint64_t IndexRange::fit_value(uint64_t val) const
 {
 	return this->fit_index(val);
 }
@@ -436,18 +446,18 @@ inline IndexRange IndexRange::fit_range(IndexRange range) const
 	return range_new;
 }
 
-inline float IndexRange::map(unsigned long int val, ValueRange range, bool reverse) const
+inline float IndexRange::map(uint64_t val, ValueRange range, bool reverse) const
 {
 	val = this->fit_value(val);
 	return ValueRange(0, this->length()).map(val - this->val_min, range, reverse);
 }
 
-inline float IndexRange::map_reverse(unsigned long int val, ValueRange range) const
+inline float IndexRange::map_reverse(uint64_t val, ValueRange range) const
 {
 	return this->map(val, range, true);
 }
 
-inline void IndexRange::set(unsigned long int min, unsigned long int max)
+inline void IndexRange::set(uint64_t min, uint64_t max)
 {
 	if (max < min) {
 		this->cnt = this->val_min = this->val_max = 0;
@@ -459,22 +469,22 @@ inline void IndexRange::set(unsigned long int min, unsigned long int max)
 	this->valid = true;
 }
 
-inline void IndexRange::move(long int offset)
+inline void IndexRange::move(int64_t offset)
 {
 	if (! this->valid) return;
-	if (offset < -(long long int)this->val_min)
-		offset = -(long long int)this->val_min;
-	this->val_min += offset; this->val_max += offset; //unsigned long int + long int works
+	if (offset < -(int64_t)this->val_min)
+		offset = -(int64_t)this->val_min;
+	this->val_min += offset; this->val_max += offset; //uint64_t + int64_t works
 }
 
-inline void IndexRange::min_move_to(unsigned long int min)
+inline void IndexRange::min_move_to(uint64_t min)
 {
 	// note: signed - unsigned is dangerous
 	if (! this->valid) return;
 	this->move(subtract(min, this->val_min));
 }
 
-inline void IndexRange::max_move_to(unsigned long int max)
+inline void IndexRange::max_move_to(uint64_t max)
 {
 	if (! this->valid) return;
 	this->move(subtract(max, this->val_max));
@@ -490,12 +500,12 @@ inline void IndexRange::step_align_with(IndexRange range, unsigned int step)
 	if (! range) return;
 	
 	// note: signed *,/,<,> unsigned is dangerous
-	long int diff_min = subtract(this->min(), range.min());
-	diff_min = round(diff_min / (long int)step) * (long int)step;
+	int64_t diff_min = subtract(this->min(), range.min());
+	diff_min = round(diff_min / (int64_t)step) * (int64_t)step;
 	
-	unsigned long int new_min, new_max;
+	uint64_t new_min, new_max;
 	
-	if (diff_min >= 0 || -diff_min < (long long int)range.min())
+	if (diff_min >= 0 || -diff_min < (int64_t)range.min())
 		new_min = range.min() + diff_min;
 	else
 		new_min = 0;
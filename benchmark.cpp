@@ -0,0 +1,190 @@
+// benchmark of CircularBuffer for each lock policy: throughput of push() and range queries
+// in a single thread, then latency of push() while reader threads query the buffer like
+// PlotArea does for each frame (value range of the latest items for auto-scaling, then
+// copying of the items shown). if SIMPLE_CAIRO_PLOT_LOCK_POLICY is defined, only that
+// policy is measured (see the Makefile). it doesn't depend on GTK.
+// usage: plot_bench [reader_count] [seconds]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cstdlib> //atoi(), atof()
+
+#include <simple-cairo-plot/circularbuffer.h>
+
+using namespace std;
+using namespace std::chrono;
+
+using namespace SimpleCairoPlot;
+
+const uint64_t Buffer_Size = 1 << 20;
+const uint64_t Reader_Range = 1 << 16; //items checked by a reader for auto-scaling
+const uint64_t Reader_Copy = 4096; //items copied by a reader
+const double Slow_Push_Us = 50; //push() taking longer is counted as slow
+const unsigned int Query_Count = 20000; //for each type of range query
+
+volatile double result_sink; //results of queries are stored here, so they are not optimized out
+const char* const Policy_Names[] = {"Lock_Read_Write", "Lock_Exclusive", "Lock_Seq", "Lock_None"};
+
+struct PushStat {
+	uint64_t cnt = 0, cnt_slow = 0;
+	double ns_mean = 0, us_max = 0;
+};
+
+struct ReaderState {
+	CircularBuffer* buf = NULL;
+	atomic_bool* flag_stop = NULL;
+	uint64_t cnt_query = 0, cnt_retry = 0;
+};
+
+void reader_loop(ReaderState* st)
+{
+	CircularBuffer& buf = *st->buf;
+	vector<float> vals(Reader_Copy);
+	while (! st->flag_stop->load(memory_order_relaxed)) {
+		uint64_t cnt = buf.count(); //the buffer is full
+		ValueRange range_val = buf.get_value_range(IndexRange(cnt - Reader_Range, cnt - 1));
+		if (range_val.min() > range_val.max()) break; //shouldn't happen
+		
+		while (true) {
+			IndexRange range_abs = buf.range_to_abs(IndexRange(cnt - Reader_Copy, cnt - 1));
+			buf.copy_range(range_abs, 1, vals.data());
+			if (buf.check_intact(range_abs.min())) break;
+			st->cnt_retry++;
+		}
+		st->cnt_query++;
+	}
+}
+
+PushStat push_run(CircularBuffer& buf, double seconds)
+{
+	PushStat stat; double ns_sum = 0;
+	steady_clock::time_point t_end = steady_clock::now()
+	                               + duration_cast<steady_clock::duration>(duration<double>(seconds));
+	steady_clock::time_point t0, t1 = steady_clock::now();
+	while (t1 < t_end) {
+		float val = stat.cnt & 1023;
+		t0 = steady_clock::now();
+		buf.push(val, false);
+		t1 = steady_clock::now();
+		
+		double ns = duration<double, nano>(t1 - t0).count();
+		ns_sum += ns; stat.cnt++;
+		if (ns / 1000 > stat.us_max) stat.us_max = ns / 1000;
+		if (ns / 1000 > Slow_Push_Us) stat.cnt_slow++;
+	}
+	if (stat.cnt > 0) stat.ns_mean = ns_sum / stat.cnt;
+	return stat;
+}
+
+void print_row(unsigned int cnt_readers, const PushStat& stat, double seconds,
+               uint64_t cnt_query, uint64_t cnt_retry)
+{
+	cout << setw(8) << cnt_readers << setw(14) << (uint64_t)(stat.cnt / seconds)
+	     << setw(10) << fixed << setprecision(1) << stat.ns_mean
+	     << setw(12) << setprecision(1) << stat.us_max << setw(10) << stat.cnt_slow
+	     << setw(12) << (uint64_t)(cnt_query / seconds) << setw(10) << cnt_retry << endl;
+}
+
+double seconds_since(steady_clock::time_point t)
+{
+	return duration<double>(steady_clock::now() - t).count();
+}
+
+void run_throughput(CircularBuffer& buf)
+{
+	const uint64_t cnt_push = 8 * Buffer_Size;
+	steady_clock::time_point t = steady_clock::now();
+	for (uint64_t i = 0; i < cnt_push; i++)
+		buf.push(i & 1023, false);
+	double push_per_s = cnt_push / seconds_since(t);
+	
+	// ranges of the latest Reader_Range items, moved by a simple LCG
+	uint64_t cnt = buf.count(), seed = 1; double sum = 0;
+	vector<float> vals(Reader_Copy);
+	t = steady_clock::now();
+	for (unsigned int i = 0; i < Query_Count; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint64_t l = (seed >> 33) % (cnt - Reader_Range);
+		sum += buf.get_value_range(IndexRange(l, l + Reader_Range - 1)).length();
+	}
+	double range_per_s = Query_Count / seconds_since(t);
+	
+	t = steady_clock::now();
+	for (unsigned int i = 0; i < Query_Count; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint64_t l = (seed >> 33) % (cnt - Reader_Range);
+		sum += buf.get_average(IndexRange(l, l + Reader_Range - 1));
+	}
+	double average_per_s = Query_Count / seconds_since(t);
+	
+	t = steady_clock::now();
+	for (unsigned int i = 0; i < Query_Count; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint64_t l = (seed >> 33) % (cnt - Reader_Copy);
+		sum += buf.copy_range(buf.range_to_abs(IndexRange(l, l + Reader_Copy - 1)), 1, vals.data());
+	}
+	double copy_per_s = Query_Count / seconds_since(t);
+	result_sink = sum;
+	
+	cout << fixed << setprecision(0) << "push(): " << push_per_s << "/s, get_value_range(): "
+	     << range_per_s << "/s, get_average(): " << average_per_s << "/s, copy_range(): "
+	     << copy_per_s << "/s" << endl;
+}
+
+void run_contention(CircularBuffer& buf, unsigned int cnt_readers, double seconds)
+{
+	atomic_bool flag_stop(false);
+	vector<ReaderState> states(cnt_readers);
+	vector<thread> threads;
+	for (unsigned int i = 0; i < cnt_readers; i++) {
+		states[i].buf = &buf; states[i].flag_stop = &flag_stop;
+		threads.push_back(thread(reader_loop, &states[i]));
+	}
+	
+	PushStat stat = push_run(buf, seconds);
+	flag_stop = true;
+	for (unsigned int i = 0; i < cnt_readers; i++)
+		threads[i].join();
+	
+	uint64_t cnt_query = 0, cnt_retry = 0;
+	for (unsigned int i = 0; i < cnt_readers; i++) {
+		cnt_query += states[i].cnt_query; cnt_retry += states[i].cnt_retry;
+	}
+	print_row(cnt_readers, stat, seconds, cnt_query, cnt_retry);
+}
+
+int main(int argc, char** argv)
+{
+	unsigned int cnt_readers = (argc > 1)? atoi(argv[1]) : 4;
+	double seconds = (argc > 2)? atof(argv[2]) : 2;
+	if (seconds <= 0) seconds = 2;
+	
+	cout << "buffer of " << Buffer_Size << " items, "
+	     << thread::hardware_concurrency() << " hardware threads" << endl;
+	for (unsigned int p = CircularBuffer::Lock_Read_Write; p <= CircularBuffer::Lock_None; p++) {
+		CircularBuffer::LockPolicy policy = (CircularBuffer::LockPolicy)p;
+		CircularBuffer buf(Buffer_Size);
+		if (! buf.set_lock_policy(policy)) continue; //fixed at compile time
+		
+		cout << endl << Policy_Names[p] << endl;
+		run_throughput(buf);
+		if (policy == CircularBuffer::Lock_None) {
+			cout << "(no synchronization, push() latency with readers is not measured)" << endl;
+			continue;
+		}
+		
+		cout << setw(8) << "readers" << setw(14) << "pushes/s" << setw(10) << "mean ns"
+		     << setw(12) << "max us" << setw(10) << "slow" << setw(12) << "queries/s"
+		     << setw(10) << "retries" << endl;
+		run_contention(buf, 0, seconds);
+		for (unsigned int n = 1; n <= cnt_readers; n *= 2)
+			run_contention(buf, n, seconds);
+		if (cnt_readers & (cnt_readers - 1)) //not a power of 2
+			run_contention(buf, cnt_readers, seconds);
+	}
+	return 0;
+}
@@ -0,0 +1,120 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+// Licensed under LGPL version 2.1.
+
+#include <simple-cairo-plot/buffergroup.h>
+
+using namespace SimpleCairoPlot;
+
+BufferGroup::BufferGroup() {}
+
+BufferGroup::BufferGroup(unsigned int chan_cnt, uint64_t sz, const SampleType* types)
+{
+	this->init(chan_cnt, sz, types);
+}
+
+void BufferGroup::init(unsigned int chan_cnt, uint64_t sz, const SampleType* types)
+{
+	if (chan_cnt == 0)
+		throw std::invalid_argument("BufferGroup::init(): invalid channel count 0.");
+	if (this->bufs) return;
+	
+	this->seq_frame = 0;
+	this->bufs = new CircularBuffer[chan_cnt]; //throws bad_alloc
+	try {
+		for (unsigned int i = 0; i < chan_cnt; i++)
+			this->bufs[i].init(sz, types? types[i] : Sample_Float);
+	} catch (...) {
+		delete[] this->bufs; this->bufs = NULL;
+		throw;
+	}
+	this->chan_cnt = chan_cnt;
+	this->cnt = 0; this->cnt_overwrite = 0;
+	for (unsigned int i = 0; i < chan_cnt; i++)
+		this->bufs[i].seq_group = &this->seq_frame;
+}
+
+BufferGroup::~BufferGroup()
+{
+	if (this->bufs) delete[] this->bufs;
+}
+
+void BufferGroup::clear(bool clear_history_count)
+{
+	// channels lock themselves here, so it isn't done in a frame (see push()), and
+	// get_frame() checks their generations instead
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		this->bufs[i].clear(clear_history_count);
+	this->sync_count();
+}
+
+bool BufferGroup::resize(uint64_t sz)
+{
+	if (! this->bufs) return false;
+	
+	uint64_t sz_old = this->bufs[0].size(); unsigned int i = 0; bool suc = true;
+	try { //not done in a frame, see clear()
+		for (; i < this->chan_cnt && suc; i++)
+			suc = this->bufs[i].resize(sz);
+	} catch (std::bad_alloc&) {
+		suc = false;
+	}
+	if (! suc) { //restore sizes of resized channels, which are not written in the meantime
+		for (unsigned int j = 0; j < i; j++)
+			this->bufs[j].resize(sz_old);
+	}
+	this->sync_count();
+	return suc;
+}
+
+bool BufferGroup::get_frame(uint64_t i, float* frame_out) const
+{
+	unsigned int seq; bool suc;
+	do {
+		while ((seq = this->seq_frame.load(std::memory_order_acquire)) & 1)
+			std::this_thread::yield();
+		
+		// channels being cleared or resized one by one have different generations
+		unsigned int gen = this->bufs[0].generation();
+		suc = (i < this->cnt);
+		for (unsigned int ch = 0; suc && ch < this->chan_cnt; ch++) {
+			suc = (i < this->bufs[ch].count() && this->bufs[ch].generation() == gen);
+			if (suc) frame_out[ch] = this->bufs[ch].item(i);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while (this->seq_frame.load(std::memory_order_relaxed) != seq);
+	
+	return suc;
+}
+
+void BufferGroup::set_option_lock_free(bool set)
+{
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		this->bufs[i].set_option_lock_free(set);
+}
+
+bool BufferGroup::set_lock_policy(CircularBuffer::LockPolicy policy)
+{
+	bool suc = true;
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		suc = this->bufs[i].set_lock_policy(policy) && suc;
+	return suc;
+}
+
+void BufferGroup::set_option_compact_on_full(bool set)
+{
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		this->bufs[i].set_option_compact_on_full(set);
+}
+
+void BufferGroup::lock(bool for_writing)
+{
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		this->bufs[i].lock(for_writing);
+}
+
+void BufferGroup::unlock()
+{
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		this->bufs[i].unlock();
+}
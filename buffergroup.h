@@ -0,0 +1,202 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+// Licensed under LGPL version 2.1.
+
+#ifndef SIMPLE_CAIRO_PLOT_BUFFER_GROUP_H
+#define SIMPLE_CAIRO_PLOT_BUFFER_GROUP_H
+
+#include <simple-cairo-plot/circularbuffer.h>
+
+namespace SimpleCairoPlot
+{
+// channels of equal size sharing the same frame counter: a frame (an item for each
+// channel) is pushed by a single call, and frames can be read consistently across
+// channels. each channel is a CircularBuffer that can be shown by PlotArea; if items are
+// loaded into channels directly, call sync_count() at last (the count follows channel 0).
+// a frame is committed once for all channels: push() writes the items under the seqlock of
+// the group instead of those of the channels, and readers of a channel check both, so that
+// they never see a channel updated while another is not. channels should be written by a
+// single thread, and cleared or resized only through the group.
+class BufferGroup
+{
+public:
+	BufferGroup(); void init(unsigned int chan_cnt, uint64_t sz, const SampleType* types = NULL);
+	BufferGroup(unsigned int chan_cnt, uint64_t sz, const SampleType* types = NULL);
+	BufferGroup(const BufferGroup&) = delete;
+	BufferGroup& operator=(const BufferGroup&) = delete;
+	~BufferGroup();
+	
+	unsigned int channel_count() const;
+	CircularBuffer& channel(unsigned int i) const;
+	CircularBuffer& operator[](unsigned int i) const;
+	
+	// amount of complete frames
+	uint64_t size() const;
+	uint64_t count() const;
+	IndexRange range() const;
+	IndexRange range_max() const;
+	bool is_full() const;
+	uint64_t count_overwritten() const;
+	uint64_t count_overall() const;
+	
+	void push(const float* frame, bool spike_check = true); //an item for each channel
+	bool is_alloc_failed() const; //the whole frame is dropped, see CircularBuffer::is_alloc_failed()
+	void clear(bool clear_history_count = false);
+	bool get_frame(uint64_t i, float* frame_out) const; //false if item i doesn't exist, or while clearing/resizing
+	void sync_count();
+	bool resize(uint64_t sz); //see CircularBuffer::resize(); throws bad_alloc
+	
+	void set_option_lock_free(bool set); //see CircularBuffer::set_option_lock_free()
+	bool set_lock_policy(CircularBuffer::LockPolicy policy); //see CircularBuffer::set_lock_policy()
+	void set_option_compact_on_full(bool set); //channels are compacted at the same frame
+	uint64_t sample_stride() const; //see CircularBuffer::sample_stride()
+	uint64_t sample_index(uint64_t i) const;
+	
+	// locks all channels, see CircularBuffer::lock()
+	void lock(bool for_writing = false);
+	void unlock();
+	
+private:
+	unsigned int chan_cnt = 0;
+	CircularBuffer* bufs = NULL;
+	
+	// copied from the channels after each frame is pushed
+	volatile uint64_t cnt = 0;
+	volatile uint64_t cnt_overwrite = 0;
+	std::atomic_uint seq_frame; //odd while a frame is being pushed (seqlock), shared with the channels
+	
+	bool push_lock_needed(unsigned int i) const;
+	void frame_begin();
+	void frame_end();
+};
+
+inline unsigned int BufferGroup::channel_count() const
+{
+	return this->chan_cnt;
+}
+
+inline CircularBuffer& BufferGroup::channel(unsigned int i) const
+{
+	if (i >= this->chan_cnt)
+		throw std::out_of_range("BufferGroup::channel(): index exceeds the channel count.");
+	return this->bufs[i];
+}
+
+inline CircularBuffer& BufferGroup::operator[](unsigned int i) const
+{
+	return this->channel(i);
+}
+
+inline uint64_t BufferGroup::size() const
+{
+	if (! this->bufs) return 0;
+	return this->bufs[0].size();
+}
+
+inline uint64_t BufferGroup::count() const
+{
+	return this->cnt;
+}
+
+inline IndexRange BufferGroup::range() const
+{
+	uint64_t cnt = this->cnt;
+	if (cnt > 0)
+		return IndexRange(0, cnt - 1);
+	else
+		return IndexRange();
+}
+
+inline IndexRange BufferGroup::range_max() const
+{
+	if (! this->bufs) return IndexRange();
+	return this->bufs[0].range_max();
+}
+
+inline bool BufferGroup::is_full() const
+{
+	return this->bufs && this->cnt == this->bufs[0].size();
+}
+
+inline uint64_t BufferGroup::count_overwritten() const
+{
+	return this->cnt_overwrite;
+}
+
+inline uint64_t BufferGroup::count_overall() const
+{
+	return this->cnt + this->cnt_overwrite;
+}
+
+inline uint64_t BufferGroup::sample_stride() const
+{
+	if (! this->bufs) return 1;
+	return this->bufs[0].sample_stride();
+}
+
+inline uint64_t BufferGroup::sample_index(uint64_t i) const
+{
+	if (! this->bufs) return i;
+	return this->bufs[0].sample_index(i);
+}
+
+inline void BufferGroup::push(const float* frame, bool spike_check)
+{
+	// storage is allocated for all channels first, so a frame is either pushed or dropped.
+	// channels that need locking (not lock-free, or being compacted) are locked before the
+	// seqlock becomes odd, otherwise the writer could wait for a reader waiting for it
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		if (! this->bufs[i].push_reserve()) return;
+	bool flag_lock = false;
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		if (this->push_lock_needed(i)) {
+			flag_lock = true; break;
+		}
+	if (flag_lock) this->lock(true);
+	
+	this->frame_begin();
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		this->bufs[i].push_value(frame[i], spike_check);
+	this->frame_end();
+	if (flag_lock) this->unlock();
+}
+
+inline bool BufferGroup::is_alloc_failed() const
+{
+	for (unsigned int i = 0; i < this->chan_cnt; i++)
+		if (this->bufs[i].is_alloc_failed()) return true;
+	return false;
+}
+
+inline void BufferGroup::sync_count()
+{
+	if (! this->bufs) return;
+	this->frame_begin(); this->frame_end();
+}
+
+/*------------------------------ private functions ------------------------------*/
+
+inline bool BufferGroup::push_lock_needed(unsigned int i) const
+{
+	const CircularBuffer& buf = this->bufs[i];
+	if (buf.lock_policy() == CircularBuffer::Lock_Seq) return buf.compact_next(); //readers are excluded while compacting
+	return buf.lock_policy() != CircularBuffer::Lock_None;
+}
+
+inline void BufferGroup::frame_begin()
+{
+	this->seq_frame.store(this->seq_frame.load(std::memory_order_relaxed) + 1,
+	                      std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void BufferGroup::frame_end()
+{
+	this->cnt = this->bufs[0].count();
+	this->cnt_overwrite = this->bufs[0].count_overwritten();
+	this->seq_frame.store(this->seq_frame.load(std::memory_order_relaxed) + 1,
+	                      std::memory_order_release);
+}
+
+}
+#endif
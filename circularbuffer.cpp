@@ -3,54 +3,489 @@
 // Licensed under LGPL version 2.1.
 
 #include <simple-cairo-plot/circularbuffer.h>
+#include <simple-cairo-plot/historystore.h>
 
 #include <cstring> //memcpy()
 #include <limits> //numeric_limits<float>
 
+#ifdef _WIN32
+	#define NOMINMAX
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h> //CreateFileMapping()
+#else
+	#include <sys/mman.h> //mmap()
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+	#define SCAN_KERNELS_X86
+	#include <immintrin.h>
+#endif
+
 using namespace SimpleCairoPlot;
 
-void CircularBuffer::init(unsigned int sz)
+/*------------------------------ scanning kernels ------------------------------*/
+
+// these functions work on a contiguous piece of a storage segment, so there is
+// no wrapping branch inside; the AVX2 versions are selected at runtime if supported.
+
+typedef void (*ScanMinMaxFunc)(const float* p, unsigned int n, float& min, float& max);
+typedef void (*ScanSumsFunc)(const float* p, unsigned int n, double& sum, double& sq_sum);
+
+static void scan_min_max_scalar(const float* p, unsigned int n, float& min, float& max)
+{
+	float mn = min, mx = max;
+	for (const float* p_end = p + n; p < p_end; p++) {
+		if (*p < mn) mn = *p;
+		if (*p > mx) mx = *p;
+	}
+	min = mn; max = mx;
+}
+
+static void scan_sums_scalar(const float* p, unsigned int n, double& sum, double& sq_sum)
+{
+	double s = 0, sq = 0;
+	for (const float* p_end = p + n; p < p_end; p++) {
+		s += *p; sq += (double)*p * *p;
+	}
+	sum += s; sq_sum += sq;
+}
+
+#ifdef SCAN_KERNELS_X86
+
+static void scan_min_max_sse2(const float* p, unsigned int n, float& min, float& max)
+{
+	if (n < 8) {scan_min_max_scalar(p, n, min, max); return;}
+	
+	__m128 v_min = _mm_set1_ps(min), v_max = _mm_set1_ps(max), v;
+	unsigned int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_ps(p + i);
+		v_min = _mm_min_ps(v_min, v); v_max = _mm_max_ps(v_max, v);
+	}
+	
+	float a_min[4], a_max[4];
+	_mm_storeu_ps(a_min, v_min); _mm_storeu_ps(a_max, v_max);
+	for (unsigned int j = 0; j < 4; j++) {
+		if (a_min[j] < min) min = a_min[j];
+		if (a_max[j] > max) max = a_max[j];
+	}
+	scan_min_max_scalar(p + i, n - i, min, max);
+}
+
+static void scan_sums_sse2(const float* p, unsigned int n, double& sum, double& sq_sum)
+{
+	__m128d v_sum = _mm_setzero_pd(), v_sq_sum = _mm_setzero_pd(), v;
+	unsigned int i;
+	for (i = 0; i + 2 <= n; i += 2) {
+		v = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(p + i))));
+		v_sum = _mm_add_pd(v_sum, v); v_sq_sum = _mm_add_pd(v_sq_sum, _mm_mul_pd(v, v));
+	}
+	
+	double a_sum[2], a_sq_sum[2];
+	_mm_storeu_pd(a_sum, v_sum); _mm_storeu_pd(a_sq_sum, v_sq_sum);
+	sum += a_sum[0] + a_sum[1]; sq_sum += a_sq_sum[0] + a_sq_sum[1];
+	scan_sums_scalar(p + i, n - i, sum, sq_sum);
+}
+
+__attribute__((target("avx2")))
+static void scan_min_max_avx2(const float* p, unsigned int n, float& min, float& max)
+{
+	if (n < 32) {scan_min_max_sse2(p, n, min, max); return;}
+	
+	// two pairs of accumulators hide the latency of min/max instructions
+	__m256 v_min1 = _mm256_set1_ps(min), v_max1 = _mm256_set1_ps(max),
+	       v_min2 = v_min1, v_max2 = v_max1, v1, v2;
+	unsigned int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		v1 = _mm256_loadu_ps(p + i); v2 = _mm256_loadu_ps(p + i + 8);
+		v_min1 = _mm256_min_ps(v_min1, v1); v_max1 = _mm256_max_ps(v_max1, v1);
+		v_min2 = _mm256_min_ps(v_min2, v2); v_max2 = _mm256_max_ps(v_max2, v2);
+	}
+	v_min1 = _mm256_min_ps(v_min1, v_min2); v_max1 = _mm256_max_ps(v_max1, v_max2);
+	
+	float a_min[8], a_max[8];
+	_mm256_storeu_ps(a_min, v_min1); _mm256_storeu_ps(a_max, v_max1);
+	for (unsigned int j = 0; j < 8; j++) {
+		if (a_min[j] < min) min = a_min[j];
+		if (a_max[j] > max) max = a_max[j];
+	}
+	scan_min_max_scalar(p + i, n - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static void scan_sums_avx2(const float* p, unsigned int n, double& sum, double& sq_sum)
+{
+	__m256d v_sum = _mm256_setzero_pd(), v_sq_sum = _mm256_setzero_pd(), v;
+	unsigned int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm256_cvtps_pd(_mm_loadu_ps(p + i));
+		v_sum = _mm256_add_pd(v_sum, v); v_sq_sum = _mm256_add_pd(v_sq_sum, _mm256_mul_pd(v, v));
+	}
+	
+	double a_sum[4], a_sq_sum[4];
+	_mm256_storeu_pd(a_sum, v_sum); _mm256_storeu_pd(a_sq_sum, v_sq_sum);
+	sum += (a_sum[0] + a_sum[1]) + (a_sum[2] + a_sum[3]);
+	sq_sum += (a_sq_sum[0] + a_sq_sum[1]) + (a_sq_sum[2] + a_sq_sum[3]);
+	scan_sums_scalar(p + i, n - i, sum, sq_sum);
+}
+
+static bool cpu_supports_avx2()
+{
+	__builtin_cpu_init(); //required if it's called before constructors
+	return __builtin_cpu_supports("avx2");
+}
+
+static const bool Flag_AVX2 = cpu_supports_avx2();
+static const ScanMinMaxFunc scan_seg_min_max = Flag_AVX2? scan_min_max_avx2 : scan_min_max_sse2;
+static const ScanSumsFunc scan_seg_sums = Flag_AVX2? scan_sums_avx2 : scan_sums_sse2;
+
+#else
+
+static const ScanMinMaxFunc scan_seg_min_max = scan_min_max_scalar;
+static const ScanSumsFunc scan_seg_sums = scan_sums_scalar;
+
+#endif
+
+// for items of other types; simple loops like these are vectorized by the compiler.
+// results are converted to values by the caller.
+
+template <typename T>
+static void scan_raw_min_max(const T* p, unsigned int n, double& min, double& max)
+{
+	T mn = p[0], mx = p[0];
+	for (const T* p_end = p + n; p < p_end; p++) {
+		if (*p < mn) mn = *p;
+		if (*p > mx) mx = *p;
+	}
+	min = mn; max = mx;
+}
+
+template <typename T>
+static void scan_raw_sums(const T* p, unsigned int n, double& sum, double& sq_sum)
+{
+	double s = 0, sq = 0;
+	for (const T* p_end = p + n; p < p_end; p++) {
+		s += *p; sq += (double)*p * *p;
+	}
+	sum = s; sq_sum = sq;
+}
+
+template <typename T>
+static void raw_to_values(const T* p, unsigned int n, double scale, double offset, float* out)
+{
+	for (unsigned int i = 0; i < n; i++)
+		out[i] = p[i] * scale + offset;
+}
+
+template <typename T>
+static void raw_to_values_step(const T* p, unsigned int n, unsigned int step, double scale, double offset, float* out)
+{
+	for (unsigned int i = 0; i < n; i++)
+		out[i] = p[(std::size_t)i * step] * scale + offset;
+}
+
+/*------------------------------ file mapping ------------------------------*/
+
+static const char File_Magic[8] = {'S', 'C', 'P', 'B', 'U', 'F', '2', '\0'}; //2: 64-bit sizes
+
+static inline std::size_t align_size(std::size_t sz)
+{
+	return (sz + 63) & ~(std::size_t)63;
+}
+
+#ifdef _WIN32
+
+// the file handles can be closed after the view is mapped
+static void* map_file(const std::string& file_path, std::size_t size, bool& flag_new, const char*& err)
+{
+	HANDLE h_file = CreateFileA(file_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+	                            NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h_file == INVALID_HANDLE_VALUE) {err = "failed to open the file"; return NULL;}
+	
+	LARGE_INTEGER file_size;
+	if (! GetFileSizeEx(h_file, &file_size)) file_size.QuadPart = -1;
+	flag_new = (file_size.QuadPart == 0);
+	if (! flag_new && (uint64_t)file_size.QuadPart != size) {
+		CloseHandle(h_file); err = "the file is not a buffer of the same size and type"; return NULL;
+	}
+	
+	HANDLE h_map = CreateFileMappingA(h_file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+	                                  (DWORD)size, NULL); //extends the file
+	void* p = NULL;
+	if (h_map != NULL) {
+		p = MapViewOfFile(h_map, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		CloseHandle(h_map);
+	}
+	CloseHandle(h_file);
+	if (p == NULL) err = "failed to map the file";
+	return p;
+}
+
+static void unmap_file(void* p, std::size_t size)
+{
+	FlushViewOfFile(p, 0);
+	UnmapViewOfFile(p);
+}
+
+static bool sync_file_map(void* p, std::size_t size, bool wait)
+{
+	return FlushViewOfFile(p, 0) != 0; //it doesn't wait for the disk anyway
+}
+
+#else
+
+// the file descriptor can be closed after mmap()
+static void* map_file(const std::string& file_path, std::size_t size, bool& flag_new, const char*& err)
+{
+	int fd = open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {err = "failed to open the file"; return NULL;}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0) st.st_size = -1;
+	flag_new = (st.st_size == 0);
+	if (! flag_new && (std::size_t)st.st_size != size) {
+		close(fd); err = "the file is not a buffer of the same size and type"; return NULL;
+	}
+	if (flag_new && ftruncate(fd, size) != 0) { //the extended part is filled with zero
+		close(fd); err = "failed to extend the file"; return NULL;
+	}
+	
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {err = "failed to map the file"; return NULL;}
+	return p;
+}
+
+static void unmap_file(void* p, std::size_t size)
+{
+	munmap(p, size); //changes are written back by the kernel
+}
+
+static bool sync_file_map(void* p, std::size_t size, bool wait)
+{
+	return msync(p, size, wait? MS_SYNC : MS_ASYNC) == 0;
+}
+
+#endif
+
+// segments not allocated yet point to this, so that readers never read invalid memory
+static unsigned char seg_zero[CircularBuffer::Segment_Size * sizeof(double)];
+
+void CircularBuffer::init(uint64_t sz, SampleType type)
 {
 	if (sz == 0)
 		throw std::invalid_argument("CircularBuffer::init(): invalid buffer size 0.");
+	if (((sz - 1) >> Segment_Size_Bits) >= UINT32_MAX) //see resize()
+		throw std::invalid_argument("CircularBuffer::init(): the buffer size is too large.");
 	
-	this->read_lock_counter = 0;
+	this->read_lock_counter = 0; this->seq_write = 0;
 	this->lock(true);
 	
-	if (this->buf != NULL) {delete[] this->buf; this->buf = NULL;}
-	if (this->buf_spike != NULL) {delete[] this->buf_spike; this->buf_spike = NULL;}
-	
-	this->bufsize = sz;
-	this->buf_spike_size = this->bufsize / 32;
-	if (this->buf_spike_size < 16) this->buf_spike_size = 16;
+	this->storage_free();
+	this->storage_layout(sz, type);
+	uint64_t index_mm_cnt = this->index_layout();
 	
+	// segments of items are allocated when they are reached by the writer
 	bool except_caught = false;
 	try {
-		this->buf_spike = new unsigned long int[this->buf_spike_size];
-		this->buf = new float[this->bufsize];
-	} catch (std::bad_alloc) {
+		this->buf_spike = new uint64_t[this->buf_spike_size];
+		this->seg_table = this->seg_table_new((this->bufsize + Segment_Size - 1) >> Segment_Size_Bits);
+		this->index_mm = new MinMax[index_mm_cnt];
+		this->index_sums = new Sums[this->index_mm_mask[0] + 1];
+	} catch (std::bad_alloc&) {
 		except_caught = true;
 	}
-	if (except_caught || this->buf == NULL || this->buf_spike == NULL) {
-		if (this->buf_spike) {delete[] this->buf_spike; this->buf_spike = NULL;}
+	if (except_caught || this->seg_table == NULL || this->buf_spike == NULL
+	||  this->index_mm == NULL || this->index_sums == NULL) {
+		this->storage_free();
 		this->unlock(); throw std::bad_alloc();
 	}
 	
-	for (unsigned int i = 0; i < this->bufsize; i++)
-		this->buf[i] = 0;
-	
-	this->bufend = this->buf + this->bufsize - 1;
 	this->buf_spike_bufend = this->buf_spike + this->buf_spike_size - 1;
+	this->index_set_levels();
 	
 	this->unlock();
 	this->clear(true);
 }
 
+void CircularBuffer::init(const std::string& file_path, uint64_t sz, SampleType type)
+{
+	if (sz == 0)
+		throw std::invalid_argument("CircularBuffer::init(): invalid buffer size 0.");
+	if (((sz - 1) >> Segment_Size_Bits) >= UINT32_MAX) //see resize()
+		throw std::invalid_argument("CircularBuffer::init(): the buffer size is too large.");
+	
+	this->read_lock_counter = 0; this->seq_write = 0;
+	this->lock(true);
+	
+	this->storage_free();
+	this->storage_layout(sz, type);
+	uint64_t index_mm_cnt = this->index_layout();
+	
+	// header, items, spike buffer, min/max index and prefix sums, aligned by 64 bytes
+	std::size_t off_buf = align_size(sizeof(FileHeader)),
+	            off_spike = off_buf + align_size((std::size_t)this->bufsize * this->item_size),
+	            off_mm = off_spike + align_size(this->buf_spike_size * sizeof(uint64_t)),
+	            off_sums = off_mm + align_size(index_mm_cnt * sizeof(MinMax)),
+	            map_size = off_sums + (this->index_mm_mask[0] + 1) * sizeof(Sums);
+	
+	bool flag_new; const char* err = NULL;
+	unsigned char* p = (unsigned char*)map_file(file_path, map_size, flag_new, err);
+	FileHeader* hdr = (FileHeader*)p;
+	if (p && !flag_new) {
+		if (memcmp(hdr->magic, File_Magic, sizeof(hdr->magic)) != 0
+		||  hdr->header_size != sizeof(FileHeader) || hdr->item_type != this->type
+		||  hdr->bufsize != this->bufsize || hdr->buf_spike_size != this->buf_spike_size
+		||  hdr->index_mm_cnt != index_mm_cnt) {
+			unmap_file(p, map_size); p = NULL;
+			err = "the file is not a buffer of the same size and type";
+		}
+	}
+	if (p == NULL) {
+		this->unlock();
+		throw std::runtime_error(std::string("CircularBuffer::init(): ") + err + ": " + file_path);
+	}
+	
+	try {
+		this->seg_table = this->seg_table_new((this->bufsize + Segment_Size - 1) >> Segment_Size_Bits);
+	} catch (std::bad_alloc&) {
+		unmap_file(p, map_size);
+		this->unlock(); throw;
+	}
+	for (unsigned int i = 0; i < this->seg_table->cnt; i++) //items are contiguous in the file
+		this->seg_table->segs[i] = p + off_buf + ((std::size_t)i << Segment_Size_Bits) * this->item_size;
+	
+	this->file_hdr = hdr; this->file_map_size = map_size;
+	this->buf_spike = (uint64_t*)(p + off_spike);
+	this->buf_spike_bufend = this->buf_spike + this->buf_spike_size - 1;
+	this->index_mm = (MinMax*)(p + off_mm);
+	this->index_sums = (Sums*)(p + off_sums);
+	this->index_set_levels();
+	
+	if (flag_new) { //the file is filled with zero
+		memcpy(hdr->magic, File_Magic, sizeof(hdr->magic));
+		hdr->header_size = sizeof(FileHeader); hdr->item_type = this->type;
+		hdr->bufsize = this->bufsize; hdr->buf_spike_size = this->buf_spike_size;
+		hdr->index_mm_cnt = index_mm_cnt;
+		this->scale = 1; this->offset = 0; this->scale_inv = 1;
+		this->unlock();
+		this->clear(true); //the header is saved here
+		this->sync_file();
+		return;
+	}
+	
+	// reattach
+	this->scale = hdr->scale; this->offset = hdr->offset; this->scale_inv = 1.0 / hdr->scale;
+	this->spike_check_ref_min = hdr->spike_check_ref_min;
+	this->spike_check_av = hdr->spike_check_av;
+	this->cnt = hdr->cnt; this->pos_end = hdr->pos_end;
+	this->cnt_overwrite = hdr->cnt_overwrite;
+	this->sample_stride_cnt = 1; this->sample_first = hdr->cnt_overwrite; this->pair_cnt = 0;
+	this->buf_spike_cnt = hdr->buf_spike_cnt;
+	this->buf_spike_end = this->buf_spike + hdr->buf_spike_end;
+	this->option_spike_check = hdr->option_spike_check;
+	this->spike_run_cnt = hdr->spike_run_cnt; this->i_abs_spike_next = hdr->i_abs_spike_next;
+	this->spike_prev[0] = hdr->spike_prev[0]; this->spike_prev[1] = hdr->spike_prev[1];
+	this->sums_run = hdr->sums_run; this->sums_comp = hdr->sums_comp;
+	this->i_abs_sums_reset = hdr->i_abs_sums_reset;
+	this->file_sync_last = this->count_overall();
+	
+	this->unlock();
+}
+
+bool CircularBuffer::sync_file(bool wait)
+{
+	if (! this->file_hdr) return false;
+	this->lock();
+	bool suc = sync_file_map(this->file_hdr, this->file_map_size, wait);
+	this->unlock();
+	return suc;
+}
+
+void CircularBuffer::storage_layout(uint64_t sz, SampleType type)
+{
+	this->bufsize = sz;
+	this->type = type;
+	switch (type) {
+		case Sample_Int16: this->item_size = sizeof(int16_t); break;
+		case Sample_Int32: this->item_size = sizeof(int32_t); break;
+		case Sample_Float: this->item_size = sizeof(float); break;
+		default:           this->item_size = sizeof(double); this->type = Sample_Double; break;
+	}
+	this->buf_spike_size = (this->bufsize / 32 < UINT32_MAX)? this->bufsize / 32 : UINT32_MAX;
+	if (this->buf_spike_size < 16) this->buf_spike_size = 16;
+}
+
+void CircularBuffer::storage_free()
+{
+	if (this->history) {delete this->history; this->history = NULL;}
+	this->windows_reset();
+	
+	if (this->file_hdr) {
+		this->file_header_save();
+		unmap_file(this->file_hdr, this->file_map_size);
+		this->file_hdr = NULL; this->file_map_size = 0;
+		this->buf_spike = NULL;
+		this->index_mm = NULL; this->index_sums = NULL;
+	} else if (this->seg_table != NULL) {
+		for (unsigned int i = 0; i < this->seg_table->cnt; i++)
+			if (this->seg_table->segs[i] != seg_zero) delete[] this->seg_table->segs[i];
+	}
+	
+	for (unsigned int i = 0; i < this->seg_pool.size(); i++)
+		delete[] this->seg_pool[i];
+	this->seg_pool.clear();
+	if (this->seg_table != NULL) this->seg_tables_old.push_back((SegTable*)this->seg_table);
+	for (unsigned int i = 0; i < this->seg_tables_old.size(); i++) {
+		delete[] this->seg_tables_old[i]->segs; delete this->seg_tables_old[i];
+	}
+	this->seg_tables_old.clear(); this->seg_table = NULL;
+	
+	if (this->buf_spike != NULL) {delete[] this->buf_spike; this->buf_spike = NULL;}
+	if (this->index_mm != NULL) {delete[] this->index_mm; this->index_mm = NULL;}
+	if (this->index_sums != NULL) {delete[] this->index_sums; this->index_sums = NULL;}
+	if (this->hist_prefix != NULL) {delete[] this->hist_prefix; this->hist_prefix = NULL;}
+	if (this->hist_run != NULL) {delete[] this->hist_run; this->hist_run = NULL;}
+	this->hist_bins = 0;
+}
+
+uint64_t CircularBuffer::index_layout()
+{
+	uint64_t index_mm_cnt = 0;
+	
+	this->index_levels = 0;
+	for (unsigned int lv = 0; lv < Index_Levels_Max; lv++) {
+		uint64_t cnt_node = (uint64_t)Block_Size << lv; //items in a node
+		uint64_t ring = 1;
+		while (ring < this->bufsize / cnt_node + 2) ring <<= 1;
+		this->index_mm_mask[lv] = ring - 1; index_mm_cnt += ring;
+		this->index_levels++;
+		if (cnt_node >= this->bufsize) break;
+	}
+	return index_mm_cnt;
+}
+
+void CircularBuffer::index_set_levels()
+{
+	MinMax* p = this->index_mm;
+	for (unsigned int lv = 0; lv < this->index_levels; lv++) {
+		this->index_mm_lv[lv] = p; p += this->index_mm_mask[lv] + 1;
+	}
+}
+
 CircularBuffer::CircularBuffer() {}
 
-CircularBuffer::CircularBuffer(unsigned int sz)
+CircularBuffer::CircularBuffer(uint64_t sz, SampleType type)
 {
-	this->init(sz);
+	this->init(sz, type);
+}
+
+CircularBuffer::CircularBuffer(const std::string& file_path, uint64_t sz, SampleType type)
+{
+	this->init(file_path, sz, type);
 }
 
 void CircularBuffer::copy_from(const CircularBuffer& from)
@@ -58,38 +493,64 @@ void CircularBuffer::copy_from(const CircularBuffer& from)
 	this->clear(true);
 	if (from.cnt == 0) return;
 	
-	this->lock(true);
+	this->lock(true); this->write_begin();
 	
-	unsigned int cnt_cpy = from.cnt; //actual amount of data to be copied
+	uint64_t cnt_cpy = from.cnt; //actual amount of data to be copied
 	if (cnt_cpy > this->bufsize)
 		cnt_cpy = this->bufsize;
 	IndexRange range_cpy(from.count() - cnt_cpy, from.count() - 1);
 	
-	BufRangeMap map = from.map_from(range_cpy);
-	memcpy(this->buf, from.buf + map.former.min(), map.former.count()*sizeof(float));
-	if (map.latter)
-		memcpy(this->buf + map.former.count(), from.buf + map.latter.min(),
-		       map.latter.count()*sizeof(float));
+	this->seg_alloc(0, cnt_cpy);
+	if (from.type == this->type && from.scale == this->scale && from.offset == this->offset) {
+		uint64_t pos_from = from.item_pos(range_cpy.min()), pos = 0;
+		for (uint64_t i = 0, n; i < cnt_cpy; i += n) {
+			n = from.pos_seg_len(pos_from, this->pos_seg_len(pos, cnt_cpy - i));
+			memcpy(this->pos_addr(pos), from.pos_addr(pos_from), n * this->item_size);
+			pos = this->pos_inc(pos, n); pos_from = from.pos_inc(pos_from, n);
+		}
+	} else {
+		for (uint64_t i = 0; i < cnt_cpy; i++)
+			this->item_store(this->pos_addr(i), from.item(range_cpy.min() + i));
+	}
 	
 	this->cnt = cnt_cpy;
-	this->end = this->ptr_inc(this->buf, cnt_cpy);
+	this->pos_end = this->pos_inc(0, cnt_cpy);
+	this->sample_stride_cnt = from.sample_stride_cnt;
+	this->sample_first = from.sample_index(range_cpy.min());
+	this->pair_cnt = from.pair_cnt; this->pair_min_first = from.pair_min_first;
+	this->pair_min = from.pair_min; this->pair_max = from.pair_max;
 	
 	// copy the spike buffer only when both spike buffers have equal size
 	if (from.bufsize == this->bufsize) {
 		this->cnt_overwrite = from.cnt_overwrite + (from.cnt - cnt_cpy);
 		memcpy(this->buf_spike, from.buf_spike,
-			   this->buf_spike_size*sizeof(unsigned long int));
+			   this->buf_spike_size*sizeof(uint64_t));
 		this->spike_check_ref_min = from.spike_check_ref_min;
 		this->buf_spike_cnt = from.buf_spike_cnt;
-		this->buf_spike_end = from.buf_spike_end;
+		this->buf_spike_end = this->buf_spike + (from.buf_spike_end - from.buf_spike);
+		this->spike_check_av = from.spike_check_av;
+		this->option_spike_check = from.option_spike_check;
+		this->i_abs_spike_next = from.i_abs_spike_next;
+		this->spike_run_cnt = from.spike_run_cnt;
+		this->spike_prev[0] = from.spike_prev[0]; this->spike_prev[1] = from.spike_prev[1];
+	} else {
+		this->option_spike_check = from.option_spike_check;
+		this->i_abs_spike_next = this->cnt_overwrite; //all items will be checked
 	}
 	
-	this->unlock();
+	this->i_abs_sums_reset = this->i_abs_hist_reset = this->cnt_overwrite;
+	for (uint64_t i = 0, n; i < cnt_cpy; i += n) {
+		n = this->pos_seg_len(i, cnt_cpy - i);
+		this->index_load(this->pos_addr(i), n, this->cnt_overwrite + i);
+	}
+	
+	this->write_end(); this->unlock();
 }
 
 CircularBuffer::CircularBuffer(CircularBuffer& from)
 {
-	this->init(from.bufsize);
+	this->init(from.bufsize, from.type);
+	this->set_scale(from.scale, from.offset);
 	from.lock();
 	this->copy_from(from);
 	from.unlock();
@@ -97,7 +558,8 @@ CircularBuffer::CircularBuffer(CircularBuffer& from)
 
 CircularBuffer::CircularBuffer(const CircularBuffer& from)
 {
-	this->init(from.bufsize);
+	this->init(from.bufsize, from.type);
+	this->set_scale(from.scale, from.offset);
 	this->copy_from(from);
 }
 
@@ -109,274 +571,1665 @@ CircularBuffer& CircularBuffer::operator=(const CircularBuffer& buf)
 
 CircularBuffer::~CircularBuffer()
 {
-	if (this->buf != NULL) delete[] this->buf;
+	this->storage_free();
+	
+	for (unsigned int i = 0; i < Windows_Max; i++)
+		if (this->windows[i].deq[0]) this->window_deqs_old.push_back(this->windows[i].deq[0]);
+	for (unsigned int i = 0; i < this->window_deqs_old.size(); i++)
+		delete[] this->window_deqs_old[i];
+}
+
+bool CircularBuffer::set_scale(float scale, float offset)
+{
+	if (scale <= 0) return false; //a negative scale would swap min and max in the index
+	
+	this->lock(true); this->write_begin();
+	this->scale = scale; this->offset = offset; this->scale_inv = 1.0 / scale;
+	if (this->history) {
+		this->history->clear(); this->history->set_scale(scale, offset);
+	}
+	this->write_end(); this->unlock();
+	
+	this->clear(); //existing items and the index can't be interpreted with new scale
+	return true;
 }
 
 void CircularBuffer::clear(bool clear_count_history)
 {
 	this->lock(true);
+	this->generation_cnt = this->generation_cnt + 1; //made visible by the fence in write_begin()
+	this->write_begin();
 	
-	this->cnt = 0;
-	if (clear_count_history)
-		this->cnt_overwrite = 0;
-	this->end = this->buf;
-	this->buf[0] = 0;
+	this->cnt = 0; this->flag_alloc_failed = false;
+	if (clear_count_history) {
+		this->cnt_overwrite = 0; this->sample_first = 0;
+	} //otherwise the next item takes the place of the first item cleared, like cnt_overwrite
+	this->pos_end = 0;
+	this->sample_stride_cnt = 1; this->pair_cnt = 0;
+	if (this->seg_table->segs[0] != seg_zero)
+		memset(this->seg_table->segs[0], 0, this->item_size);
 	
 	this->buf_spike_cnt = 0;
 	this->buf_spike_end = this->buf_spike;
 	this->spike_check_av = 0;
+	this->i_abs_spike_next = this->cnt_overwrite; this->spike_run_cnt = 0;
+	this->spike_prev[0] = this->spike_prev[1] = 0;
 	
-	this->last_min_max_scan = MinMaxScanInfo();
-	this->last_av_calc = AvCalcInfo();
+	if (this->history) //the history may contain items just cleared
+		this->history->truncate(this->cnt_overwrite);
+	this->i_abs_history_next = this->cnt_overwrite;
 	
-	this->unlock();
+	this->index_sums_reset();
+	this->windows_reset();
+	
+	this->write_end(); this->unlock();
 }
 
 void CircularBuffer::erase()
 {
-	if (this->buf == NULL) return;
+	if (this->seg_table == NULL) return;
 	this->clear(true);
 	
-	this->lock();
-	for (unsigned int i = 0; i < this->bufsize; i++)
-		this->buf[i] = 0;
-	this->unlock();
+	this->lock(true); this->write_begin();
+	for (uint64_t i = 0; i < this->bufsize; i += Segment_Size)
+		if (this->seg_table->segs[i >> Segment_Size_Bits] != seg_zero)
+			memset(this->pos_addr(i), 0, this->pos_seg_len(i, Segment_Size) * this->item_size);
+	this->write_end(); this->unlock();
 }
 
-void CircularBuffer::load(const float* data, unsigned int cnt, bool spike_check)
+bool CircularBuffer::resize(uint64_t sz)
 {
-	if (data == NULL || cnt == 0) return;
-	this->lock(true);
-	
-	unsigned int cnt_load = cnt; //actual amount of data to be read and loaded
-	if (cnt_load > this->bufsize)
-		cnt_load = this->bufsize;
+	if (this->seg_table == NULL || this->file_hdr || sz == 0) return false;
 	
-	const float* pf, * pf_end; //pointer of data to be read
-	pf_end = data + cnt - 1;
-	pf = pf_end - cnt_load + 1;
+	this->lock(true);
+	const SegTable* table = this->seg_table;
+	uint64_t pos = this->pos_end, i_seg = pos >> Segment_Size_Bits, r = pos & (Segment_Size - 1);
+	SegTable* table_new = NULL; unsigned char* seg_split = NULL;
 	
-	if (spike_check) {
-		for (pf; pf <= pf_end; pf++)
-			this->push(*pf, true, false);
-		this->cnt_overwrite += cnt - cnt_load;
-	} else {
-		BufRangeMap map = this->map_from(IndexRange(0, cnt_load - 1));
-		memcpy(this->buf + map.former.min(), pf, map.former.count()*sizeof(float));
-		if (map.latter)
-			memcpy(this->buf + map.latter.min(), pf + map.former.count(),
-			       map.latter.count()*sizeof(float));
+	if (sz > this->bufsize) {
+		// new segments are inserted after the segment containing pos_end. if pos_end isn't
+		// at the beginning of a segment, the oldest items in that segment are copied into
+		// the last new segment, at the same offsets
+		uint64_t cnt_seg = ((sz - this->bufsize - 1) >> Segment_Size_Bits) + 1;
+		if (cnt_seg > UINT32_MAX - table->cnt) { //the segment table is limited to 2^32 segments
+			this->unlock(); return false;
+		}
+		try {
+			table_new = this->seg_table_new(table->cnt + cnt_seg);
+			if (r > 0 && table->segs[i_seg] != seg_zero)
+				seg_split = new unsigned char[Segment_Size * this->item_size];
+		} catch (std::bad_alloc&) {
+			if (table_new) {delete[] table_new->segs; delete table_new;}
+			this->unlock(); throw;
+		}
+		
+		this->generation_cnt = this->generation_cnt + 1; //pinned views are invalidated
+		this->write_begin();
+		try {
+			this->index_resize(this->bufsize + (cnt_seg << Segment_Size_Bits));
+		} catch (std::bad_alloc&) {
+			delete[] table_new->segs; delete table_new;
+			if (seg_split) delete[] seg_split;
+			this->write_end(); this->unlock(); throw;
+		}
+		
+		uint64_t i_ins = (r > 0)? i_seg + 1 : i_seg;
+		for (uint64_t i = 0; i < i_ins; i++)
+			table_new->segs[i] = table->segs[i];
+		for (uint64_t i = i_ins; i < table->cnt; i++)
+			table_new->segs[i + cnt_seg] = table->segs[i];
+		if (seg_split) {
+			memcpy(seg_split + r * this->item_size, table->segs[i_seg] + r * this->item_size,
+			       (Segment_Size - r) * this->item_size);
+			table_new->segs[i_ins + cnt_seg - 1] = seg_split;
+		}
+		this->seg_table_replace(table_new);
+		this->bufsize += cnt_seg << Segment_Size_Bits; //pos_end and items are not moved
+		this->write_end();
+	}
+	else if (sz < this->bufsize) {
+		// segments after the one containing pos_end (or from that one, if pos_end is at its
+		// beginning) are removed; free space goes first, then the oldest items are discarded
+		uint64_t cnt_seg = (this->bufsize - sz) >> Segment_Size_Bits;
+		if (cnt_seg > table->cnt - 1) cnt_seg = table->cnt - 1;
+		if (cnt_seg == 0) {
+			this->unlock(); return true;
+		}
+		try {
+			table_new = this->seg_table_new(table->cnt - cnt_seg);
+			this->seg_pool.reserve(this->seg_pool.size() + cnt_seg);
+		} catch (std::bad_alloc&) {
+			if (table_new) {delete[] table_new->segs; delete table_new;}
+			this->unlock(); throw;
+		}
+		
+		uint64_t i_rm = (r > 0)? i_seg + 1 : i_seg, size_rm = 0, size_free;
+		for (uint64_t k = 0; k < cnt_seg; k++) {
+			uint64_t i = (i_rm + k) % table->cnt;
+			size_rm += (i + 1 < table->cnt)? (uint64_t)Segment_Size
+			                               : this->bufsize - ((table->cnt - 1) << Segment_Size_Bits);
+		}
+		size_free = (r > 0)? Segment_Size - r + size_rm : size_rm; //positions freed from pos_end
+		uint64_t cnt_drop = 0;
+		if (size_free > this->bufsize - this->cnt) {
+			cnt_drop = size_free - (this->bufsize - this->cnt);
+			if (cnt_drop > this->cnt) cnt_drop = this->cnt;
+		}
 		
-		unsigned long int tmp_cnt = this->cnt + cnt;
-		if (tmp_cnt > this->bufsize) {
-			this->cnt_overwrite += tmp_cnt - this->bufsize;
-			this->cnt = this->bufsize;
-		} else
-			this->cnt = tmp_cnt;
+		this->generation_cnt = this->generation_cnt + 1;
+		this->write_begin();
+		if (this->history) this->history_save(this->cnt_overwrite + cnt_drop);
+		
+		uint64_t j = 0, i_seg_new = 0;
+		for (uint64_t i = 0; i < table->cnt; i++) {
+			if ((i + table->cnt - i_rm) % table->cnt < cnt_seg) { //removed
+				if (table->segs[i] != seg_zero) this->seg_pool.push_back(table->segs[i]);
+				continue;
+			}
+			if (i == ((r > 0)? i_seg : (i_rm + cnt_seg) % table->cnt)) i_seg_new = j;
+			table_new->segs[j++] = table->segs[i];
+		}
+		this->cnt -= cnt_drop; this->cnt_overwrite += cnt_drop;
+		this->sample_first += cnt_drop * this->sample_stride_cnt;
+		this->seg_table_replace(table_new);
+		this->bufsize -= size_rm;
+		this->pos_end = (i_seg_new << Segment_Size_Bits) + r;
+		this->write_end();
 	}
 	
 	this->unlock();
+	return true;
 }
 
-unsigned int CircularBuffer::get_spikes(IndexRange range, unsigned int* buf_out)
+void CircularBuffer::load(const float* data, uint64_t cnt, bool spike_check)
 {
-	if (this->buf_spike_cnt == 0) return 0;
-	
-	this->lock();
-	range = this->range().cut_range(range);
-	range = this->range_to_abs(range);
+	if (data == NULL || cnt == 0) return;
 	
-	unsigned int cnt_sp = 0;
-	unsigned int* p = buf_out; unsigned long int cur;
-	for (unsigned int i = 0; i < this->buf_spike_cnt; i++) {
-		cur = this->buf_spike_item(i);
-		if (cur < range.min()) continue;
-		if (cur > range.max()) break;
-		*p = this->index_to_rel(this->buf_spike_item(i));
-		cnt_sp++; p++;
+	if (this->type == Sample_Float && this->scale == 1 && this->offset == 0) {
+		this->load_raw(data, cnt, spike_check); return;
 	}
 	
-	this->unlock();
-	return cnt_sp;
+	// items are converted chunk by chunk
+	unsigned char chunk[Spike_Check_Chunk * sizeof(double)];
+	this->lock(true); this->write_begin();
+	if (this->option_compact || this->sample_stride_cnt > 1) { //pushed one by one
+		for (uint64_t i = 0; i < cnt && this->push_reserve(); i++)
+			this->push_compact(data[i], spike_check);
+		this->write_end(); this->unlock(); return;
+	}
+	uint64_t cnt_load = this->load_skip(cnt);
+	data += cnt - cnt_load;
+	for (uint64_t i = 0, n; i < cnt_load; i += n) {
+		n = cnt_load - i; if (n > Spike_Check_Chunk) n = Spike_Check_Chunk;
+		if (n > this->bufsize) n = this->bufsize;
+		for (unsigned int j = 0; j < n; j++)
+			this->item_store(chunk + j*this->item_size, data[i + j]);
+		this->load_items(chunk, n, spike_check);
+	}
+	this->write_end(); this->unlock();
 }
 
-unsigned int CircularBuffer::get_spikes(IndexRange range, unsigned long int* buf_out)
+void CircularBuffer::load_raw(const void* data, uint64_t cnt, bool spike_check)
 {
-	if (this->buf_spike_cnt == 0) return 0;
-	
-	this->lock();
-	range = this->range().cut_range(range);
-	range = this->range_to_abs(range);
+	if (data == NULL || cnt == 0) return;
+	this->lock(true); this->write_begin();
+	if (this->option_compact || this->sample_stride_cnt > 1) { //pushed one by one
+		for (uint64_t i = 0; i < cnt && this->push_reserve(); i++)
+			this->push_compact(this->item_value((const unsigned char*)data + (std::size_t)i * this->item_size),
+			                   spike_check);
+		this->write_end(); this->unlock(); return;
+	}
 	
-	unsigned int cnt_sp = 0; unsigned long int cur;
-	for (unsigned int i = 0; i < this->buf_spike_cnt; i++) {
-		cur = this->buf_spike_item(i);
-		if (cur < range.min()) continue;
-		if (cur > range.max()) break;
-		*buf_out = this->buf_spike_item(i);
-		cnt_sp++; buf_out++;
+	uint64_t cnt_load = this->load_skip(cnt);
+	const unsigned char* pd = (const unsigned char*)data + (std::size_t)(cnt - cnt_load) * this->item_size;
+	for (uint64_t i = 0, n; i < cnt_load; i += n) { //cnt_load > bufsize if history is enabled
+		n = cnt_load - i; if (n > this->bufsize) n = this->bufsize;
+		this->load_items(pd + (std::size_t)i * this->item_size, n, spike_check);
 	}
 	
-	this->unlock();
-	return cnt_sp;
+	this->write_end(); this->unlock();
 }
 
-ValueRange CircularBuffer::get_value_range(IndexRange range, unsigned int chk_step)
+unsigned int CircularBuffer::get_spikes(IndexRange range, unsigned int* buf_out)
 {
-	using std::numeric_limits;
-	
-	if (this->cnt == 0) return ValueRange(0, 0);
+	this->lock(); this->spike_lock();
+	this->spike_update();
 	
-	// indexes used during the calculation are "absolute"
-	range = this->range().cut_range(range);
-	range = this->range_to_abs(range);
-	if (chk_step == 0 || chk_step >= this->cnt / 2) chk_step = 1;
-	
-	MinMaxScanInfo last;
-	this->lock_info.lock();
-	last = this->last_min_max_scan;
-	this->lock_info.unlock();
-	
-	if (last.range_i_min_max_scan.contain(range) && range.contain(last.range_i_min_max))
-		return last.range_min_max;
+	IndexRange range_abs; unsigned int seq;
+	unsigned int cnt_sp; unsigned int* p; uint64_t cur;
+	do { //retry only in lock-free mode
+		seq = this->read_begin();
+		range_abs = this->range_to_abs(this->range().cut_range(range));
+		
+		cnt_sp = 0; p = buf_out;
+		if (! range_abs) continue;
+		for (unsigned int i = this->buf_spike_lower_bound(range_abs.min()); i < this->buf_spike_cnt; i++) {
+			cur = this->buf_spike_item(i);
+			if (cur > range_abs.max()) break;
+			*p = this->index_to_rel(cur);
+			cnt_sp++; p++;
+		}
+	} while (this->lock_policy() == Lock_Seq && this->read_retry(seq));
 	
-	this->lock();
+	this->spike_unlock(); this->unlock();
+	return cnt_sp;
+}
+
+unsigned int CircularBuffer::get_spikes(IndexRange range, uint64_t* buf_out)
+{
+	this->lock(); this->spike_lock();
+	this->spike_update();
 	
-	unsigned long int il = range.min(), ir = range.max();
-	unsigned long int imin = il, imax = il;
-	float min = numeric_limits<float>::max(), max = numeric_limits<float>::lowest();
+	IndexRange range_abs; unsigned int seq;
+	unsigned int cnt_sp; uint64_t* p; uint64_t cur;
+	do { //retry only in lock-free mode
+		seq = this->read_begin();
+		range_abs = this->range_to_abs(this->range().cut_range(range));
+		
+		cnt_sp = 0; p = buf_out;
+		if (! range_abs) continue;
+		for (unsigned int i = this->buf_spike_lower_bound(range_abs.min()); i < this->buf_spike_cnt; i++) {
+			cur = this->buf_spike_item(i);
+			if (cur > range_abs.max()) break;
+			*p = cur;
+			cnt_sp++; p++;
+		}
+	} while (this->lock_policy() == Lock_Seq && this->read_retry(seq));
 	
-	// optimized for scrolling right, but not for scrolling left
-	if (range.intersected_not_left_of(last.range_i_min_max_scan)
-	&&  range.contain(last.range_i_min_max))
-	{
-		imin = last.range_i_min_max.min(); min = last.range_min_max.min();
-		imax = last.range_i_min_max.max(); max = last.range_min_max.max();
-		il = last.range_i_min_max_scan.max();
-	}
+	this->spike_unlock(); this->unlock();
+	return cnt_sp;
+}
+
+void CircularBuffer::set_history_capacity(std::size_t capacity)
+{
+	if (! this->seg_table) return;
+	this->lock(true); this->write_begin();
 	
-	// check for spikes
-	unsigned long int i; float cur;
-	if (chk_step > 1 && this->buf_spike_cnt > 0) {
-		for (unsigned int i_sp = 0; i_sp < this->buf_spike_cnt; i_sp++) {
-			i = this->buf_spike_item(i_sp);
-			if (i < il) continue; if (i > ir) break;
-			cur = this->abs_index_item(i);
-			if (cur < min) {min = cur; imin = i;}
-			if (cur > max) {max = cur; imax = i;}
+	if (this->history) {delete this->history; this->history = NULL;}
+	if (capacity > 0) {
+		try {
+			this->history = new HistoryStore(capacity, this->type);
+		} catch (std::bad_alloc&) {
+			this->history = NULL;
+		}
+		if (this->history == NULL) {
+			this->write_end(); this->unlock(); throw std::bad_alloc();
 		}
+		this->history->set_scale(this->scale, this->offset);
+		this->i_abs_history_next = this->cnt_overwrite;
 	}
 	
-	float* p = this->item_addr(this->index_to_rel(il));
-	this->unlock();
-	
-	for (i = il; i <= ir; i += chk_step) {
-		cur = *p;
-		if (cur < min) {min = cur; imin = i;}
-		if (cur > max) {max = cur; imax = i;}
-		p = this->ptr_inc(p, chk_step);
-	}
+	this->write_end(); this->unlock();
+}
+
+IndexRange CircularBuffer::history_range() const
+{
+	uint64_t i_first, i_end; unsigned int seq;
+	do {
+		seq = this->read_begin();
+		i_first = this->cnt_overwrite; i_end = this->count_overall();
+		if (this->history) {
+			IndexRange range_hist = this->history->range();
+			if (range_hist && range_hist.min() < i_first) i_first = range_hist.min();
+		}
+	} while (this->read_retry(seq));
 	
-	last.range_i_min_max_scan = range;
-	last.range_i_min_max.set(imin, imax);
-	last.range_min_max.set(min, max);
+	if (i_end == i_first) return IndexRange();
+	return IndexRange(i_first, i_end - 1);
+}
+
+ValueRange CircularBuffer::get_history_value_range(IndexRange range_abs)
+{
+	using std::numeric_limits;
+	float min, max; IndexRange range_hist, range_cur;
 	
-	this->lock_info.lock();
-	this->last_min_max_scan = last;
-	this->lock_info.unlock();
+	this->lock();
+	do { //retry only in lock-free mode
+		min = numeric_limits<float>::max(); max = numeric_limits<float>::lowest();
+		this->history_split(range_abs, range_hist, range_cur);
+		if (range_hist) {
+			ValueRange vr = this->history->get_value_range(range_hist);
+			min = vr.min(); max = vr.max();
+		}
+		if (! range_cur) break;
+		ValueRange vr = this->index_value_range(range_cur);
+		if (vr.min() < min) min = vr.min();
+		if (vr.max() > max) max = vr.max();
+	} while (! this->check_intact(range_cur.min()));
+	this->unlock();
 	
-	return last.range_min_max;
+	if (min > max) return ValueRange(0, 0);
+	return ValueRange(min, max);
 }
 
-float CircularBuffer::get_average(IndexRange range, unsigned int chk_step)
+float CircularBuffer::get_history_average(IndexRange range_abs)
 {
-	if (this->cnt == 0) return 0;
+	double sum, sq_sum, sum_cur, sq_sum_cur; IndexRange range_hist, range_cur;
 	
-	// indexes used during the calculation are "absolute"
-	range = this->range().cut_range(range);
-	range = this->range_to_abs(range);
-	
-	if (range == this->last_av_calc.range_i_av_val)
-		return this->last_av_calc.av_val;
+	this->lock();
+	do { //retry only in lock-free mode
+		sum = sq_sum = 0;
+		this->history_split(range_abs, range_hist, range_cur);
+		if (range_hist) this->history->get_sums(range_hist, sum, sq_sum);
+		if (! range_cur) break;
+		this->index_get_sums(range_cur, sum_cur, sq_sum_cur);
+		sum += sum_cur;
+	} while (! this->check_intact(range_cur.min()));
+	this->unlock();
 	
-	AvCalcInfo last;
-	this->lock_info.lock();
-	last = this->last_av_calc;
-	this->lock_info.unlock();
+	uint64_t cnt = range_hist.count() + range_cur.count();
+	if (cnt == 0) return 0;
+	return sum / cnt;
+}
+
+uint64_t CircularBuffer::copy_history(IndexRange range_abs, float* out)
+{
+	uint64_t cnt_cpy; IndexRange range_hist, range_cur;
 	
 	this->lock();
+	do { //retry only in lock-free mode
+		cnt_cpy = 0;
+		this->history_split(range_abs, range_hist, range_cur);
+		if (range_hist) cnt_cpy = this->history->copy(range_hist, out);
+		if (! range_cur) break;
+		cnt_cpy += this->copy_items(range_cur, 1, out + cnt_cpy, NULL, NULL);
+	} while (! this->check_intact(range_cur.min()));
+	this->unlock();
 	
-	bool flag_optimize = false, flag_add, flag_subtract;
-	unsigned long int il_add, ir_add, il_sub, ir_sub; //index bounds
-	unsigned int cnt = 0; float sum = 0;
-	
-	// optimized for scrolling right, but not for scrolling left
-	if (last.range_i_av_val.min() > this->cnt_overwrite
-	&&  range.intersected_not_left_of(last.range_i_av_val))
-	{
-		flag_add      = (range.max() > last.range_i_av_val.max());
-		flag_subtract = (range.min() > last.range_i_av_val.min());
-		
-		unsigned int cnt_operate = 0;
-		if (flag_add) {
-			il_add = last.range_i_av_val.max() + 1; ir_add = range.max();
-			cnt_operate += ir_add - il_add + 1;
-		}
-		if (flag_subtract) {
-			il_sub = last.range_i_av_val.min(); ir_sub = range.min() - 1;
-			cnt_operate += ir_sub - il_sub + 1;
-		}
-		flag_optimize = (cnt_operate < range.count());
-	}
+	return cnt_cpy;
+}
+
+uint64_t CircularBuffer::copy_range(IndexRange range_abs, unsigned int step, float* out)
+{
+	this->lock();
+	uint64_t cnt_cpy = this->copy_items(range_abs, step, out, NULL, NULL);
+	this->unlock();
+	return cnt_cpy;
+}
+
+uint64_t CircularBuffer::copy_range(IndexRange range_abs, unsigned int step, CopyFuncPtr func, void* obj)
+{
+	if (func == NULL) return 0;
+	this->lock();
+	uint64_t cnt_cpy = this->copy_items(range_abs, step, NULL, func, obj);
+	this->unlock();
+	return cnt_cpy;
+}
+
+uint64_t CircularBuffer::copy_range_m4(IndexRange range_abs, unsigned int step, float* out)
+{
+	this->lock();
+	uint64_t cnt_cpy = this->copy_items_m4(range_abs, step, out, NULL, NULL);
+	this->unlock();
+	return cnt_cpy;
+}
+
+uint64_t CircularBuffer::copy_range_m4(IndexRange range_abs, unsigned int step, CopyFuncPtr func, void* obj)
+{
+	if (func == NULL) return 0;
+	this->lock();
+	uint64_t cnt_cpy = this->copy_items_m4(range_abs, step, NULL, func, obj);
+	this->unlock();
+	return cnt_cpy;
+}
+
+BufferView CircularBuffer::view(IndexRange range) const
+{
+	BufferView view; IndexRange range_view; unsigned int seq;
+	view.type = this->type; view.scale = this->scale; view.offset = this->offset;
+	do { //the counters and the position should be consistent
+		seq = this->read_begin();
+		view.cnt = 0;
+		range_view = this->range().cut_range(range); if (! range_view) continue;
+		
+		view.buf = this; view.generation = this->generation_cnt;
+		view.i_abs = this->index_to_abs(range_view.min());
+		const SegTable* table = this->seg_table;
+		view.pos = this->item_pos(range_view.min()); view.cnt = range_view.count();
+		view.bufsize = this->bufsize; view.item_size = this->item_size; view.segs = table->segs;
+	} while (this->read_retry(seq));
+	
+	return view;
+}
+
+ValueRange CircularBuffer::get_value_range(IndexRange range, unsigned int /*chk_step*/)
+{
+	if (this->cnt == 0) return ValueRange(0, 0);
+	
+	IndexRange range_abs; ValueRange range_val(0, 0);
+	this->lock();
+	do { //retry only in lock-free mode
+		range_abs = this->range_to_abs_sync(range);
+		if (! range_abs) break;
+		range_val = this->index_value_range(range_abs);
+	} while (! this->check_intact(range_abs.min()));
+	this->unlock();
+	
+	return range_val;
+}
+
+float CircularBuffer::get_average(IndexRange range, unsigned int /*chk_step*/)
+{
+	double sum, sq_sum;
+	if (! this->get_sums(range, sum, sq_sum)) return 0;
+	return sum / range.count();
+}
+
+float CircularBuffer::get_rms(IndexRange range)
+{
+	double sum, sq_sum;
+	if (! this->get_sums(range, sum, sq_sum)) return 0;
+	return sqrt(sq_sum / range.count());
+}
+
+float CircularBuffer::get_std_dev(IndexRange range)
+{
+	double sum, sq_sum;
+	if (! this->get_sums(range, sum, sq_sum)) return 0;
+	
+	double av = sum / range.count(), var = sq_sum / range.count() - av*av;
+	if (var < 0) var = 0; //rounding error
+	return sqrt(var);
+}
+
+int CircularBuffer::window_register(uint64_t width)
+{
+	if (width == 0) return -1;
+	uint64_t deq_size = 1; //blocks intersected by the window
+	while (deq_size < (width >> Block_Size_Bits) + 3) deq_size <<= 1;
+	
+	this->lock(true);
+	
+	// a retired window can be reused directly if the writer is excluded by the lock
+	int id = -1;
+	for (int i = 0; i < Windows_Max; i++)
+		if (this->windows[i].state == Window_Free
+		|| (this->windows[i].state == Window_Retired && this->lock_policy() != Lock_Seq)) {
+			id = i; break;
+		}
+	if (id < 0) {this->unlock(); return -1;}
+	
+	Window& win = this->windows[id];
+	if (win.deq[0] == NULL || win.deq_mask + 1 < deq_size) {
+		uint64_t* deqs = NULL;
+		try {
+			deqs = new uint64_t[2 * deq_size];
+		} catch (std::bad_alloc&) {
+			deqs = NULL;
+		}
+		if (deqs == NULL) {
+			this->unlock(); throw std::bad_alloc();
+		}
+		if (win.deq[0]) this->window_deqs_old.push_back(win.deq[0]);
+		win.deq[0] = deqs; win.deq[1] = deqs + deq_size; win.deq_mask = deq_size - 1;
+	}
+	win.width = width; win.deq_cnt[0] = win.deq_cnt[1] = 0;
+	win.flag_rebuild = true;
+	std::atomic_thread_fence(std::memory_order_release); //the writer reads the state at first
+	win.state = Window_Active;
+	
+	this->unlock();
+	return id;
+}
+
+void CircularBuffer::window_unregister(int id)
+{
+	if (id < 0 || id >= Windows_Max) return;
+	this->windows[id].state = Window_Retired;
+}
+
+ValueRange CircularBuffer::get_window_value_range(int id)
+{
+	if (id < 0 || id >= Windows_Max || this->cnt == 0) return ValueRange(0, 0);
+	const Window& win = this->windows[id];
+	
+	using std::numeric_limits;
+	float min, max; unsigned int seq;
+	this->lock();
+	do { //retry only in lock-free mode
+		seq = this->read_begin();
+		min = numeric_limits<float>::max(); max = numeric_limits<float>::lowest();
+		
+		uint64_t i_end = this->count_overall(), i_first = this->cnt_overwrite;
+		if (i_end - i_first > win.width) i_first = i_end - win.width;
+		IndexRange range_abs(i_first, i_end - 1);
+		if (win.state != Window_Active || win.flag_rebuild) {
+			ValueRange range_val = this->index_value_range(range_abs);
+			min = range_val.min(); max = range_val.max(); continue;
+		}
+		
+		// blocks in [blk_l, blk_r) are completely inside the window
+		uint64_t blk_l = (i_first + Block_Size - 1) >> Block_Size_Bits,
+		         blk_r = i_end >> Block_Size_Bits;
+		if (blk_l >= blk_r) {
+			this->scan_value_range(range_abs, min, max); continue;
+		}
+		if (i_first < (blk_l << Block_Size_Bits))
+			this->scan_value_range(IndexRange(i_first, (blk_l << Block_Size_Bits) - 1), min, max);
+		if (i_end > (blk_r << Block_Size_Bits))
+			this->scan_value_range(IndexRange(blk_r << Block_Size_Bits, i_end - 1), min, max);
+		
+		// the first block in the deque not before blk_l has the extreme value of the rest;
+		// only blocks left by the latest block completion are skipped here
+		for (unsigned int k = 0; k < 2; k++) {
+			for (uint64_t j = 0; j < win.deq_cnt[k] && j <= win.deq_mask; j++) {
+				uint64_t blk = win.deq[k][(win.deq_first[k] + j) & win.deq_mask];
+				if (blk < blk_l) continue;
+				const MinMax& node = this->index_mm_lv[0][blk & this->index_mm_mask[0]];
+				if (k == 0 && node.min < min) min = node.min;
+				if (k == 1 && node.max > max) max = node.max;
+				break;
+			}
+		}
+	} while (this->read_retry(seq));
+	this->unlock();
+	
+	return ValueRange(min, max);
+}
+
+bool CircularBuffer::find_above(IndexRange range, float thr, uint64_t& i_out, bool forward)
+{
+	return this->find(range, thr, true, forward, i_out);
+}
+
+bool CircularBuffer::find_below(IndexRange range, float thr, uint64_t& i_out, bool forward)
+{
+	return this->find(range, thr, false, forward, i_out);
+}
+
+bool CircularBuffer::find_crossing(uint64_t i_from, float thr, uint64_t& i_out, bool forward)
+{
+	if (this->cnt == 0) return false;
+	
+	IndexRange range_abs; uint64_t i_abs, i_abs_next = 0; bool found;
+	this->lock();
+	do { //retry only in lock-free mode
+		found = false;
+		IndexRange range_avail = this->range_to_abs_sync(this->range_max()); //existing items
+		uint64_t cnt = range_avail.count();
+		if (forward? (i_from + 1 >= cnt) : (i_from < 2 || i_from > cnt)) break;
+		
+		// search for the first item on the other side of the item next to the crossing
+		i_abs_next = range_avail.min() + (forward? i_from : i_from - 1);
+		bool above = ! (this->item_value(this->pos_addr(this->abs_pos(i_abs_next))) > thr);
+		range_abs = forward? IndexRange(i_abs_next + 1, range_avail.max())
+		                   : IndexRange(range_avail.min(), i_abs_next - 1);
+		
+		// item <= thr is equivalent to item < (the next float value after thr)
+		float thr_cmp = above? thr : std::nextafter(thr, std::numeric_limits<float>::infinity());
+		found = this->index_find(range_abs, thr_cmp, above, forward, i_abs);
+	} while (! this->check_intact(forward? i_abs_next : range_abs.min())); //the oldest item read
+	if (found) i_out = this->index_to_rel(forward? i_abs : i_abs + 1);
+	this->unlock();
+	
+	return found;
+}
+
+bool CircularBuffer::find_max(IndexRange range, uint64_t& i_out)
+{
+	return this->find_extremum(range, true, i_out);
+}
+
+bool CircularBuffer::find_min(IndexRange range, uint64_t& i_out)
+{
+	return this->find_extremum(range, false, i_out);
+}
+
+bool CircularBuffer::set_histogram(ValueRange range, unsigned int bins)
+{
+	if (bins > 0 && !(range.length() > 0)) return false;
+	
+	uint64_t* prefix = NULL, * run = NULL, mask = this->hist_layout(this->bufsize);
+	if (bins > 0) {
+		try {
+			prefix = new uint64_t[(mask + 1) * bins];
+			run = new uint64_t[bins];
+		} catch (std::bad_alloc&) {
+			if (prefix) delete[] prefix;
+			throw;
+		}
+	}
+	
+	this->lock(true); this->write_begin();
+	if (this->hist_prefix != NULL) delete[] this->hist_prefix;
+	if (this->hist_run != NULL) delete[] this->hist_run;
+	this->hist_prefix = prefix; this->hist_run = run; this->hist_mask = mask;
+	this->hist_bins = bins;
+	if (bins > 0) {
+		this->hist_min = range.min(); this->hist_max = range.max();
+		this->hist_scale = bins / (double)range.length();
+		this->hist_count_all();
+	}
+	this->write_end(); this->unlock();
+	return true;
+}
+
+bool CircularBuffer::get_histogram(IndexRange range, uint64_t* counts_out)
+{
+	if (this->cnt == 0 || this->hist_bins == 0) return false;
+	
+	IndexRange range_abs;
+	this->lock();
+	do { //retry only in lock-free mode
+		range_abs = this->range_to_abs_sync(range);
+		if (! range_abs) break;
+		this->index_get_hist(range_abs, counts_out);
+	} while (! this->check_intact(range_abs.min()));
+	this->unlock();
+	
+	return (bool)range_abs;
+}
+
+bool CircularBuffer::get_quantiles(IndexRange range, const float* q, unsigned int cnt, float* out)
+{
+	unsigned int bins = this->hist_bins;
+	if (this->cnt == 0 || bins == 0) return false;
+	std::vector<uint64_t> counts(bins);
+	
+	IndexRange range_abs; ValueRange range_val(0, 0); float hist_min, bin_width;
+	this->lock();
+	do { //retry only in lock-free mode
+		range_abs = this->range_to_abs_sync(range);
+		if (!range_abs || this->hist_bins != bins) {
+			range_abs = IndexRange(); break;
+		}
+		this->index_get_hist(range_abs, counts.data());
+		range_val = this->index_value_range(range_abs);
+	} while (! this->check_intact(range_abs.min()));
+	hist_min = this->hist_min; bin_width = 1.0 / this->hist_scale;
+	this->unlock();
+	if (! range_abs) return false;
+	
+	// find the bin containing the item of rank q * count, assuming items are uniformly
+	// distributed in the bin
+	double total = range_abs.count();
+	for (unsigned int j = 0; j < cnt; j++) {
+		if (q[j] <= 0) {out[j] = range_val.min(); continue;}
+		if (q[j] >= 1) {out[j] = range_val.max(); continue;}
+		
+		double rank = q[j] * total, cum = 0; unsigned int b = 0;
+		while (b < bins - 1 && cum + counts[b] <= rank) cum += counts[b++];
+		double val = hist_min + (b + ((counts[b] > 0)? (rank - cum) / counts[b] : 0)) * bin_width;
+		if (val < range_val.min()) val = range_val.min();
+		if (val > range_val.max()) val = range_val.max();
+		out[j] = val;
+	}
+	return true;
+}
+
+/*------------------------------ private functions ------------------------------*/
+
+void CircularBuffer::file_header_save()
+{
+	FileHeader* hdr = this->file_hdr;
+	hdr->scale = this->scale; hdr->offset = this->offset;
+	hdr->spike_check_ref_min = this->spike_check_ref_min;
+	hdr->spike_check_av = this->spike_check_av;
+	hdr->cnt = this->cnt; hdr->pos_end = this->pos_end;
+	hdr->cnt_overwrite = this->cnt_overwrite;
+	hdr->buf_spike_cnt = this->buf_spike_cnt;
+	hdr->buf_spike_end = this->buf_spike_end - this->buf_spike;
+	hdr->option_spike_check = this->option_spike_check;
+	hdr->spike_run_cnt = this->spike_run_cnt; hdr->i_abs_spike_next = this->i_abs_spike_next;
+	hdr->spike_prev[0] = this->spike_prev[0]; hdr->spike_prev[1] = this->spike_prev[1];
+	hdr->sums_run = this->sums_run; hdr->sums_comp = this->sums_comp;
+	hdr->i_abs_sums_reset = this->i_abs_sums_reset;
+	
+	if (this->file_sync_interval > 0
+	&&  this->count_overall() - this->file_sync_last >= this->file_sync_interval) {
+		sync_file_map(hdr, this->file_map_size, false); //schedules writing without waiting
+		this->file_sync_last = this->count_overall();
+	}
+}
+
+void CircularBuffer::history_save(uint64_t i_abs_end)
+{
+	unsigned char items[HistoryStore::Block_Size * sizeof(double)];
+	
+	if (this->i_abs_history_next < this->cnt_overwrite) //shouldn't happen
+		this->i_abs_history_next = this->cnt_overwrite;
+	while (this->i_abs_history_next < i_abs_end) {
+		uint64_t i = this->i_abs_history_next - this->cnt_overwrite;
+		if (i >= this->cnt) break;
+		uint64_t n = this->cnt - i;
+		if (n > HistoryStore::Block_Size) n = HistoryStore::Block_Size;
+		
+		uint64_t pos = this->item_pos(i);
+		for (uint64_t j = 0, n_seg; j < n; j += n_seg) {
+			n_seg = this->pos_seg_len(pos, n - j);
+			memcpy(items + j * this->item_size, this->pos_addr(pos), n_seg * this->item_size);
+			pos = this->pos_inc(pos, n_seg);
+		}
+		this->history->append(this->i_abs_history_next, items, n);
+		this->i_abs_history_next += n;
+	}
+}
+
+void CircularBuffer::history_split(IndexRange range_abs, IndexRange& range_hist, IndexRange& range_cur) const
+{
+	uint64_t cnt_ovr; unsigned int seq;
+	do {
+		seq = this->read_begin();
+		cnt_ovr = this->cnt_overwrite;
+		range_cur = intersection(this->range_to_abs(this->range()), range_abs);
+	} while (this->read_retry(seq));
+	
+	range_hist = IndexRange();
+	if (this->history && cnt_ovr > 0)
+		range_hist = intersection(intersection(this->history->range(), IndexRange(0, cnt_ovr - 1)), range_abs);
+}
+
+void CircularBuffer::seg_alloc(uint64_t pos, uint64_t cnt)
+{
+	if (cnt > this->bufsize) cnt = this->bufsize;
+	SegTable* table = this->seg_table;
+	for (uint64_t i = 0, n; i < cnt; i += n) {
+		n = this->pos_seg_len(pos, cnt - i);
+		unsigned char*& seg = table->segs[pos >> Segment_Size_Bits];
+		if (seg == seg_zero) {
+			if (! this->seg_pool.empty()) {
+				seg = this->seg_pool.back(); this->seg_pool.pop_back();
+			} else
+				seg = new unsigned char[Segment_Size * this->item_size]; //throws bad_alloc
+		}
+		pos = this->pos_inc(pos, n);
+	}
+}
+
+bool CircularBuffer::seg_alloc_push()
+{
+	try {
+		this->seg_alloc(this->pos_end, (this->sample_stride_cnt > 1)? 2 : 1);
+	} catch (std::bad_alloc&) {
+		this->flag_alloc_failed = true; //the caller drops the item
+		return false;
+	}
+	return true;
+}
+
+CircularBuffer::SegTable* CircularBuffer::seg_table_new(unsigned int cnt)
+{
+	SegTable* table = new SegTable;
+	try {
+		table->segs = new unsigned char*[cnt];
+	} catch (std::bad_alloc&) {
+		delete table; throw;
+	}
+	table->cnt = cnt;
+	for (unsigned int i = 0; i < cnt; i++)
+		table->segs[i] = seg_zero;
+	return table;
+}
+
+void CircularBuffer::seg_table_replace(SegTable* table)
+{
+	// the old table may be used by readers not holding the lock, so it isn't freed here
+	this->seg_tables_old.push_back((SegTable*)this->seg_table);
+	this->seg_table = table;
+}
+
+void CircularBuffer::index_resize(uint64_t sz)
+{
+	// rings of index nodes are enlarged, nodes of available blocks are copied; nodes of
+	// new levels are calculated from their children
+	uint64_t sz_old = this->bufsize, mask_old[Index_Levels_Max]; unsigned int levels_old = this->index_levels;
+	MinMax* lv_old[Index_Levels_Max];
+	for (unsigned int lv = 0; lv < levels_old; lv++) {
+		mask_old[lv] = this->index_mm_mask[lv]; lv_old[lv] = this->index_mm_lv[lv];
+	}
+	MinMax* mm_old = this->index_mm; Sums* sums_old = this->index_sums;
+	
+	this->bufsize = sz; //for index_layout()
+	uint64_t index_mm_cnt = this->index_layout();
+	this->bufsize = sz_old;
+	MinMax* mm_new = NULL; Sums* sums_new = NULL;
+	uint64_t hist_mask_new = this->hist_layout(sz), * hist_new = NULL;
+	try {
+		mm_new = new MinMax[index_mm_cnt];
+		sums_new = new Sums[this->index_mm_mask[0] + 1];
+		if (this->hist_bins)
+			hist_new = new uint64_t[(hist_mask_new + 1) * this->hist_bins];
+	} catch (std::bad_alloc&) {
+		if (mm_new) delete[] mm_new;
+		if (sums_new) delete[] sums_new;
+		mm_new = NULL;
+	}
+	if (mm_new == NULL) { //keep the old index
+		this->index_levels = levels_old;
+		for (unsigned int lv = 0; lv < levels_old; lv++) this->index_mm_mask[lv] = mask_old[lv];
+		throw std::bad_alloc();
+	}
+	this->index_mm = mm_new; this->index_sums = sums_new;
+	this->index_set_levels();
+	
+	uint64_t blk_first = this->cnt_overwrite >> Block_Size_Bits,
+	         blk_cur = this->count_overall() >> Block_Size_Bits; //being filled
+	for (uint64_t blk = (blk_first > 0)? blk_first - 1 : 0; blk < blk_cur; blk++)
+		this->index_sums[blk & this->index_mm_mask[0]] = sums_old[blk & mask_old[0]];
+	
+	for (unsigned int lv = 0; lv < this->index_levels; lv++) {
+		for (uint64_t j = blk_first >> lv; j <= (blk_cur >> lv); j++) {
+			MinMax& node = this->index_mm_lv[lv][j & this->index_mm_mask[lv]];
+			if (lv < levels_old) {
+				node = lv_old[lv][j & mask_old[lv]]; continue;
+			}
+			if ((j << lv) >= blk_cur) break; //no completed block in this node
+			node = this->index_mm_lv[lv - 1][(2*j) & this->index_mm_mask[lv - 1]];
+			if (((2*j + 1) << (lv - 1)) < blk_cur) {
+				const MinMax& node_r = this->index_mm_lv[lv - 1][(2*j + 1) & this->index_mm_mask[lv - 1]];
+				if (node_r.min < node.min) node.min = node_r.min;
+				if (node_r.max > node.max) node.max = node_r.max;
+			}
+		}
+	}
+	
+	if (hist_new) { //stored counts of available blocks are copied
+		uint64_t hblk_first = this->cnt_overwrite >> Hist_Block_Size_Bits,
+		         hblk_cur = this->count_overall() >> Hist_Block_Size_Bits;
+		for (uint64_t blk = (hblk_first > 0)? hblk_first - 1 : 0; blk < hblk_cur; blk++)
+			memcpy(hist_new + (blk & hist_mask_new) * this->hist_bins,
+			       this->hist_prefix + (blk & this->hist_mask) * this->hist_bins,
+			       this->hist_bins * sizeof(uint64_t));
+		delete[] this->hist_prefix;
+		this->hist_prefix = hist_new; this->hist_mask = hist_mask_new;
+	}
+	
+	delete[] mm_old; delete[] sums_old; //readers are excluded by lock(true)
+	this->windows_reset();
+}
+
+uint64_t CircularBuffer::load_skip(uint64_t cnt)
+{
+	if (cnt <= this->bufsize) return cnt;
+	if (this->history) return cnt; //all items should be compressed into the history
+	
+	// existing items and skipped items are all treated as overwritten
+	this->cnt_overwrite += this->cnt + (cnt - this->bufsize);
+	this->sample_first = this->cnt_overwrite; //sample_stride_cnt is 1 here
+	this->cnt = 0; this->pos_end = 0;
+	this->index_sums_reset();
+	return this->bufsize;
+}
+
+void CircularBuffer::load_items(const unsigned char* data, uint64_t cnt, bool spike_check)
+{
+	this->option_spike_check = spike_check;
+	if (this->history && this->cnt + cnt > this->bufsize)
+		this->history_save(this->cnt_overwrite + (this->cnt + cnt - this->bufsize));
+	this->index_load(data, cnt, this->count_overall());
+	
+	this->seg_alloc(this->pos_end, cnt);
+	uint64_t pos = this->pos_end;
+	for (uint64_t i = 0, n; i < cnt; i += n) {
+		n = this->pos_seg_len(pos, cnt - i);
+		memcpy(this->pos_addr(pos), data + i * this->item_size, n * this->item_size);
+		pos = this->pos_inc(pos, n);
+	}
+	this->pos_end = pos;
+	
+	uint64_t tmp_cnt = this->cnt + cnt; //no more than 2*bufsize
+	if (tmp_cnt > this->bufsize) {
+		this->cnt_overwrite += tmp_cnt - this->bufsize;
+		this->sample_first += tmp_cnt - this->bufsize;
+		this->cnt = this->bufsize;
+	} else
+		this->cnt = tmp_cnt;
+}
+
+void CircularBuffer::push_compact(float val, bool spike_check)
+{
+	float vals[2] = {val, val}; unsigned int cnt_new = 1;
+	if (this->sample_stride_cnt > 1) { //val is accumulated into the pair
+		if (this->pair_cnt == 0) {
+			this->pair_min = this->pair_max = val; this->pair_min_first = true;
+		} else if (val < this->pair_min) {
+			this->pair_min = val; this->pair_min_first = false;
+		} else if (val > this->pair_max) {
+			this->pair_max = val; this->pair_min_first = true;
+		}
+		this->option_spike_check = spike_check;
+		if (++this->pair_cnt < 2 * this->sample_stride_cnt) return;
+		
+		vals[0] = this->pair_min_first? this->pair_min : this->pair_max;
+		vals[1] = this->pair_min_first? this->pair_max : this->pair_min;
+		cnt_new = 2; this->pair_cnt = 0;
+	}
+	
+	if (this->option_compact && !this->file_hdr && this->bufsize >= 4
+	&&  this->cnt + cnt_new > this->bufsize) {
+		this->compact(vals, cnt_new);
+		this->option_spike_check = spike_check;
+	} else {
+		for (unsigned int i = 0; i < cnt_new; i++)
+			this->push_item(vals[i], spike_check);
+	}
+}
+
+void CircularBuffer::compact(const float* vals_new, unsigned int cnt_new)
+{
+	// existing items and new items are grouped by 4 items, each group is replaced by its
+	// min and max in the original order. items are moved forward, so it's done in place.
+	// items left (less than 4) are accumulated into the pair of the new stride
+	unsigned char items_new[2 * sizeof(double)], pair[2 * sizeof(double)];
+	for (unsigned int i = 0; i < cnt_new; i++)
+		this->item_store(items_new + i * this->item_size, vals_new[i]);
+	
+	this->generation_cnt = this->generation_cnt + 1; //pinned views are invalidated
+	uint64_t pos_first = this->item_pos(0), cnt_all = this->cnt + cnt_new,
+	         cnt_grp = cnt_all / 4;
+	const unsigned char* p[4]; double v[4];
+	for (uint64_t g = 0; g <= cnt_grp; g++) {
+		unsigned int cnt_in_grp = (g < cnt_grp)? 4 : cnt_all - 4*cnt_grp, k_min = 0, k_max = 0;
+		for (unsigned int k = 0; k < cnt_in_grp; k++) {
+			uint64_t i = 4*g + k;
+			if (i < this->cnt)
+				p[k] = this->pos_addr(this->pos_inc(pos_first, i));
+			else
+				p[k] = items_new + (i - this->cnt) * this->item_size;
+			v[k] = this->item_value(p[k]);
+			if (v[k] < v[k_min]) k_min = k;
+			if (v[k] > v[k_max]) k_max = k;
+		}
+		if (g == cnt_grp) { //items left
+			for (unsigned int k = 0; k < cnt_in_grp; k++) {
+				if (k == 0 || v[k] < this->pair_min) this->pair_min = v[k];
+				if (k == 0 || v[k] > this->pair_max) this->pair_max = v[k];
+			}
+			this->pair_min_first = (k_min <= k_max);
+			this->pair_cnt = cnt_in_grp * this->sample_stride_cnt;
+			break;
+		}
+		
+		unsigned int k_a = (k_min <= k_max)? k_min : k_max, k_b = (k_min <= k_max)? k_max : k_min;
+		memcpy(pair, p[k_a], this->item_size);
+		memcpy(pair + this->item_size, p[k_b], this->item_size);
+		memcpy(this->pos_addr(this->pos_inc(pos_first, 2*g)), pair, this->item_size);
+		memcpy(this->pos_addr(this->pos_inc(pos_first, 2*g + 1)), pair + this->item_size, this->item_size);
+	}
+	this->sample_stride_cnt = this->sample_stride_cnt * 2;
 	
-	if (! flag_optimize) {
-		flag_add = true; flag_subtract = false;
-		il_add = range.min(); ir_add = range.max();
+	// the index and spikes are built again
+	uint64_t cnt = 2 * cnt_grp;
+	this->cnt = 0; this->index_sums_reset(); this->windows_reset();
+	for (uint64_t i = 0, n; i < cnt; i += n) {
+		uint64_t pos = this->pos_inc(pos_first, i);
+		n = this->pos_seg_len(pos, cnt - i);
+		this->index_load(this->pos_addr(pos), n, this->cnt_overwrite + i);
 	}
+	this->cnt = cnt;
+	this->pos_end = this->pos_inc(pos_first, cnt);
 	
-	if (chk_step == 0 || chk_step >= (ir_add - il_add + 1) / 32) {
-		chk_step = (ir_add - il_add + 1) / 32; if (chk_step == 0) chk_step = 1;
+	this->buf_spike_cnt = 0;
+	this->buf_spike_end = this->buf_spike;
+	this->spike_check_av = 0;
+	this->i_abs_spike_next = this->cnt_overwrite; this->spike_run_cnt = 0;
+	this->spike_prev[0] = this->spike_prev[1] = 0;
+}
+
+void CircularBuffer::buf_spike_load(const uint64_t* data, unsigned int cnt)
+{
+	if (cnt > this->buf_spike_size) {
+		data += cnt - this->buf_spike_size; cnt = this->buf_spike_size;
 	}
 	
-	if (flag_optimize) {
-		cnt = last.range_i_av_val.count_by_step(chk_step);
-		sum = cnt * last.av_val;
+	unsigned int cur = this->buf_spike_end - this->buf_spike;
+	BufRangeMap map(IndexRange(0, cnt - 1), this->buf_spike_size, cur);
+	memcpy(this->buf_spike + map.former.min(), data, map.former.count()*sizeof(uint64_t));
+	if (map.latter)
+		memcpy(this->buf_spike + map.latter.min(), data + map.former.count(),
+		       map.latter.count()*sizeof(uint64_t));
+	
+	cur += cnt; if (cur >= this->buf_spike_size) cur -= this->buf_spike_size;
+	this->buf_spike_end = this->buf_spike + cur;
+	
+	unsigned int tmp_cnt = this->buf_spike_cnt + cnt;
+	this->buf_spike_cnt = (tmp_cnt < this->buf_spike_size)? tmp_cnt : this->buf_spike_size;
+}
+
+void CircularBuffer::spike_update()
+{
+	float val[Spike_Check_Chunk + 2], dd[Spike_Check_Chunk]; //val[0], val[1] are previous values
+	uint64_t spikes[Spike_Check_Chunk]; unsigned int cnt_sp;
+	
+	uint64_t cnt_ovr, i_end, i_abs, pos_first, cnt_prev; unsigned int seq, n;
+	float av, ref; bool check;
+	while (true) {
+		do { //get consistent counters and position of the first item
+			seq = this->read_begin();
+			cnt_ovr = this->cnt_overwrite; i_end = cnt_ovr + this->cnt;
+			pos_first = this->item_pos(0);
+			check = this->option_spike_check;
+		} while (this->read_retry(seq));
+		
+		i_abs = this->i_abs_spike_next; cnt_prev = this->spike_run_cnt;
+		if (i_abs < cnt_ovr) { //items not checked have been overwritten
+			i_abs = cnt_ovr; cnt_prev = 0;
+		}
+		if (i_abs >= i_end) break;
+		
+		n = (i_end - i_abs < Spike_Check_Chunk)? i_end - i_abs : (uint64_t)Spike_Check_Chunk;
+		val[0] = this->spike_prev[0]; val[1] = this->spike_prev[1];
+		uint64_t pos = this->pos_inc(pos_first, i_abs - cnt_ovr);
+		for (unsigned int j = 0, n_seg; j < n; j += n_seg) {
+			n_seg = this->pos_seg_len(pos, n - j);
+			this->items_to_values(this->pos_addr(pos), n_seg, val + 2 + j);
+			pos = this->pos_inc(pos, n_seg);
+		}
+		if (! this->check_intact(i_abs)) continue; //read again
+		
+		av = this->spike_check_av; cnt_sp = 0;
+		if (check) {
+			for (unsigned int j = 0; j < n; j++)
+				dd[j] = (val[j + 2] - val[j + 1]) - (val[j + 1] - val[j]);
+			
+			for (unsigned int j = 0; j < n; j++) {
+				uint64_t cnt_cur = cnt_prev + j + 1; //count of items after pushing this item
+				if (cnt_cur > this->bufsize) cnt_cur = this->bufsize;
+				if (cnt_cur == 1) av = val[j + 2];
+				if (cnt_cur < 3) continue;
+				
+				ref = av;
+				if (fabs(ref) < this->spike_check_ref_min)
+					ref = this->spike_check_ref_min;
+				if (!ref) ref = 1;
+				
+				if (av != 0 && fabs(dd[j] / ref) > 0.05)
+					spikes[cnt_sp++] = i_abs + j - 1;
+				else
+					av = 0.9*av + 0.1*val[j + 2];
+			}
+		}
+		if (cnt_sp > 0) this->buf_spike_load(spikes, cnt_sp);
+		
+		this->spike_check_av = av;
+		this->spike_prev[0] = val[n]; this->spike_prev[1] = val[n + 1];
+		cnt_prev += n; if (cnt_prev > this->bufsize) cnt_prev = this->bufsize;
+		this->spike_run_cnt = cnt_prev;
+		this->i_abs_spike_next = i_abs + n;
 	}
+}
+
+uint64_t CircularBuffer::copy_items(IndexRange range_abs, unsigned int step, float* out, CopyFuncPtr func, void* obj) const
+{
+	if (step == 0) step = 1;
+	IndexRange range_avail = this->range_to_abs_sync(this->range_max()); //existing items
+	if (!range_abs || !range_avail.contain(range_abs.min())) return 0;
+	uint64_t i_end = range_avail.max() + 1, cnt_cpy = 0;
+	
+	// items taken in each contiguous part of the storage begin at its first item
+	uint64_t cnt = ((range_abs.max() < i_end)? range_abs.max() + 1 : i_end) - range_abs.min(),
+	         pos = this->abs_pos(range_abs.min());
+	float chunk[Copy_Chunk_Size];
+	for (uint64_t i = 0; i < cnt;) {
+		unsigned int n = this->pos_seg_len(pos, cnt - i), n_out = (n + step - 1) / step, m;
+		const unsigned char* p = this->pos_addr(pos);
+		for (unsigned int k = 0; k < n_out; k += m) {
+			m = n_out - k;
+			if (func && m > Copy_Chunk_Size) m = Copy_Chunk_Size;
+			this->items_to_values(p + (std::size_t)k * step * this->item_size, m,
+			                      func? chunk : out + cnt_cpy, step);
+			if (func) func(obj, chunk, m);
+			cnt_cpy += m;
+		}
+		
+		uint64_t adv = (uint64_t)n_out * step; //not less than n
+		i += adv; if (i < cnt) pos = this->pos_inc(pos, adv);
+	}
+	return cnt_cpy;
+}
+
+uint64_t CircularBuffer::copy_items_m4(IndexRange range_abs, unsigned int step, float* out, CopyFuncPtr func, void* obj) const
+{
+	if (step == 0) step = 1;
+	IndexRange range_avail = this->range_to_abs_sync(this->range_max()); //existing items
+	if (!range_abs || !range_avail.contain(range_abs.min())) return 0;
+	uint64_t i_last = (range_abs.max() < range_avail.max())? range_abs.max() : range_avail.max(), cnt_cpy = 0;
 	
-	float* p_add, * p_sub, * p_add_end, * p_sub_end;
-	if (flag_add) {
-		unsigned int add_cnt = IndexRange(il_add, ir_add).count_by_step(chk_step);
-		p_add = this->item_addr(this->index_to_rel(il_add));
-		p_add_end = this->ptr_inc(p_add, (add_cnt - 1)*chk_step);
-		cnt += add_cnt;
+	float chunk[Copy_Chunk_Size]; unsigned int n = 0; //Copy_Chunk_Size is a multiple of M4_Values
+	for (uint64_t i = range_abs.min(), j; i <= i_last; i = j + 1) {
+		j = (i_last - i >= step)? i + step - 1 : i_last;
+		float* p = func? chunk + n : out + cnt_cpy;
+		ValueRange range_val = this->index_value_range(IndexRange(i, j));
+		p[0] = this->item_value(this->pos_addr(this->abs_pos(i)));
+		p[1] = range_val.min(); p[2] = range_val.max();
+		p[3] = this->item_value(this->pos_addr(this->abs_pos(j)));
+		
+		cnt_cpy += M4_Values;
+		if (func && (n += M4_Values) == Copy_Chunk_Size) {
+			func(obj, chunk, n); n = 0;
+		}
+		if (j == i_last) break;
+	}
+	if (func && n > 0) func(obj, chunk, n);
+	return cnt_cpy;
+}
+
+void CircularBuffer::items_to_values(const unsigned char* data, unsigned int cnt, float* out, unsigned int step) const
+{
+	if (step > 1) {
+		switch (this->type) {
+			case Sample_Int16: raw_to_values_step((const int16_t*)data, cnt, step, this->scale, this->offset, out); break;
+			case Sample_Int32: raw_to_values_step((const int32_t*)data, cnt, step, this->scale, this->offset, out); break;
+			case Sample_Float: raw_to_values_step((const float*)data, cnt, step, this->scale, this->offset, out); break;
+			default:           raw_to_values_step((const double*)data, cnt, step, this->scale, this->offset, out); break;
+		}
+		return;
 	}
-	if (flag_subtract) {
-		unsigned int sub_cnt = IndexRange(il_sub, ir_sub).count_by_step(chk_step);
-		p_sub = this->item_addr(this->index_to_rel(il_sub));
-		p_sub_end = this->ptr_inc(p_sub, (sub_cnt - 1)*chk_step);
-		cnt -= sub_cnt;
+	
+	switch (this->type) {
+		case Sample_Int16: raw_to_values((const int16_t*)data, cnt, this->scale, this->offset, out); break;
+		case Sample_Int32: raw_to_values((const int32_t*)data, cnt, this->scale, this->offset, out); break;
+		case Sample_Float:
+			if (this->scale == 1 && this->offset == 0)
+				memcpy(out, data, cnt*sizeof(float));
+			else
+				raw_to_values((const float*)data, cnt, this->scale, this->offset, out);
+			break;
+		default: raw_to_values((const double*)data, cnt, this->scale, this->offset, out); break;
 	}
+}
+
+void CircularBuffer::index_load(const unsigned char* data, uint64_t cnt, uint64_t i_abs)
+{
+	if (this->parallel_threshold > 0 && cnt >= this->parallel_threshold
+	&&  this->index_load_parallel(data, cnt, i_abs)) return;
 	
+	unsigned int i_in_blk, cnt_blk;
+	BlockSummary smr;
+	while (cnt > 0) {
+		i_in_blk = i_abs & (Block_Size - 1);
+		cnt_blk = Block_Size - i_in_blk;
+		if (cnt_blk > cnt) cnt_blk = cnt;
+		
+		this->index_summarize(data, cnt_blk, smr);
+		this->index_load_block(data, cnt_blk, i_abs, smr);
+		data += cnt_blk * this->item_size; cnt -= cnt_blk; i_abs += cnt_blk;
+	}
+}
+
+bool CircularBuffer::index_load_parallel(const unsigned char* data, uint64_t cnt, uint64_t i_abs)
+{
+	unsigned int workers = std::thread::hardware_concurrency();
+	if (workers > Workers_Max) workers = Workers_Max;
+	
+	// complete blocks are summarized by the workers (including this thread), then
+	// the summaries are added into the index in order, which is cheap
+	uint64_t cnt_head = (Block_Size - (i_abs & (Block_Size - 1))) & (Block_Size - 1);
+	if (workers < 2 || cnt < cnt_head + Block_Size * workers) return false;
+	uint64_t cnt_blk = (cnt - cnt_head) >> Block_Size_Bits,
+	         part = (cnt_blk + workers - 1) / workers;
+	
+	BlockSummary* smrs = NULL;
+	try {
+		smrs = new BlockSummary[cnt_blk];
+	} catch (std::bad_alloc&) {
+		return false;
+	}
+	
+	const unsigned char* data_blk = data + cnt_head * this->item_size;
+	const std::size_t blk_bytes = (std::size_t)Block_Size * this->item_size;
+	std::vector<std::thread> threads; uint64_t b = 0;
+	try {
+		threads.reserve(workers - 1);
+		for (; b + part < cnt_blk && threads.size() < workers - 1; b += part)
+			threads.emplace_back(&CircularBuffer::index_summarize_blocks, this,
+			                     data_blk + b * blk_bytes, part, smrs + b);
+	} catch (std::exception&) {} //blocks left are summarized in this thread
+	this->index_summarize_blocks(data_blk + b * blk_bytes, cnt_blk - b, smrs + b);
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
+	
+	BlockSummary smr;
+	if (cnt_head > 0) {
+		this->index_summarize(data, cnt_head, smr);
+		this->index_load_block(data, cnt_head, i_abs, smr);
+	}
+	for (b = 0; b < cnt_blk; b++)
+		this->index_load_block(data_blk + b * blk_bytes, Block_Size,
+		                       i_abs + cnt_head + (b << Block_Size_Bits), smrs[b]);
+	delete[] smrs;
+	
+	uint64_t cnt_done = cnt_head + (cnt_blk << Block_Size_Bits);
+	if (cnt_done < cnt) {
+		this->index_summarize(data + cnt_done * this->item_size, cnt - cnt_done, smr);
+		this->index_load_block(data + cnt_done * this->item_size, cnt - cnt_done, i_abs + cnt_done, smr);
+	}
+	return true;
+}
+
+void CircularBuffer::index_summarize(const unsigned char* data, unsigned int cnt, BlockSummary& smr) const
+{
+	smr.sums.sum = smr.sums.sq_sum = 0;
+	this->scan_seg_value_range(data, cnt, smr.mm.min, smr.mm.max);
+	this->scan_seg_sums(data, cnt, smr.sums.sum, smr.sums.sq_sum);
+}
+
+void CircularBuffer::index_summarize_blocks(const unsigned char* data, uint64_t cnt_blk, BlockSummary* smrs) const
+{
+	const std::size_t blk_bytes = (std::size_t)Block_Size * this->item_size;
+	for (uint64_t b = 0; b < cnt_blk; b++)
+		this->index_summarize(data + b * blk_bytes, Block_Size, smrs[b]);
+}
+
+void CircularBuffer::index_load_block(const unsigned char* data, unsigned int cnt, uint64_t i_abs, const BlockSummary& smr)
+{
+	this->index_sums_add(smr.sums.sum, smr.sums.sq_sum);
+	if (this->hist_bins)
+		for (unsigned int k = 0; k < cnt; k++)
+			this->hist_push(i_abs + k, this->item_value(data + k * this->item_size));
+	
+	unsigned int i_in_blk = i_abs & (Block_Size - 1);
+	MinMax& node = this->index_mm_lv[0][(i_abs >> Block_Size_Bits) & this->index_mm_mask[0]];
+	if (i_in_blk == 0) {
+		node = smr.mm;
+	} else {
+		if (smr.mm.min < node.min) node.min = smr.mm.min;
+		if (smr.mm.max > node.max) node.max = smr.mm.max;
+	}
+	if (i_in_blk + cnt == Block_Size)
+		this->index_block_done(i_abs >> Block_Size_Bits);
+}
+
+void CircularBuffer::scan_seg_value_range(const unsigned char* p, unsigned int n, float& min, float& max) const
+{
+	double raw_min, raw_max;
+	switch (this->type) {
+		case Sample_Int16: scan_raw_min_max((const int16_t*)p, n, raw_min, raw_max); break;
+		case Sample_Int32: scan_raw_min_max((const int32_t*)p, n, raw_min, raw_max); break;
+		case Sample_Float: {
+			float f_min, f_max; f_min = f_max = *(const float*)p;
+			scan_seg_min_max((const float*)p, n, f_min, f_max);
+			if (this->scale == 1 && this->offset == 0) {min = f_min; max = f_max; return;}
+			raw_min = f_min; raw_max = f_max; break;
+		}
+		default: scan_raw_min_max((const double*)p, n, raw_min, raw_max); break;
+	}
+	min = raw_min * this->scale + this->offset; max = raw_max * this->scale + this->offset;
+}
+
+void CircularBuffer::scan_seg_sums(const unsigned char* p, unsigned int n, double& sum, double& sq_sum) const
+{
+	double raw_sum, raw_sq_sum;
+	switch (this->type) {
+		case Sample_Int16: scan_raw_sums((const int16_t*)p, n, raw_sum, raw_sq_sum); break;
+		case Sample_Int32: scan_raw_sums((const int32_t*)p, n, raw_sum, raw_sq_sum); break;
+		case Sample_Float:
+			raw_sum = raw_sq_sum = 0;
+			::scan_seg_sums((const float*)p, n, raw_sum, raw_sq_sum); break;
+		default: scan_raw_sums((const double*)p, n, raw_sum, raw_sq_sum); break;
+	}
+	
+	// sum of (s*r + o) and sum of (s*r + o)^2
+	double s = this->scale, o = this->offset;
+	sum = s*raw_sum + n*o;
+	sq_sum = s*s*raw_sq_sum + 2*s*o*raw_sum + n*o*o;
+}
+
+void CircularBuffer::index_block_done(uint64_t i_blk)
+{
+	this->index_sums[i_blk & this->index_mm_mask[0]] = this->sums_run;
+	
+	MinMax mm = this->index_mm_lv[0][i_blk & this->index_mm_mask[0]];
+	
+	for (unsigned int lv = 1; lv < this->index_levels; lv++) {
+		MinMax& node = this->index_mm_lv[lv][(i_blk >> lv) & this->index_mm_mask[lv]];
+		if ((i_blk & (((uint64_t)1 << lv) - 1)) == 0) //first block of the node
+			node = mm;
+		else {
+			if (mm.min < node.min) node.min = mm.min;
+			if (mm.max > node.max) node.max = mm.max;
+		}
+	}
+	
+	for (unsigned int i = 0; i < Windows_Max; i++) {
+		Window& win = this->windows[i];
+		if (win.state == Window_Free) continue;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (win.state == Window_Retired)
+			win.state = Window_Free; //the writer won't touch it until it's registered again
+		else if (win.flag_rebuild)
+			this->window_rebuild(win, i_blk);
+		else
+			this->window_add_block(win, i_blk);
+	}
+}
+
+void CircularBuffer::window_add_block(Window& win, uint64_t i_blk)
+{
+	const MinMax& mm = this->index_mm_lv[0][i_blk & this->index_mm_mask[0]];
+	uint64_t i_end = (i_blk + 1) << Block_Size_Bits,
+	         blk_first = (i_end > win.width)? (i_end - win.width) >> Block_Size_Bits : 0;
+	
+	for (unsigned int k = 0; k < 2; k++) {
+		uint64_t* deq = win.deq[k];
+		// drop blocks out of the window from the front
+		while (win.deq_cnt[k] > 0 && deq[win.deq_first[k]] < blk_first) {
+			win.deq_first[k] = (win.deq_first[k] + 1) & win.deq_mask; win.deq_cnt[k]--;
+		}
+		// drop blocks that can't be the extreme value any more from the back
+		while (win.deq_cnt[k] > 0) {
+			uint64_t blk = deq[(win.deq_first[k] + win.deq_cnt[k] - 1) & win.deq_mask];
+			const MinMax& node = this->index_mm_lv[0][blk & this->index_mm_mask[0]];
+			if (k == 0 && node.min < mm.min) break;
+			if (k == 1 && node.max > mm.max) break;
+			win.deq_cnt[k]--;
+		}
+		if (win.deq_cnt[k] > win.deq_mask) { //shouldn't happen
+			win.deq_first[k] = (win.deq_first[k] + 1) & win.deq_mask; win.deq_cnt[k]--;
+		}
+		deq[(win.deq_first[k] + win.deq_cnt[k]) & win.deq_mask] = i_blk;
+		win.deq_cnt[k]++;
+	}
+}
+
+void CircularBuffer::window_rebuild(Window& win, uint64_t i_blk)
+{
+	win.deq_first[0] = win.deq_first[1] = 0;
+	win.deq_cnt[0] = win.deq_cnt[1] = 0;
+	
+	// blocks of overwritten items are not available
+	uint64_t i_end = (i_blk + 1) << Block_Size_Bits,
+	         i_first = (i_end > win.width)? i_end - win.width : 0;
+	if (i_first < this->cnt_overwrite) i_first = this->cnt_overwrite;
+	for (uint64_t blk = i_first >> Block_Size_Bits; blk <= i_blk; blk++)
+		this->window_add_block(win, blk);
+	
+	win.flag_rebuild = false;
+}
+
+void CircularBuffer::windows_reset()
+{
+	for (unsigned int i = 0; i < Windows_Max; i++)
+		this->windows[i].flag_rebuild = true;
+}
+
+bool CircularBuffer::get_sums(IndexRange& range, double& sum, double& sq_sum)
+{
+	if (this->cnt == 0) return false;
+	
+	IndexRange range_abs;
+	this->lock();
+	do { //retry only in lock-free mode
+		range_abs = this->range_to_abs_sync(range);
+		if (! range_abs) break;
+		this->index_get_sums(range_abs, sum, sq_sum);
+	} while (! this->check_intact(range_abs.min()));
 	this->unlock();
 	
-	if (flag_subtract) while (true) {
-		sum -= *p_sub;
-		if (p_sub == p_sub_end) break;
-		p_sub = this->ptr_inc(p_sub, chk_step);
+	range = range_abs;
+	return (bool)range_abs;
+}
+
+void CircularBuffer::index_sums_reset()
+{
+	this->sums_run.sum = this->sums_run.sq_sum = 0;
+	this->sums_comp.sum = this->sums_comp.sq_sum = 0;
+	this->i_abs_sums_reset = this->count_overall();
+	
+	if (this->hist_bins) memset(this->hist_run, 0, this->hist_bins * sizeof(uint64_t));
+	this->i_abs_hist_reset = this->i_abs_sums_reset;
+}
+
+void CircularBuffer::scan_sums(IndexRange range_abs, double& sum, double& sq_sum) const
+{
+	uint64_t pos = this->abs_pos(range_abs.min()), cnt = range_abs.count();
+	
+	double seg_sum, seg_sq_sum;
+	for (uint64_t i = 0, n; i < cnt; i += n) {
+		n = this->pos_seg_len(pos, cnt - i);
+		this->scan_seg_sums(this->pos_addr(pos), n, seg_sum, seg_sq_sum);
+		sum += seg_sum; sq_sum += seg_sq_sum;
+		pos = this->pos_inc(pos, n);
+	}
+}
+
+void CircularBuffer::index_get_sums(IndexRange range_abs, double& sum, double& sq_sum) const
+{
+	sum = sq_sum = 0;
+	
+	// blocks in [blk_l, blk_r) are completely inside the range
+	uint64_t blk_l = (range_abs.min() + Block_Size - 1) >> Block_Size_Bits,
+	         blk_r = (range_abs.max() + 1) >> Block_Size_Bits;
+	if (blk_l >= blk_r) {
+		this->scan_sums(range_abs, sum, sq_sum);
+		return;
+	}
+	
+	// scan items outside of these blocks
+	if (range_abs.min() < (blk_l << Block_Size_Bits))
+		this->scan_sums(IndexRange(range_abs.min(), (blk_l << Block_Size_Bits) - 1), sum, sq_sum);
+	if (range_abs.max() >= (blk_r << Block_Size_Bits))
+		this->scan_sums(IndexRange(blk_r << Block_Size_Bits, range_abs.max()), sum, sq_sum);
+	
+	// prefix sums before block blk_l are zero if the block begins at the reset point
+	const Sums& sums_r = this->index_sums[(blk_r - 1) & this->index_mm_mask[0]];
+	sum += sums_r.sum; sq_sum += sums_r.sq_sum;
+	if ((blk_l << Block_Size_Bits) > this->i_abs_sums_reset) {
+		const Sums& sums_l = this->index_sums[(blk_l - 1) & this->index_mm_mask[0]];
+		sum -= sums_l.sum; sq_sum -= sums_l.sq_sum;
+	}
+}
+
+void CircularBuffer::scan_value_range(IndexRange range_abs, float& min, float& max) const
+{
+	uint64_t pos = this->abs_pos(range_abs.min()), cnt = range_abs.count();
+	
+	float seg_min, seg_max;
+	for (uint64_t i = 0, n; i < cnt; i += n) {
+		n = this->pos_seg_len(pos, cnt - i);
+		this->scan_seg_value_range(this->pos_addr(pos), n, seg_min, seg_max);
+		if (seg_min < min) min = seg_min;
+		if (seg_max > max) max = seg_max;
+		pos = this->pos_inc(pos, n);
+	}
+}
+
+ValueRange CircularBuffer::index_value_range(IndexRange range_abs) const
+{
+	using std::numeric_limits;
+	float min = numeric_limits<float>::max(), max = numeric_limits<float>::lowest();
+	
+	// blocks in [blk_l, blk_r) are completely inside the range
+	uint64_t blk_l = (range_abs.min() + Block_Size - 1) >> Block_Size_Bits,
+	         blk_r = (range_abs.max() + 1) >> Block_Size_Bits;
+	if (blk_l >= blk_r) {
+		this->scan_value_range(range_abs, min, max);
+		return ValueRange(min, max);
+	}
+	
+	// scan items outside of these blocks
+	if (range_abs.min() < (blk_l << Block_Size_Bits))
+		this->scan_value_range(IndexRange(range_abs.min(), (blk_l << Block_Size_Bits) - 1), min, max);
+	if (range_abs.max() >= (blk_r << Block_Size_Bits))
+		this->scan_value_range(IndexRange(blk_r << Block_Size_Bits, range_abs.max()), min, max);
+	
+	// climb up the pyramid
+	unsigned int lv = 0; const MinMax* node;
+	while (blk_l < blk_r) {
+		if (lv == this->index_levels - 1) { //top level, the ring has only a few nodes
+			for (; blk_l < blk_r; blk_l++) {
+				node = &this->index_mm_lv[lv][blk_l & this->index_mm_mask[lv]];
+				if (node->min < min) min = node->min;
+				if (node->max > max) max = node->max;
+			}
+			break;
+		}
+		if (blk_l & 1) {
+			node = &this->index_mm_lv[lv][blk_l & this->index_mm_mask[lv]]; blk_l++;
+			if (node->min < min) min = node->min;
+			if (node->max > max) max = node->max;
+		}
+		if (blk_r & 1) {
+			blk_r--; node = &this->index_mm_lv[lv][blk_r & this->index_mm_mask[lv]];
+			if (node->min < min) min = node->min;
+			if (node->max > max) max = node->max;
+		}
+		blk_l >>= 1; blk_r >>= 1; lv++;
+	}
+	
+	return ValueRange(min, max);
+}
+
+bool CircularBuffer::scan_find(IndexRange range_abs, float thr, bool above, bool forward, uint64_t& i_abs_out) const
+{
+	uint64_t cnt = range_abs.count();
+	for (uint64_t j = 0; j < cnt; j++) {
+		uint64_t i_abs = forward? range_abs.min() + j : range_abs.max() - j;
+		float val = this->item_value(this->pos_addr(this->abs_pos(i_abs)));
+		if (above? (val > thr) : (val < thr)) {
+			i_abs_out = i_abs; return true;
+		}
 	}
-	if (flag_add) while (true) {
-		sum += *p_add;
-		if (p_add == p_add_end) break;
-		p_add = this->ptr_inc(p_add, chk_step);
+	return false;
+}
+
+bool CircularBuffer::index_find(IndexRange range_abs, float thr, bool above, bool forward, uint64_t& i_abs_out) const
+{
+	// blocks in [blk_l, blk_r) are completely inside the range
+	uint64_t blk_l = (range_abs.min() + Block_Size - 1) >> Block_Size_Bits,
+	         blk_r = (range_abs.max() + 1) >> Block_Size_Bits;
+	if (blk_l >= blk_r)
+		return this->scan_find(range_abs, thr, above, forward, i_abs_out);
+	
+	// items outside of these blocks
+	IndexRange range_head, range_tail;
+	if (range_abs.min() < (blk_l << Block_Size_Bits))
+		range_head.set(range_abs.min(), (blk_l << Block_Size_Bits) - 1);
+	if (range_abs.max() >= (blk_r << Block_Size_Bits))
+		range_tail.set(blk_r << Block_Size_Bits, range_abs.max());
+	
+	if (range_head && forward && this->scan_find(range_head, thr, above, true, i_abs_out)) return true;
+	if (range_tail && !forward && this->scan_find(range_tail, thr, above, false, i_abs_out)) return true;
+	
+	// walk through the blocks from one end: climb up the pyramid while the node at the current
+	// position is aligned and inside the range, skip it if it can't match, otherwise go down
+	// into it. blk is the next block to be checked (the end of blocks left if backward)
+	unsigned int lv = 0; uint64_t blk = forward? blk_l : blk_r;
+	bool climb = true; //not after going down
+	while (forward? (blk < blk_r) : (blk > blk_l)) {
+		if (climb) {
+			uint64_t cnt_left = forward? (blk_r - blk) : (blk - blk_l);
+			while (lv > 0 && ((uint64_t)1 << lv) > cnt_left) lv--;
+			while (lv + 1 < this->index_levels && (blk & (((uint64_t)2 << lv) - 1)) == 0 && ((uint64_t)2 << lv) <= cnt_left)
+				lv++;
+		}
+		
+		uint64_t blk_node = forward? blk : blk - ((uint64_t)1 << lv); //first block of the node
+		const MinMax& node = this->index_mm_lv[lv][(blk_node >> lv) & this->index_mm_mask[lv]];
+		if (above? (node.max > thr) : (node.min < thr)) {
+			if (lv > 0) {lv--; climb = false; continue;}
+			IndexRange range_blk(blk_node << Block_Size_Bits, ((blk_node + 1) << Block_Size_Bits) - 1);
+			if (this->scan_find(range_blk, thr, above, forward, i_abs_out)) return true;
+			//otherwise the block has been overwritten (lock-free mode), the caller will retry
+		}
+		blk = forward? blk + ((uint64_t)1 << lv) : blk_node; climb = true;
 	}
 	
-	last.av_val = sum / cnt;
-	last.range_i_av_val = range;
+	if (range_tail && forward && this->scan_find(range_tail, thr, above, true, i_abs_out)) return true;
+	if (range_head && !forward && this->scan_find(range_head, thr, above, false, i_abs_out)) return true;
+	return false;
+}
+
+bool CircularBuffer::find(IndexRange range, float thr, bool above, bool forward, uint64_t& i_out)
+{
+	if (this->cnt == 0) return false;
+	
+	IndexRange range_abs; uint64_t i_abs; bool found;
+	this->lock();
+	do { //retry only in lock-free mode
+		found = false;
+		range_abs = this->range_to_abs_sync(range);
+		if (! range_abs) break;
+		found = this->index_find(range_abs, thr, above, forward, i_abs);
+	} while (! this->check_intact(range_abs.min()));
+	if (found) i_out = this->index_to_rel(i_abs);
+	this->unlock();
+	
+	return found;
+}
+
+bool CircularBuffer::find_extremum(IndexRange range, bool is_max, uint64_t& i_out)
+{
+	if (this->cnt == 0) return false;
+	
+	using std::numeric_limits;
+	IndexRange range_abs; uint64_t i_abs; bool found;
+	this->lock();
+	do { //retry only in lock-free mode
+		found = false;
+		range_abs = this->range_to_abs_sync(range);
+		if (! range_abs) break;
+		
+		// item >= max is equivalent to item > (the float value before max)
+		ValueRange range_val = this->index_value_range(range_abs);
+		float thr = is_max? std::nextafter(range_val.max(), numeric_limits<float>::lowest())
+		                  : std::nextafter(range_val.min(), numeric_limits<float>::max());
+		found = this->index_find(range_abs, thr, is_max, true, i_abs);
+	} while (! this->check_intact(range_abs.min()));
+	if (found) i_out = this->index_to_rel(i_abs);
+	this->unlock();
 	
-	this->lock_info.lock();
-	this->last_av_calc = last;
-	this->lock_info.unlock();
+	return found;
+}
+
+uint64_t CircularBuffer::hist_layout(uint64_t sz) const
+{
+	uint64_t ring = 1;
+	while (ring < (sz >> Hist_Block_Size_Bits) + 3) ring <<= 1;
+	return ring - 1;
+}
+
+void CircularBuffer::hist_count_all()
+{
+	memset(this->hist_run, 0, this->hist_bins * sizeof(uint64_t));
+	this->i_abs_hist_reset = this->cnt_overwrite;
 	
-	return last.av_val;
+	uint64_t pos = this->item_pos(0), cnt = this->cnt;
+	for (uint64_t i = 0, n; i < cnt; i += n) {
+		n = this->pos_seg_len(pos, cnt - i);
+		const unsigned char* p = this->pos_addr(pos);
+		for (uint64_t k = 0; k < n; k++)
+			this->hist_push(this->cnt_overwrite + i + k, this->item_value(p + k * this->item_size));
+		pos = this->pos_inc(pos, n);
+	}
+}
+
+void CircularBuffer::scan_hist(IndexRange range_abs, uint64_t* counts) const
+{
+	uint64_t pos = this->abs_pos(range_abs.min()), cnt = range_abs.count();
+	for (uint64_t i = 0, n; i < cnt; i += n) {
+		n = this->pos_seg_len(pos, cnt - i);
+		const unsigned char* p = this->pos_addr(pos);
+		for (uint64_t k = 0; k < n; k++)
+			counts[this->hist_bin(this->item_value(p + k * this->item_size))]++;
+		pos = this->pos_inc(pos, n);
+	}
 }
 
+void CircularBuffer::index_get_hist(IndexRange range_abs, uint64_t* counts) const
+{
+	unsigned int bins = this->hist_bins;
+	memset(counts, 0, bins * sizeof(uint64_t));
+	
+	// blocks in [blk_l, blk_r) are completely inside the range
+	uint64_t blk_l = (range_abs.min() + Hist_Block_Size - 1) >> Hist_Block_Size_Bits,
+	         blk_r = (range_abs.max() + 1) >> Hist_Block_Size_Bits;
+	if (blk_l >= blk_r) {
+		this->scan_hist(range_abs, counts);
+		return;
+	}
+	
+	// scan items outside of these blocks
+	if (range_abs.min() < (blk_l << Hist_Block_Size_Bits))
+		this->scan_hist(IndexRange(range_abs.min(), (blk_l << Hist_Block_Size_Bits) - 1), counts);
+	if (range_abs.max() >= (blk_r << Hist_Block_Size_Bits))
+		this->scan_hist(IndexRange(blk_r << Hist_Block_Size_Bits, range_abs.max()), counts);
+	
+	// stored counts before block blk_l are zero if the block begins at the reset point
+	const uint64_t* counts_r = this->hist_prefix + ((blk_r - 1) & this->hist_mask) * bins;
+	for (unsigned int b = 0; b < bins; b++) counts[b] += counts_r[b];
+	if ((blk_l << Hist_Block_Size_Bits) > this->i_abs_hist_reset) {
+		const uint64_t* counts_l = this->hist_prefix + ((blk_l - 1) & this->hist_mask) * bins;
+		for (unsigned int b = 0; b < bins; b++) counts[b] -= counts_l[b];
+	}
+}
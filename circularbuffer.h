@@ -6,9 +6,12 @@
 #define SIMPLE_CAIRO_PLOT_CIRCULAR_BUFFER_H
 
 #include <stdexcept>
+#include <string>
 #include <thread> //this_thread::sleep_for()
-#include <mutex>
 #include <atomic> //atomic_flag, atomic_uint
+#include <cstdint> //int16_t, int32_t
+#include <cstring> //memcpy()
+#include <vector>
 
 #include <simple-cairo-plot/axisrange.h> //<cmath> included
 
@@ -22,7 +25,21 @@
 
 namespace SimpleCairoPlot
 {
-class CircularBuffer; struct BufRangeMap;
+class CircularBuffer; struct BufRangeMap; struct BufferView; class HistoryStore; class BufferGroup;
+template <typename T> class CircularBufferT;
+
+// type of items stored in the buffer; integer items are converted to float values by
+// `value = item * scale + offset` (see CircularBuffer::set_scale()).
+enum SampleType {Sample_Int16, Sample_Int32, Sample_Float, Sample_Double};
+
+template <typename T> struct SampleTypeOf; //not defined for unsupported types
+template <> struct SampleTypeOf<int16_t> {enum {Value = Sample_Int16};};
+template <> struct SampleTypeOf<int32_t> {enum {Value = Sample_Int32};};
+template <> struct SampleTypeOf<float> {enum {Value = Sample_Float};};
+template <> struct SampleTypeOf<double> {enum {Value = Sample_Double};};
+
+// receives values copied by CircularBuffer::copy_range() in chunks; obj is passed through
+using CopyFuncPtr = void (*)(void* obj, const float* vals, unsigned int cnt);
 
 // mapping from index range in the circular buffer to 1 or 2 segment(s) in memory
 struct BufRangeMap {
@@ -31,98 +48,442 @@ struct BufRangeMap {
 	BufRangeMap(IndexRange range, unsigned int bufsize, unsigned int cur);
 };
 
+// pinned view of items in a range of the buffer, made without locking or copying: items
+// are read in place from contiguous segments in the storage type of the buffer (a segment
+// ends at the end of a storage segment or the end of the ring). the writer may keep pushing
+// while the view is used, so check count_lost() or intact() after reading items; the oldest
+// items are always overwritten first. resize() of the buffer invalidates the view.
+struct BufferView {
+	const CircularBuffer* buf = NULL;
+	uint64_t i_abs = 0; //absolute index of the first item
+	unsigned int generation = 0; //see CircularBuffer::generation()
+	SampleType type = Sample_Float; float scale = 1, offset = 0;
+	
+	// position of the first item in the ring, the ring size and storage segments of the buffer
+	uint64_t pos = 0, cnt = 0, bufsize = 0; unsigned int item_size = sizeof(float);
+	unsigned char* const* segs = NULL;
+	
+	uint64_t count() const;
+	operator bool() const;
+	unsigned int segment_count() const;
+	unsigned int segment_size(unsigned int i_seg) const;
+	template <typename T> const T* segment(unsigned int i_seg) const; //T must be the storage type
+	float item(uint64_t i) const; //converted by scale and offset
+	
+	uint64_t count_lost() const; //amount of items (from the first) overwritten or cleared
+	bool intact() const;
+};
+
 class CircularBuffer
 {
 public:
 	// locks for writing (except the constructor without parameter and the destructor)
-	CircularBuffer(); void init(unsigned int sz); //init() must be called if this constructor is used
-	CircularBuffer(unsigned int sz);
+	CircularBuffer(); void init(uint64_t sz, SampleType type = Sample_Float); //init() must be called if this constructor is used
+	CircularBuffer(uint64_t sz, SampleType type = Sample_Float);
+	CircularBuffer(const std::string& file_path, uint64_t sz, SampleType type = Sample_Float);
 	CircularBuffer(CircularBuffer& from); //`from` is locked here for reading
 	CircularBuffer(const CircularBuffer& from);
 	CircularBuffer& operator=(const CircularBuffer& buf);
 	~CircularBuffer();
 	
-	unsigned int size() const; unsigned int spike_buffer_size() const;
+	// file-backed storage: items, spike buffer, index and counters are kept in a memory-mapped
+	// file, so the buffer can be larger than RAM, and data survives restarting of the process.
+	// if the file exists, it is reattached (sz and type must be the same as before), otherwise
+	// it's created. throws runtime_error on failure, and the file is never overwritten.
+	void init(const std::string& file_path, uint64_t sz, SampleType type = Sample_Float);
+	bool is_file_backed() const;
+	bool sync_file(bool wait = true); //writes changes back to the file (msync); locks for reading
+	void set_file_sync_interval(unsigned int cnt_items); //0: never sync automatically (default)
+	
+	// items are stored in segments of Segment_Size items, allocated when the writer reaches
+	// them. resize() changes the size by whole segments (the result is at least sz if growing,
+	// and at most sz if shrinking) without re-init: new space is inserted after the latest
+	// item, or the oldest items are discarded; existing items are not moved, except that items
+	// in the segment containing the end position may be copied once. locks for writing, so in
+	// lock-free mode it should be called by the writer thread. throws bad_alloc; returns false
+	// for file-backed buffers, or if the buffer would exceed 2^32 segments.
+	enum {Segment_Size_Bits = 12, Segment_Size = 1 << Segment_Size_Bits};
+	bool resize(uint64_t sz);
+	
+	// compressed history of overwritten items (cold tier, see HistoryStore), taking `capacity`
+	// bytes of memory at most; the oldest history is dropped when it's full. 0: disabled (default).
+	// locks for writing, throws bad_alloc. it isn't kept in the file of a file-backed buffer.
+	void set_history_capacity(std::size_t capacity);
+	IndexRange history_range() const; //absolute indexes of items available, including current items
+	
+	// lock for reading. range_abs is absolute, it may cover the history and current items
+	ValueRange get_history_value_range(IndexRange range_abs);
+	float get_history_average(IndexRange range_abs);
+	uint64_t copy_history(IndexRange range_abs, float* out); //returns amount of items copied
+	
+	uint64_t size() const; unsigned int spike_buffer_size() const;
+	SampleType sample_type() const; float sample_scale() const; float sample_offset() const;
 	bool is_valid_range(IndexRange range) const;
-	unsigned int count() const;
+	uint64_t count() const;
 	IndexRange range() const;
 	IndexRange range_max() const;
 	bool is_full() const;
-	unsigned long int count_overwritten() const;
-	unsigned long int count_overall() const;
+	uint64_t count_overwritten() const;
+	uint64_t count_overall() const;
 	
-	unsigned long int index_to_abs(unsigned int i) const; //returns a fixed index after filling
-	unsigned int index_to_rel(unsigned long int i) const; //turn back to "relative" index
+	uint64_t index_to_abs(uint64_t i) const; //returns a fixed index after filling
+	uint64_t index_to_rel(uint64_t i) const; //turn back to "relative" index
 	IndexRange range_to_abs(IndexRange range) const;
 	IndexRange range_to_rel(IndexRange range_abs) const;
 	
-	float& item(unsigned int i) const;
-	float& operator[](unsigned int i) const;
-	float& abs_index_item(unsigned long int i) const;
-	float& last_item() const;
+	// items are returned by value, because they may be stored in another type
+	float item(uint64_t i) const;
+	float operator[](uint64_t i) const;
+	float abs_index_item(uint64_t i) const;
+	float last_item() const;
 	
-	// locks for writing
+	// copies values of items in range_abs (absolute indexes) taking one item of every `step`
+	// items, reading storage segments directly. range_abs.min() must be available, the rest
+	// of the range is limited to existing items; returns the amount of values copied. locks
+	// for reading; the counters are read consistently with the writer (see set_option_lock_free()),
+	// but in lock-free mode, call check_intact(range_abs.min()) afterwards. func
+	// is called with chunks of at most Copy_Chunk_Size values, and it shouldn't call member
+	// functions of this buffer that lock for writing.
+	enum {Copy_Chunk_Size = 256};
+	uint64_t copy_range(IndexRange range_abs, unsigned int step, float* out);
+	uint64_t copy_range(IndexRange range_abs, unsigned int step, CopyFuncPtr func, void* obj);
+	
+	// like copy_range(), but M4_Values values are copied for each group of `step` items
+	// beginning at range_abs.min(): the first item, the minimum, the maximum and the last item
+	// (the last group may be partial). drawn at the same x position, they cover the same pixels
+	// as all items of a group that doesn't exceed a pixel column. min/max cost O(log n) time
+	// by the index. returns the amount of values copied; chunks passed to func hold whole groups.
+	enum {M4_Values = 4};
+	uint64_t copy_range_m4(IndexRange range_abs, unsigned int step, float* out);
+	uint64_t copy_range_m4(IndexRange range_abs, unsigned int step, CopyFuncPtr func, void* obj);
+	
+	// doesn't lock. the view of the whole buffer is returned if range is not given
+	BufferView view() const;
+	BufferView view(IndexRange range) const;
+	
+	// locks for writing. in lock-free mode (Lock_Seq), the `lock` argument of push() is ignored:
+	// it locks only if the push compacts the buffer, otherwise readers retry by the seqlock
+	bool set_scale(float scale, float offset = 0); //scale must be positive. it clears the buffer
 	void clear(bool clear_history_count = false);
 	void erase();
 	void push(float val, bool spike_check = true, bool lock = true);
-	void load(const float* data, unsigned int cnt, bool spike_check = true); //optimized without spike check
+	void load(const float* data, uint64_t cnt, bool spike_check = true);
+	
+	// storage segments are allocated when the writer reaches them. if it fails, push() drops
+	// the item instead of throwing bad_alloc in the writer thread, and is_alloc_failed() returns
+	// true until clear() is called. push_reserve() allocates storage for the next push() ahead
+	// (push() calls it), returns false on failure; it should be called by the writer
+	bool push_reserve();
+	bool is_alloc_failed() const;
 	
-	// get_spikes() locks for reading
+	// push() never waits for readers in this mode. readers take a consistent snapshot of the
+	// counters and positions (seqlock: read_begin() and read_retry(), retrying if push() is
+	// done meanwhile), then read items in place, and retry the whole query if the first item
+	// of the range has been overwritten (check_intact()), so long reads are not starved.
+	// only one thread should write to the buffer, and clear(), load() or resize() should not be
+	// called while it's pushing data. default: false
+	void set_option_lock_free(bool set); //same as set_lock_policy(set? Lock_Seq : Lock_Read_Write)
+	
+	// Lock_Read_Write: readers share the spinlock, writers wait for them (default);
+	// Lock_Exclusive: readers exclude each other too; Lock_Seq: lock-free mode (see above);
+	// Lock_None: no synchronization at all, for a buffer used by a single thread.
+	// if SIMPLE_CAIRO_PLOT_LOCK_POLICY is defined as one of them (for the library and the
+	// program), the policy is fixed at compile time and set_lock_policy() returns false.
+	enum LockPolicy {Lock_Read_Write = 0, Lock_Exclusive, Lock_Seq, Lock_None};
+	bool set_lock_policy(LockPolicy policy); //don't call it while other threads use the buffer
+	LockPolicy lock_policy() const;
+	bool check_intact(uint64_t i_abs) const; //false if the item has been (or is being) overwritten
+	uint64_t index_intact_min() const; //absolute index of the oldest item not being overwritten
+	unsigned int generation() const; //increased by clear(), resize() and compaction, so that pinned views can detect it
+	
+	// when the buffer is full, existing items are compacted at half resolution instead of
+	// being overwritten: every 4 items are replaced by their min and max (in their original
+	// order), and from then on, min and max of every 2*sample_stride() samples pushed are
+	// stored as a pair of items, so that a session of any length fits in the buffer. push()
+	// takes the write lock while compacting, even in lock-free mode. ignored for file-backed
+	// buffers or buffers smaller than 4 items. default: false
+	void set_option_compact_on_full(bool set);
+	uint64_t sample_stride() const; //amount of samples each item stands for, reset by clear()
+	uint64_t sample_index(uint64_t i) const; //index of the first sample of item i
+	
+	// when load() (or load_raw()) gets at least `cnt` items, min/max and sums of their blocks
+	// are calculated by up to Workers_Max threads before being added into the index. 0 means
+	// single-threaded. default: Parallel_Threshold_Default
+	enum {Workers_Max = 8, Parallel_Threshold_Default = 1 << 20};
+	void set_parallel_threshold(uint64_t cnt);
+	
+	// get_spikes() locks for reading. spike check is done lazily here for new items, in chunks;
+	// spike_check of the latest push() or load() decides whether new items are checked.
 	void set_spike_check_ref_min(float val);
 	unsigned int get_spikes(unsigned int* buf_out); //short naming, actually turning points
-	unsigned int get_spikes(IndexRange range, unsigned int* buf_out);
-	unsigned int get_spikes(IndexRange range, unsigned long int* buf_out);
+	unsigned int get_spikes(IndexRange range, unsigned int* buf_out); //only for buffers within 4G items
+	unsigned int get_spikes(IndexRange range, uint64_t* buf_out); //absolute indexes
 	
-	// locks for reading; optimized for scrolling right
+	// locks for reading. get_value_range() costs O(log n) time by the min/max index,
+	// get_average(), get_rms() and get_std_dev() cost O(1) time by block prefix sums.
+	// chk_step is ignored because the results are always exact. ranges are relative, so they
+	// only cover current items; get_history_value_range(), etc. also cover the history.
 	ValueRange get_value_range(unsigned int chk_step = 1);
 	ValueRange get_value_range(IndexRange range, unsigned int chk_step = 1);
 	float get_average(unsigned int chk_step = 1);
 	float get_average(IndexRange range, unsigned int chk_step = 1);
+	float get_rms(IndexRange range); //root mean square
+	float get_std_dev(IndexRange range); //standard deviation
+	
+	// sliding windows of the latest `width` items, for live-tail autoscaling. min/max of
+	// complete blocks in each window are kept in monotonic deques updated on push() and
+	// load(), so get_window_value_range() scans only the partial blocks at both ends,
+	// whatever the width is. window_register() returns -1 if all windows are used, and
+	// throws bad_alloc. in lock-free mode, a window unregistered is reused after the writer
+	// completes a block.
+	enum {Windows_Max = 8};
+	int window_register(uint64_t width); //locks for writing
+	void window_unregister(int id);
+	ValueRange get_window_value_range(int id); //locks for reading
+	
+	// searching by the min/max index: blocks whose min/max values can't match are skipped
+	// through the pyramid, so only the blocks containing a match and the partial blocks at
+	// both ends are scanned. indexes are relative; false is returned if nothing is found and
+	// i_out is not changed. if forward is false, the last match is returned. locks for reading.
+	bool find_above(IndexRange range, float thr, uint64_t& i_out, bool forward = true); //item > thr
+	bool find_below(IndexRange range, float thr, uint64_t& i_out, bool forward = true); //item < thr
+	
+	// the first index i after i_from (or the last index i before i_from, if forward is false)
+	// that items i - 1 and i are on different sides of thr; an item equal to thr is below it
+	bool find_crossing(uint64_t i_from, float thr, uint64_t& i_out, bool forward = true);
+	
+	// the first index of the maximum or minimum value in the range
+	bool find_max(IndexRange range, uint64_t& i_out);
+	bool find_min(IndexRange range, uint64_t& i_out);
 	
-	// the buffer can be locked externally ONLY before writing to or reading multiple
-	// data from the buffer through operator[]; member functions that lock for writing
-	// should NOT be called inside that lock() and unlock() pair.
+	// fixed-bin histograms for quantiles and value distributions of any range: counts of
+	// each bin are accumulated like the prefix sums and stored for each block of
+	// Hist_Block_Size items, so a range costs O(bins) time plus scanning of the partial
+	// blocks at both ends. values out of `range` are counted in the first or the last bin.
+	// existing items are counted by set_histogram(); bins = 0 disables it (default). it
+	// locks for writing (call it in the writer thread in lock-free mode), throws bad_alloc,
+	// and returns false if the range is empty. it isn't kept in the file of a file-backed buffer.
+	enum {Hist_Block_Size_Bits = 12, Hist_Block_Size = 1 << Hist_Block_Size_Bits};
+	bool set_histogram(ValueRange range, unsigned int bins);
+	unsigned int histogram_bins() const;
+	ValueRange histogram_range() const;
+	
+	// lock for reading; false (or 0) is returned if the histogram is disabled or the range is
+	// empty. counts_out should have histogram_bins() elements. quantiles (q in [0, 1]) are
+	// interpolated inside the bins, and limited by min/max values of the range.
+	bool get_histogram(IndexRange range, uint64_t* counts_out);
+	bool get_quantiles(IndexRange range, const float* q, unsigned int cnt, float* out);
+	float get_quantile(IndexRange range, float q);
+	
+	// lock(false) can be called externally before reading multiple items through operator[]
+	// or item(), so they are consistent with each other (they are returned by value); writers
+	// should use push() or load() instead. it doesn't exclude push() in lock-free mode, use
+	// copy_range() there. member functions that lock for writing should NOT be called inside
+	// that lock() and unlock() pair.
 	void lock(bool for_writing = false);
 	void unlock();
 	
+protected:
+	void load_raw(const void* data, uint64_t cnt, bool spike_check); //items in the storage type
+	const void* raw_item_addr(uint64_t i) const;
+	
 private:
-	unsigned int bufsize = 0;
-	float* buf = NULL; float* bufend = NULL;
-	float* volatile end = NULL; //points to where the next item should be stored in
-	volatile unsigned int cnt = 0;
-	volatile unsigned long int cnt_overwrite = 0;
+	friend class BufferGroup; //pushes frames into its channels under its own seqlock
+	
+	uint64_t bufsize = 0;
+	SampleType type = Sample_Float; unsigned int item_size = sizeof(float);
+	float scale = 1, offset = 0; double scale_inv = 1; //scale_inv is used for converting values to items
+	struct SegTable {unsigned int cnt; unsigned char** segs;}; //pointers to storage segments
+	SegTable* volatile seg_table = NULL; //replaced by resize(), old tables are freed by storage_free()
+	std::vector<SegTable*> seg_tables_old;
+	std::vector<unsigned char*> seg_pool; //segments removed by resize(), not freed for pinned views
+	volatile uint64_t pos_end = 0; //position where the next item should be stored in
+	volatile uint64_t cnt = 0;
+	volatile uint64_t cnt_overwrite = 0;
+	volatile unsigned int generation_cnt = 0;
 	
-	// used for spike check
+	// compaction: items stand for sample_stride_cnt samples each; if it's greater than 1,
+	// samples are accumulated into the pair (min and max) until 2*sample_stride_cnt samples
+	// are pushed. sample_first is the index of the first sample of the first item.
+	volatile bool option_compact = false;
+	volatile uint64_t sample_stride_cnt = 1, sample_first = 0;
+	uint64_t pair_cnt = 0; //samples accumulated
+	float pair_min = 0, pair_max = 0; bool pair_min_first = true;
+	
+	// used for spike check, done by spike_update() (called by readers) for new items
 	unsigned int buf_spike_size = 0;
 	float spike_check_ref_min = 0;
-	unsigned long int* buf_spike = NULL, * buf_spike_bufend = NULL;
-	unsigned long int* volatile buf_spike_end = NULL;
+	uint64_t* buf_spike = NULL, * buf_spike_bufend = NULL;
+	uint64_t* volatile buf_spike_end = NULL;
 	volatile unsigned int buf_spike_cnt = 0;
 	volatile float spike_check_av = 0;
+	volatile bool option_spike_check = false; //set by push() and load()
+	volatile bool flag_alloc_failed = false; //see is_alloc_failed()
+	uint64_t i_abs_spike_next = 0; //absolute index of the first item not checked
+	uint64_t spike_run_cnt = 0; //amount of items checked since reset, no more than bufsize
+	float spike_prev[2] = {0, 0}; //values of two items before i_abs_spike_next
+	std::atomic_flag flag_lock_spike = ATOMIC_FLAG_INIT; //held by the reader in spike_update()
+	
+	// min/max index (pyramid) updated on push() and load(). blocks are aligned with
+	// "absolute" indexes, level 0 summarizes each block of Block_Size items, level n
+	// summarizes 2^n blocks. each level is a ring whose size is a power of 2; a node
+	// is reset when its first block is completed, and it's used only if all of its
+	// items are available, so nodes of overwritten data are never used.
+	enum {Block_Size_Bits = 6, Block_Size = 1 << Block_Size_Bits, Index_Levels_Max = 32};
+	struct MinMax {float min, max;};
+	MinMax* index_mm = NULL; //allocated once for all levels
+	MinMax* index_mm_lv[Index_Levels_Max]; uint64_t index_mm_mask[Index_Levels_Max];
+	unsigned int index_levels = 0;
+	
+	// prefix sums stored when each block is completed, in the ring of the same size as
+	// level 0 of the pyramid. the running sums are compensated (Kahan summation), and
+	// they are reset by clear() and when load() discards all existing items.
+	struct Sums {double sum, sq_sum;};
+	Sums* index_sums = NULL;
+	Sums sums_run = {0, 0}, sums_comp = {0, 0}; //running sums and their compensations
+	uint64_t i_abs_sums_reset = 0; //absolute index of the first item after reset
 	
-	// used for optimization (indexes are "absolute")
-	struct MinMaxScanInfo {
-		IndexRange range_i_min_max_scan,
-		           range_i_min_max; //two indexes stored as a range for convenience
-		ValueRange range_min_max = ValueRange(0, 0);
-	} last_min_max_scan;
-	struct AvCalcInfo {
-		IndexRange range_i_av_val;
-		float av_val = 0;
-	} last_av_calc;
-	std::mutex lock_info;
+	// min/max and sums of (a part of) a block, calculated by worker threads for loading large
+	// amounts of items (see set_parallel_threshold()), then added into the index in order
+	struct BlockSummary {MinMax mm; Sums sums;};
+	uint64_t parallel_threshold = Parallel_Threshold_Default;
+	
+	// sliding windows: rings of block indexes whose min (deq[0]) or max (deq[1]) values are
+	// increasing or decreasing from the front. they are rebuilt by the writer after clear(),
+	// compaction and resizing. the writer acknowledges unregistering by setting Window_Free.
+	enum WindowState {Window_Free = 0, Window_Active, Window_Retired};
+	struct Window {
+		volatile WindowState state; volatile bool flag_rebuild; uint64_t width;
+		uint64_t* deq[2]; uint64_t deq_first[2], deq_cnt[2], deq_mask;
+	};
+	Window windows[Windows_Max] = {};
+	std::vector<uint64_t*> window_deqs_old; //replaced deques, freed by the destructor
+	
+	// histogram: running counts of bins (since i_abs_hist_reset, which follows the reset of
+	// prefix sums) are stored when each block of Hist_Block_Size items is completed, in a
+	// ring of hist_mask + 1 blocks, each taking hist_bins counts.
+	unsigned int hist_bins = 0; float hist_min = 0, hist_max = 0; double hist_scale = 1; //bins per unit
+	uint64_t* hist_prefix = NULL; uint64_t hist_mask = 0;
+	uint64_t* hist_run = NULL;
+	uint64_t i_abs_hist_reset = 0;
+	
+	// used for file-backed storage; counters are copied into the header by write_end()
+	struct FileHeader {
+		char magic[8]; uint32_t header_size, item_type, buf_spike_size, option_spike_check;
+		uint64_t bufsize, index_mm_cnt;
+		float scale, offset, spike_check_ref_min, spike_check_av;
+		uint64_t cnt, pos_end; uint32_t buf_spike_cnt, buf_spike_end;
+		uint64_t spike_run_cnt; float spike_prev[2];
+		uint64_t cnt_overwrite, i_abs_sums_reset, i_abs_spike_next;
+		Sums sums_run, sums_comp;
+	};
+	FileHeader* file_hdr = NULL; std::size_t file_map_size = 0;
+	unsigned int file_sync_interval = 0; uint64_t file_sync_last = 0;
+	
+	// items are compressed into the history block by block before they are overwritten
+	HistoryStore* history = NULL;
+	uint64_t i_abs_history_next = 0; //absolute index of the first item not compressed
 	
 	// used to avoid multithreaded conflicts
 	std::atomic_flag flag_lock = ATOMIC_FLAG_INIT; //atomic_flag is not implemented with mutex
 	std::atomic_int read_lock_counter; //atomic_int is not implemented with mutex on most platforms
+	std::atomic_uint seq_write; //odd while the buffer is being written (seqlock)
+	const std::atomic_uint* seq_group = NULL; //seqlock of the BufferGroup holding it, checked by readers as well
+	volatile LockPolicy lock_pol = Lock_Read_Write; //see lock_policy()
+	
+	void write_begin();
+	void write_end();
+	bool write_pending() const; //the buffer or its group is being written
+	unsigned int read_begin() const;
+	bool read_retry(unsigned int seq) const;
+	
+	void storage_layout(uint64_t sz, SampleType type); //sets sizes, doesn't allocate
+	void storage_free();
+	void file_header_save();
+	void history_save(uint64_t i_abs_end); //compresses items before i_abs_end
+	void history_split(IndexRange range_abs, IndexRange& range_hist, IndexRange& range_cur) const;
 	
 	void copy_from(const CircularBuffer& from);
-	float* ptr_inc(float* p, unsigned int inc = 1) const;
-	float* item_addr(unsigned int i) const;
-	BufRangeMap map_from(IndexRange range) const;
-	unsigned long int buf_spike_item(unsigned int i) const;
-	void buf_spike_push(unsigned long int val);
-	void spike_check();
+	void push_value(float val, bool spike_check); //without locking and write_begin(), used by push() and BufferGroup
+	void push_item(float val, bool spike_check); //without locking
+	void push_compact(float val, bool spike_check); //without locking, used if sample_stride_cnt > 1 or option_compact is set
+	bool compact_next() const; //whether the next sample pushed will cause compaction
+	void compact(const float* vals_new, unsigned int cnt_new); //the new items are included
+	uint64_t load_skip(uint64_t cnt); //returns amount of items to be loaded
+	void load_items(const unsigned char* data, uint64_t cnt, bool spike_check); //cnt <= bufsize
+	uint64_t pos_inc(uint64_t pos, uint64_t inc = 1) const;
+	uint64_t item_pos(uint64_t i) const;
+	uint64_t abs_pos(uint64_t i_abs) const; //for readers: the counters are read consistently (seqlock)
+	IndexRange range_to_abs_sync(IndexRange range) const; //range_to_abs(range().cut_range(range)) for readers
+	unsigned char* pos_addr(uint64_t pos) const;
+	unsigned int pos_seg_len(uint64_t pos, uint64_t cnt) const; //length of contiguous storage
+	void seg_alloc(uint64_t pos, uint64_t cnt); //allocates segments to be written
+	bool seg_alloc_push(); //seg_alloc() for the next item(s) of push(), returns false on bad_alloc
+	SegTable* seg_table_new(unsigned int cnt);
+	void seg_table_replace(SegTable* table);
+	void index_resize(uint64_t sz); //before bufsize is increased to sz; throws bad_alloc
+	double item_value(const unsigned char* p) const; //converts the item to its value
+	double item_store(unsigned char* p, double val); //returns the value of the stored item
+	uint64_t buf_spike_item(unsigned int i) const;
+	unsigned int buf_spike_lower_bound(uint64_t i_abs) const; //binary search
+	void buf_spike_load(const uint64_t* data, unsigned int cnt);
+	void spike_lock();
+	void spike_unlock();
+	
+	// new items are checked in chunks: values and second differences of a chunk are
+	// calculated in simple loops that can be vectorized, then they are compared with the
+	// running average; spikes are appended in bulk. items are read like other readers do,
+	// and a chunk is read again if it's overwritten in the meantime (lock-free mode).
+	enum {Spike_Check_Chunk = 256};
+	void spike_update(); //spike_lock() must be called before
+	void items_to_values(const unsigned char* data, unsigned int cnt, float* out, unsigned int step = 1) const;
+	uint64_t copy_items(IndexRange range_abs, unsigned int step, float* out, CopyFuncPtr func, void* obj) const; //without locking
+	uint64_t copy_items_m4(IndexRange range_abs, unsigned int step, float* out, CopyFuncPtr func, void* obj) const;
+	
+	uint64_t index_layout(); //sets levels and masks, returns amount of nodes of all levels
+	void index_set_levels(); //after index_mm is allocated
+	void index_push(uint64_t i_abs, double val);
+	void index_load(const unsigned char* data, uint64_t cnt, uint64_t i_abs);
+	bool index_load_parallel(const unsigned char* data, uint64_t cnt, uint64_t i_abs); //false if not done
+	void index_summarize(const unsigned char* data, unsigned int cnt, BlockSummary& smr) const; //cnt <= Block_Size
+	void index_summarize_blocks(const unsigned char* data, uint64_t cnt_blk, BlockSummary* smrs) const;
+	void index_load_block(const unsigned char* data, unsigned int cnt, uint64_t i_abs, const BlockSummary& smr);
+	void index_block_done(uint64_t i_blk);
+	void window_add_block(Window& win, uint64_t i_blk); //called by the writer
+	void window_rebuild(Window& win, uint64_t i_blk); //from the blocks in the buffer
+	void windows_reset(); //the windows are rebuilt on the next block completed
+	void scan_seg_value_range(const unsigned char* p, unsigned int n, float& min, float& max) const;
+	void scan_seg_sums(const unsigned char* p, unsigned int n, double& sum, double& sq_sum) const;
+	uint64_t hist_layout(uint64_t sz) const; //returns the mask of the ring
+	unsigned int hist_bin(float val) const;
+	void hist_push(uint64_t i_abs, float val);
+	void hist_count_all(); //counts existing items
+	void scan_hist(IndexRange range_abs, uint64_t* counts) const; //adds to counts
+	void index_get_hist(IndexRange range_abs, uint64_t* counts) const;
+	void scan_value_range(IndexRange range_abs, float& min, float& max) const;
+	ValueRange index_value_range(IndexRange range_abs) const; //range_abs must be available
+	bool scan_find(IndexRange range_abs, float thr, bool above, bool forward, uint64_t& i_abs_out) const;
+	bool index_find(IndexRange range_abs, float thr, bool above, bool forward, uint64_t& i_abs_out) const; //range_abs must be available
+	bool find(IndexRange range, float thr, bool above, bool forward, uint64_t& i_out); //locks
+	bool find_extremum(IndexRange range, bool is_max, uint64_t& i_out); //locks
+	void index_sums_reset();
+	void index_sums_add(double val, double sq_val);
+	void scan_sums(IndexRange range_abs, double& sum, double& sq_sum) const;
+	void index_get_sums(IndexRange range_abs, double& sum, double& sq_sum) const;
+	bool get_sums(IndexRange& range, double& sum, double& sq_sum); //locks, converts range to absolute
+};
+
+// the buffer storing items of type T (int16_t, int32_t, float or double). it can be used
+// wherever CircularBuffer is accepted; items of integer types should be scaled by set_scale().
+template <typename T>
+class CircularBufferT: public CircularBuffer
+{
+public:
+	CircularBufferT(); void init(uint64_t sz);
+	CircularBufferT(uint64_t sz);
+	
+	void load_raw(const T* data, uint64_t cnt, bool spike_check = true); //items are not scaled
+	T raw_item(uint64_t i) const;
 };
 
 inline BufRangeMap::BufRangeMap() {}
@@ -143,7 +504,97 @@ inline BufRangeMap::BufRangeMap(IndexRange range, unsigned int bufsize, unsigned
 		this->former.set(il, ir);
 }
 
-inline unsigned int CircularBuffer::size() const
+inline uint64_t BufferView::count() const
+{
+	return this->cnt;
+}
+
+inline BufferView::operator bool() const
+{
+	return this->cnt > 0;
+}
+
+inline unsigned int BufferView::segment_count() const
+{
+	// segments before the end of the ring and after it
+	const unsigned int bits = CircularBuffer::Segment_Size_Bits;
+	if (this->cnt == 0) return 0;
+	uint64_t end_a = (this->pos + this->cnt < this->bufsize)? this->pos + this->cnt : this->bufsize,
+	         cnt_a = ((end_a - 1) >> bits) - (this->pos >> bits) + 1;
+	if (this->pos + this->cnt <= this->bufsize) return cnt_a;
+	return cnt_a + ((this->pos + this->cnt - this->bufsize - 1) >> bits) + 1;
+}
+
+inline unsigned int BufferView::segment_size(unsigned int i_seg) const
+{
+	const unsigned int bits = CircularBuffer::Segment_Size_Bits;
+	uint64_t end_a = (this->pos + this->cnt < this->bufsize)? this->pos + this->cnt : this->bufsize,
+	         cnt_a = ((end_a - 1) >> bits) - (this->pos >> bits) + 1, begin, end;
+	if (i_seg < cnt_a) {
+		begin = (i_seg == 0)? this->pos : ((this->pos >> bits) + i_seg) << bits;
+		end = ((this->pos >> bits) + i_seg + 1) << bits; if (end > end_a) end = end_a;
+	} else {
+		begin = (i_seg - cnt_a) << bits;
+		end = begin + (1 << bits); if (end > this->pos + this->cnt - this->bufsize) end = this->pos + this->cnt - this->bufsize;
+	}
+	return end - begin;
+}
+
+template <typename T>
+inline const T* BufferView::segment(unsigned int i_seg) const
+{
+	if ((SampleType)SampleTypeOf<T>::Value != this->type)
+		throw std::invalid_argument("BufferView::segment(): T isn't the storage type.");
+	if (i_seg >= this->segment_count())
+		throw std::out_of_range("BufferView::segment(): index exceeds the segment count.");
+	
+	const unsigned int bits = CircularBuffer::Segment_Size_Bits;
+	uint64_t end_a = (this->pos + this->cnt < this->bufsize)? this->pos + this->cnt : this->bufsize,
+	         cnt_a = ((end_a - 1) >> bits) - (this->pos >> bits) + 1, begin;
+	if (i_seg < cnt_a)
+		begin = (i_seg == 0)? this->pos : ((this->pos >> bits) + i_seg) << bits;
+	else
+		begin = (i_seg - cnt_a) << bits;
+	return (const T*)(this->segs[begin >> bits]) + (begin & ((1 << bits) - 1));
+}
+
+inline float BufferView::item(uint64_t i) const
+{
+	if (i >= this->cnt)
+		throw std::out_of_range("BufferView::item(): index exceeds the count of the view.");
+	
+	uint64_t pos = this->pos + i;
+	if (pos >= this->bufsize) pos -= this->bufsize;
+	const unsigned char* p = this->segs[pos >> CircularBuffer::Segment_Size_Bits]
+	                       + (std::size_t)(pos & (CircularBuffer::Segment_Size - 1)) * this->item_size;
+	
+	double raw;
+	switch (this->type) {
+		case Sample_Int16: raw = *(const int16_t*)p; break;
+		case Sample_Int32: raw = *(const int32_t*)p; break;
+		case Sample_Float: raw = *(const float*)p; break;
+		default:           raw = *(const double*)p; break;
+	}
+	return raw * this->scale + this->offset;
+}
+
+inline uint64_t BufferView::count_lost() const
+{
+	uint64_t cnt = this->count();
+	if (cnt == 0) return 0;
+	
+	uint64_t i_min = this->buf->index_intact_min(); //with a fence after reading items
+	if (this->buf->generation() != this->generation) return cnt;
+	if (i_min <= this->i_abs) return 0;
+	return (i_min - this->i_abs < cnt)? i_min - this->i_abs : cnt;
+}
+
+inline bool BufferView::intact() const
+{
+	return this->count_lost() == 0;
+}
+
+inline uint64_t CircularBuffer::size() const
 {
 	return this->bufsize;
 }
@@ -153,12 +604,37 @@ inline unsigned int CircularBuffer::spike_buffer_size() const
 	return this->buf_spike_size;
 }
 
+inline bool CircularBuffer::is_file_backed() const
+{
+	return this->file_hdr != NULL;
+}
+
+inline void CircularBuffer::set_file_sync_interval(unsigned int cnt_items)
+{
+	this->file_sync_interval = cnt_items;
+}
+
+inline SampleType CircularBuffer::sample_type() const
+{
+	return this->type;
+}
+
+inline float CircularBuffer::sample_scale() const
+{
+	return this->scale;
+}
+
+inline float CircularBuffer::sample_offset() const
+{
+	return this->offset;
+}
+
 inline bool CircularBuffer::is_valid_range(IndexRange range) const
 {
 	return range && range.max() < this->bufsize;
 }
 
-inline unsigned int CircularBuffer::count() const
+inline uint64_t CircularBuffer::count() const
 {
 	return this->cnt;
 }
@@ -181,24 +657,24 @@ inline bool CircularBuffer::is_full() const
 	return this->cnt == this->bufsize;
 }
 
-inline unsigned long int CircularBuffer::count_overwritten() const
+inline uint64_t CircularBuffer::count_overwritten() const
 {
 	return this->cnt_overwrite;
 }
 
-inline unsigned long int CircularBuffer::count_overall() const
+inline uint64_t CircularBuffer::count_overall() const
 {
 	return this->cnt + this->cnt_overwrite;
 }
 
-inline unsigned long int CircularBuffer::index_to_abs(unsigned int i) const
+inline uint64_t CircularBuffer::index_to_abs(uint64_t i) const
 {
 	return i + this->cnt_overwrite;
 }
 
-inline unsigned int CircularBuffer::index_to_rel(unsigned long int i) const
+inline uint64_t CircularBuffer::index_to_rel(uint64_t i) const
 {
-	unsigned long int cnt_ovr = this->cnt_overwrite;
+	uint64_t cnt_ovr = this->cnt_overwrite;
 	if (i >= cnt_ovr + this->cnt)
 		return this->cnt - 1;
 	else if (i >= cnt_ovr)
@@ -221,49 +697,143 @@ inline IndexRange CircularBuffer::range_to_rel(IndexRange range_abs) const
 	return range;
 }
 
-inline float& CircularBuffer::item(unsigned int i) const
+inline float CircularBuffer::item(uint64_t i) const
 {
 	if (i >= this->bufsize)
 		throw std::out_of_range("CircularBuffer::item(): index exceeds the buffer size.");
 	
-	return *(this->item_addr(i));
+	return this->item_value(this->pos_addr(this->item_pos(i)));
 }
 
-inline float& CircularBuffer::operator[](unsigned int i) const
+inline float CircularBuffer::operator[](uint64_t i) const
 {
 	return this->item(i);
 }
 
-inline float& CircularBuffer::abs_index_item(unsigned long int i) const
+inline float CircularBuffer::abs_index_item(uint64_t i) const
 {
 	return this->item(this->index_to_rel(i));
 }
 
-inline float& CircularBuffer::last_item() const
+inline float CircularBuffer::last_item() const
 {
 	if (this->cnt == 0) return this->item(0);
 	return this->item(this->cnt - 1);
 }
 
+inline BufferView CircularBuffer::view() const
+{
+	return this->view(this->range_max());
+}
+
 inline void CircularBuffer::push(float val, bool spike_check, bool lock)
 {
-	if (! this->buf) return;
+	if (! this->seg_table) return;
+	if (this->lock_policy() == Lock_Seq) lock = this->compact_next(); //readers are excluded while compacting
 	if (lock) this->lock(true);
-	
-	*this->end = val;
-	this->end = this->ptr_inc(this->end);
-	
-	if (this->cnt < this->bufsize)
-		this->cnt++;
-	else
-		this->cnt_overwrite++;
-	
-	if (spike_check)
-		this->spike_check();
-	
+	if (this->push_reserve()) { //otherwise the item is dropped, see is_alloc_failed()
+		this->write_begin();
+		this->push_value(val, spike_check);
+		this->write_end();
+	}
 	if (lock) this->unlock();
 }
 
+inline bool CircularBuffer::push_reserve()
+{
+	// a new segment may begin at the next item, or the one after it if a pair of items is
+	// pushed at once (sample_stride_cnt > 1), which may also wrap around to the first segment
+	uint64_t offset = this->pos_end & (Segment_Size - 1);
+	if (offset != 0 && (this->sample_stride_cnt == 1
+	                    || (offset != Segment_Size - 1 && this->pos_end + 1 < this->bufsize)))
+		return true;
+	return this->seg_alloc_push();
+}
+
+inline bool CircularBuffer::is_alloc_failed() const
+{
+	return this->flag_alloc_failed;
+}
+
+inline void CircularBuffer::set_option_lock_free(bool set)
+{
+	this->set_lock_policy(set? Lock_Seq : Lock_Read_Write);
+}
+
+inline bool CircularBuffer::set_lock_policy(LockPolicy policy)
+{
+#ifdef SIMPLE_CAIRO_PLOT_LOCK_POLICY
+	return policy == this->lock_policy();
+#else
+	this->lock_pol = policy; return true;
+#endif
+}
+
+inline CircularBuffer::LockPolicy CircularBuffer::lock_policy() const
+{
+#ifdef SIMPLE_CAIRO_PLOT_LOCK_POLICY
+	return CircularBuffer::SIMPLE_CAIRO_PLOT_LOCK_POLICY; //branches on it are removed by the compiler
+#else
+	return this->lock_pol;
+#endif
+}
+
+inline bool CircularBuffer::check_intact(uint64_t i_abs) const
+{
+	return i_abs >= this->index_intact_min();
+}
+
+inline uint64_t CircularBuffer::index_intact_min() const
+{
+	std::atomic_thread_fence(std::memory_order_acquire); //previous reads of data must be done
+	uint64_t cnt_ovr = this->cnt_overwrite;
+	if (this->write_pending())
+		cnt_ovr++; //the oldest item may be overwritten right now
+	return cnt_ovr;
+}
+
+inline unsigned int CircularBuffer::generation() const
+{
+	return this->generation_cnt;
+}
+
+inline void CircularBuffer::set_option_compact_on_full(bool set)
+{
+	this->option_compact = set;
+}
+
+inline void CircularBuffer::set_parallel_threshold(uint64_t cnt)
+{
+	this->parallel_threshold = cnt;
+}
+
+inline uint64_t CircularBuffer::sample_stride() const
+{
+	return this->sample_stride_cnt;
+}
+
+inline uint64_t CircularBuffer::sample_index(uint64_t i) const
+{
+	return this->sample_first + i * this->sample_stride_cnt;
+}
+
+inline unsigned int CircularBuffer::histogram_bins() const
+{
+	return this->hist_bins;
+}
+
+inline ValueRange CircularBuffer::histogram_range() const
+{
+	return ValueRange(this->hist_min, this->hist_max);
+}
+
+inline float CircularBuffer::get_quantile(IndexRange range, float q)
+{
+	float val;
+	if (! this->get_quantiles(range, &q, 1, &val)) return 0;
+	return val;
+}
+
 inline void CircularBuffer::set_spike_check_ref_min(float val)
 {
 	if (val < 0) val = -val;
@@ -290,6 +860,10 @@ inline void CircularBuffer::lock(bool for_writing)
 	using namespace std::chrono;
 	using namespace std::this_thread;
 	
+	LockPolicy policy = this->lock_policy();
+	if (policy == Lock_None) return;
+	if (policy == Lock_Exclusive) for_writing = true;
+	
 	// write operation must wait for previous operation;
 	// read operation must wait for previous write operation.
 	if (this->flag_lock.test_and_set(std::memory_order_acquire)
@@ -306,6 +880,7 @@ inline void CircularBuffer::lock(bool for_writing)
 
 inline void CircularBuffer::unlock()
 {
+	if (this->lock_policy() == Lock_None) return;
 	if (this->read_lock_counter.load(std::memory_order_acquire) > 0) {
 		int counter = --this->read_lock_counter;
 		if (counter > 0) return;
@@ -314,71 +889,291 @@ inline void CircularBuffer::unlock()
 	this->flag_lock.clear(std::memory_order_release);
 }
 
-/*------------------------------ private functions ------------------------------*/
+/*------------------------------ protected functions ------------------------------*/
 
-inline float* CircularBuffer::ptr_inc(float* p, unsigned int inc) const
+inline const void* CircularBuffer::raw_item_addr(uint64_t i) const
 {
-	p += inc;
-	if (p > this->bufend)
-		p -= this->bufsize;
-	return p;
+	if (i >= this->bufsize)
+		throw std::out_of_range("CircularBuffer::raw_item_addr(): index exceeds the buffer size.");
+	
+	return this->pos_addr(this->item_pos(i));
 }
 
-inline float* CircularBuffer::item_addr(unsigned int i) const
+/*------------------------------ private functions ------------------------------*/
+
+inline void CircularBuffer::push_value(float val, bool spike_check)
 {
-	if (! this->is_full())
-		return this->ptr_inc(this->buf, i);
+	if (this->option_compact || this->sample_stride_cnt > 1)
+		this->push_compact(val, spike_check);
 	else
-		return this->ptr_inc(this->end, i);
+		this->push_item(val, spike_check);
+}
+
+inline void CircularBuffer::push_item(float val, bool spike_check)
+{
+	// the segment is allocated by push_reserve()
+	if (this->history && this->cnt == this->bufsize && this->i_abs_history_next <= this->cnt_overwrite)
+		this->history_save(this->cnt_overwrite + 1);
+	this->index_push(this->count_overall(), this->item_store(this->pos_addr(this->pos_end), val));
+	this->pos_end = this->pos_inc(this->pos_end);
+	
+	if (this->cnt < this->bufsize)
+		this->cnt++;
+	else {
+		this->cnt_overwrite++; this->sample_first += this->sample_stride_cnt;
+	}
+	
+	this->option_spike_check = spike_check;
+}
+
+inline bool CircularBuffer::compact_next() const
+{
+	if (!this->option_compact || this->file_hdr || this->bufsize < 4) return false;
+	if (this->sample_stride_cnt == 1) return this->cnt == this->bufsize;
+	return this->pair_cnt + 1 == 2 * this->sample_stride_cnt && this->cnt + 2 > this->bufsize;
 }
 
-inline BufRangeMap CircularBuffer::map_from(IndexRange range) const
+inline void CircularBuffer::index_sums_add(double val, double sq_val)
 {
-	return BufRangeMap(range, this->bufsize, this->item_addr(0) - this->buf);
+	double y, t;
+	y = val - this->sums_comp.sum; t = this->sums_run.sum + y;
+	this->sums_comp.sum = (t - this->sums_run.sum) - y; this->sums_run.sum = t;
+	y = sq_val - this->sums_comp.sq_sum; t = this->sums_run.sq_sum + y;
+	this->sums_comp.sq_sum = (t - this->sums_run.sq_sum) - y; this->sums_run.sq_sum = t;
 }
 
-inline unsigned long int CircularBuffer::buf_spike_item(unsigned int i) const
+inline void CircularBuffer::index_push(uint64_t i_abs, double val_d)
 {
-	unsigned long int* p;
+	this->index_sums_add(val_d, val_d * val_d);
+	
+	float val = val_d;
+	if (this->hist_bins) this->hist_push(i_abs, val);
+	unsigned int i_in_blk = i_abs & (Block_Size - 1);
+	MinMax& node = this->index_mm_lv[0][(i_abs >> Block_Size_Bits) & this->index_mm_mask[0]];
+	if (i_in_blk == 0) {
+		node.min = node.max = val;
+	} else {
+		if (val < node.min) node.min = val;
+		if (val > node.max) node.max = val;
+	}
+	if (i_in_blk == Block_Size - 1)
+		this->index_block_done(i_abs >> Block_Size_Bits);
+}
+
+inline unsigned int CircularBuffer::hist_bin(float val) const
+{
+	double x = (val - this->hist_min) * this->hist_scale;
+	if (! (x > 0)) return 0; //NaN is counted in the first bin
+	return (x < this->hist_bins)? (unsigned int)x : this->hist_bins - 1;
+}
+
+inline void CircularBuffer::hist_push(uint64_t i_abs, float val)
+{
+	this->hist_run[this->hist_bin(val)]++;
+	if ((i_abs & (Hist_Block_Size - 1)) == Hist_Block_Size - 1)
+		memcpy(this->hist_prefix + ((i_abs >> Hist_Block_Size_Bits) & this->hist_mask) * this->hist_bins,
+		       this->hist_run, this->hist_bins * sizeof(uint64_t));
+}
+
+inline void CircularBuffer::write_begin()
+{
+	if (this->lock_policy() == Lock_None) return;
+	this->seq_write.store(this->seq_write.load(std::memory_order_relaxed) + 1,
+	                      std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release); //following writes can't be moved before it
+}
+
+inline void CircularBuffer::write_end()
+{
+	if (this->file_hdr) this->file_header_save();
+	if (this->lock_policy() == Lock_None) return;
+	this->seq_write.store(this->seq_write.load(std::memory_order_relaxed) + 1,
+	                      std::memory_order_release);
+}
+
+inline bool CircularBuffer::write_pending() const
+{
+	return (this->seq_write.load(std::memory_order_acquire) & 1)
+	    || (this->seq_group && (this->seq_group->load(std::memory_order_acquire) & 1));
+}
+
+inline unsigned int CircularBuffer::read_begin() const
+{
+	// the sequence of the group is added: both are increased only, so the sum is changed
+	// if either of them is changed, and it's even when both are even
+	unsigned int seq, seq_grp = 0;
+	if (this->lock_policy() == Lock_None) return 0;
+	while (true) {
+		seq = this->seq_write.load(std::memory_order_acquire);
+		if (this->seq_group) seq_grp = this->seq_group->load(std::memory_order_acquire);
+		if (((seq | seq_grp) & 1) == 0) break;
+		std::this_thread::yield();
+	}
+	return seq + seq_grp;
+}
+
+inline bool CircularBuffer::read_retry(unsigned int seq) const
+{
+	if (this->lock_policy() == Lock_None) return false;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	unsigned int seq_now = this->seq_write.load(std::memory_order_relaxed);
+	if (this->seq_group) seq_now += this->seq_group->load(std::memory_order_relaxed);
+	return seq_now != seq;
+}
+
+inline uint64_t CircularBuffer::pos_inc(uint64_t pos, uint64_t inc) const
+{
+	pos += inc;
+	if (pos >= this->bufsize)
+		pos -= this->bufsize;
+	return pos;
+}
+
+inline uint64_t CircularBuffer::item_pos(uint64_t i) const
+{
+	// the first item isn't at position 0 if the buffer has been resized while it was full
+	uint64_t pos = this->pos_end + (this->bufsize - this->cnt);
+	if (pos >= this->bufsize) pos -= this->bufsize;
+	return this->pos_inc(pos, i);
+}
+
+inline uint64_t CircularBuffer::abs_pos(uint64_t i_abs) const
+{
+	uint64_t pos, back; unsigned int seq;
+	do {
+		seq = this->read_begin();
+		back = this->count_overall() - i_abs; //amount of items from i_abs to the end
+		if (back > this->bufsize) back = this->bufsize; //overwritten, the caller should retry
+		pos = this->pos_end + (this->bufsize - back);
+	} while (this->read_retry(seq));
+	
+	if (pos >= this->bufsize) pos -= this->bufsize;
+	return pos;
+}
+
+inline IndexRange CircularBuffer::range_to_abs_sync(IndexRange range) const
+{
+	IndexRange range_abs; unsigned int seq;
+	do {
+		seq = this->read_begin();
+		range_abs = this->range_to_abs(this->range().cut_range(range));
+	} while (this->read_retry(seq));
+	return range_abs;
+}
+
+inline unsigned char* CircularBuffer::pos_addr(uint64_t pos) const
+{
+	const SegTable* table = this->seg_table;
+	uint64_t i_seg = pos >> Segment_Size_Bits;
+	if (i_seg >= table->cnt) i_seg = table->cnt - 1; //torn read during resize() in lock-free mode
+	return table->segs[i_seg] + (std::size_t)(pos & (Segment_Size - 1)) * this->item_size;
+}
+
+inline unsigned int CircularBuffer::pos_seg_len(uint64_t pos, uint64_t cnt) const
+{
+	uint64_t n = Segment_Size - (pos & (Segment_Size - 1));
+	if (pos < this->bufsize && n > this->bufsize - pos) n = this->bufsize - pos;
+	return (n < cnt)? n : cnt;
+}
+
+inline double CircularBuffer::item_value(const unsigned char* p) const
+{
+	double raw;
+	switch (this->type) {
+		case Sample_Int16: raw = *(const int16_t*)p; break;
+		case Sample_Int32: raw = *(const int32_t*)p; break;
+		case Sample_Float: raw = *(const float*)p; break;
+		default:           raw = *(const double*)p; break;
+	}
+	return raw * this->scale + this->offset;
+}
+
+inline double CircularBuffer::item_store(unsigned char* p, double val)
+{
+	double raw = (val - this->offset) * this->scale_inv;
+	switch (this->type) {
+		case Sample_Int16:
+			raw = round(raw);
+			if (raw > INT16_MAX) raw = INT16_MAX; else if (raw < INT16_MIN) raw = INT16_MIN;
+			*(int16_t*)p = raw; break;
+		case Sample_Int32:
+			raw = round(raw);
+			if (raw > INT32_MAX) raw = INT32_MAX; else if (raw < INT32_MIN) raw = INT32_MIN;
+			*(int32_t*)p = raw; break;
+		case Sample_Float:
+			*(float*)p = raw; raw = *(float*)p; break;
+		default:
+			*(double*)p = raw; break;
+	}
+	return raw * this->scale + this->offset;
+}
+
+inline uint64_t CircularBuffer::buf_spike_item(unsigned int i) const
+{
+	uint64_t* p;
 	if (this->buf_spike_cnt < this->buf_spike_size)
 		p = this->buf_spike + i;
 	else
 		p = this->buf_spike_end + i;
 	
-	if (p > this->buf_spike_bufend) p -= this->bufsize;
+	if (p > this->buf_spike_bufend) p -= this->buf_spike_size;
 	return *p;
 }
 
-inline void CircularBuffer::buf_spike_push(unsigned long int val)
+inline unsigned int CircularBuffer::buf_spike_lower_bound(uint64_t i_abs) const
 {
-	*this->buf_spike_end = val;
-	if (this->buf_spike_cnt < this->buf_spike_size)
-		this->buf_spike_cnt++;
-	
-	this->buf_spike_end++;
-	if (this->buf_spike_end > this->buf_spike_bufend)
-		this->buf_spike_end = this->buf_spike;
+	// indexes in the spike buffer are increasing
+	unsigned int l = 0, r = this->buf_spike_cnt, m;
+	while (l < r) {
+		m = l + (r - l) / 2;
+		if (this->buf_spike_item(m) < i_abs)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
 }
 
-inline void CircularBuffer::spike_check()
+inline void CircularBuffer::spike_lock()
 {
-	using namespace std;
-	
-	if (this->cnt == 1) this->spike_check_av = this->last_item();
-	if (this->cnt < 3) return;
-	
-	float ref = this->spike_check_av;
-	if (fabs(ref) < spike_check_ref_min)
-		ref = spike_check_ref_min;
-	if (!ref) ref = 1;
-	
-	float dd =  this->item(this->cnt - 1) - this->item(this->cnt - 2)
-	         - (this->item(this->cnt - 2) - this->item(this->cnt - 3));
-	
-	if (spike_check_av != 0 && fabs(dd / ref) > 0.05)
-		this->buf_spike_push(this->count_overall() - 2);
-	else
-		this->spike_check_av = 0.9*this->spike_check_av + 0.1*this->last_item();
+	if (this->lock_policy() == Lock_None) return;
+	while (this->flag_lock_spike.test_and_set(std::memory_order_acquire))
+		std::this_thread::yield();
+}
+
+inline void CircularBuffer::spike_unlock()
+{
+	if (this->lock_policy() == Lock_None) return;
+	this->flag_lock_spike.clear(std::memory_order_release);
+}
+
+/*------------------------------ CircularBufferT functions ------------------------------*/
+
+template <typename T>
+inline CircularBufferT<T>::CircularBufferT() {}
+
+template <typename T>
+inline void CircularBufferT<T>::init(uint64_t sz)
+{
+	CircularBuffer::init(sz, (SampleType)SampleTypeOf<T>::Value);
+}
+
+template <typename T>
+inline CircularBufferT<T>::CircularBufferT(uint64_t sz)
+{
+	this->init(sz);
+}
+
+template <typename T>
+inline void CircularBufferT<T>::load_raw(const T* data, uint64_t cnt, bool spike_check)
+{
+	CircularBuffer::load_raw(data, cnt, spike_check);
+}
+
+template <typename T>
+inline T CircularBufferT<T>::raw_item(uint64_t i) const
+{
+	return *(const T*)this->raw_item_addr(i);
 }
 
 }
@@ -16,12 +16,12 @@ using namespace SimpleCairoPlot;
 
 Frontend::Frontend() {}
 
-Frontend::Frontend(std::vector<VariablePtr>& ptrs, unsigned int buf_size)
+Frontend::Frontend(std::vector<VariablePtr>& ptrs, uint64_t buf_size)
 {
 	this->init(ptrs, buf_size);
 }
 
-void Frontend::init(std::vector<VariablePtr>& ptrs, unsigned int buf_size)
+void Frontend::init(std::vector<VariablePtr>& ptrs, uint64_t buf_size)
 {
 	if (ptrs.size() == 0 || buf_size < 2)
 		throw std::runtime_error("Frontend::init(): invalid parameter.");
@@ -34,10 +34,12 @@ void Frontend::init(std::vector<VariablePtr>& ptrs, unsigned int buf_size)
 void Frontend::open()
 {
 	if (this->thread_gtk || this->window) return;
+	this->set_ready(false); //clears flag_finished of the previous run
 	this->thread_gtk = new std::thread(&Frontend::app_run, this);
-	
-	while (! this->window) sleep_for(milliseconds(10));
-	sleep_for(milliseconds(10));
+	if (! this->wait_ready(true)) {
+		this->run(); //joins the thread
+		throw std::runtime_error("Frontend::open(): the application exited before showing the window.");
+	}
 }
 
 void Frontend::run()
@@ -59,7 +61,7 @@ void Frontend::close()
 	if (this->thread_gtk)
 		this->run();
 	else //this function is called from another thread too
-		while (this->window) sleep_for(milliseconds(1));
+		this->wait_ready(false);
 }
 
 Frontend::~Frontend()
@@ -73,11 +75,13 @@ void Frontend::open()
 {
 	if (this->thread_gtk || this->window) return;
 	
+	this->set_ready(false);
 	if (! thread_gtk)
 		thread_gtk = new std::thread(&Frontend::thread_loop, this);
 	else
 		this->flag_open = true;
-	while (! this->window) sleep_for(milliseconds(10));
+	if (! this->wait_ready(true))
+		throw std::runtime_error("Frontend::open(): the application exited before showing the window.");
 }
 
 void Frontend::run()
@@ -98,7 +102,7 @@ void Frontend::close()
 	this->rec->stop();
 	this->dispatcher_quit->emit(); //eventually deletes itself
 	
-	while (this->window) sleep_for(milliseconds(10));
+	this->wait_ready(false);
 }
 
 Frontend::~Frontend()
@@ -116,17 +120,36 @@ Frontend::~Frontend()
 
 Recorder& Frontend::recorder() const
 {
-	unsigned int wait_ms = 0;
-	while (!this->window && wait_ms < 5000) {
-		sleep_for(milliseconds(10)); wait_ms += 10;
-	}
-	if (! this->window)
+	if (! this->wait_ready(true, milliseconds(5000)))
 		throw std::runtime_error("Frontend::recorder(): frontend is not opened.");
 	return *this->rec;
 }
 
 /*------------------------------ private functions ------------------------------*/
 
+void Frontend::set_ready(bool ready, bool finished)
+{
+	std::lock_guard<std::mutex> lock(this->mtx_ready);
+	this->flag_ready = ready; this->flag_finished = finished;
+	this->cond_ready.notify_all();
+}
+
+bool Frontend::wait_ready(bool ready, milliseconds timeout) const
+{
+	std::unique_lock<std::mutex> lock(this->mtx_ready);
+	if (timeout == milliseconds::max()) {
+		while (this->flag_ready != ready && !(ready && this->flag_finished))
+			this->cond_ready.wait(lock);
+		return this->flag_ready == ready;
+	}
+	
+	steady_clock::time_point t_end = steady_clock::now() + timeout;
+	while (this->flag_ready != ready && !(ready && this->flag_finished))
+		if (this->cond_ready.wait_until(lock, t_end) == std::cv_status::timeout)
+			break;
+	return this->flag_ready == ready;
+}
+
 #ifdef _WIN32
 void Frontend::thread_loop()
 {
@@ -148,6 +171,7 @@ void Frontend::app_run()
 	std::string app_name = "org.simple-cairo-plot.frontend_";
 	app_name += std::to_string(steady_clock::now().time_since_epoch().count());
 	Glib::RefPtr<Gtk::Application> app = Gtk::Application::create(app_name);
+	this->set_ready(false); //run() may call it again after it has finished
 	
 	this->dispatcher_quit = new Glib::Dispatcher;
 	this->dispatcher_quit->connect(sigc::mem_fun(*(app.get()), &Gtk::Application::quit));
@@ -160,6 +184,7 @@ void Frontend::app_run()
 	this->window = NULL; //the window is already destructed when the thread exits Application::run()
 	delete this->file_dialog;
 	delete this->dispatcher_quit;
+	this->set_ready(false, true); //also wakes up open() if the window has never been shown
 }
 
 void Frontend::create_window()
@@ -187,8 +212,9 @@ void Frontend::create_window()
 	box->set_border_width(5); box->set_spacing(2);
 	box->pack_start(*this->rec, Gtk::PACK_EXPAND_WIDGET);
 	box->pack_start(*bar, Gtk::PACK_SHRINK);
-
+	
 	this->window = new Gtk::Window();
+	this->window->signal_show().connect(sigc::mem_fun(*this, &Frontend::on_window_show));
 	this->window->set_title(this->title);
 	this->window->set_default_size(640, 400);
 	this->window->add(*box);
@@ -210,6 +236,11 @@ void Frontend::create_file_dialog()
 	this->file_dialog->set_modal(true);
 }
 
+void Frontend::on_window_show()
+{
+	this->set_ready(true); //wakes up open()
+}
+
 void Frontend::on_buffers_full()
 {
 	this->window->set_title(this->title + " - Full...");
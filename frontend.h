@@ -7,6 +7,9 @@
 
 #include <simple-cairo-plot/recorder.h>
 
+#include <mutex>
+#include <condition_variable>
+
 #include <gtkmm/window.h>
 #include <gtkmm/filechooserdialog.h>
 #include <gtkmm/button.h>
@@ -17,13 +20,20 @@ namespace SimpleCairoPlot
 
 class Frontend: public sigc::trackable
 {
-	std::vector<VariablePtr> ptrs; unsigned int buf_size;
+	std::vector<VariablePtr> ptrs; uint64_t buf_size;
 	Recorder* rec;
 	
 	std::thread* thread_gtk = NULL;
 	Glib::Dispatcher* dispatcher_quit = NULL;
 	Gtk::Window* volatile window = NULL;
 	
+	// set when the window is shown, cleared when it's closed; waiters are notified.
+	// flag_finished is set when app_run() returns, waiters for readiness return false then
+	bool flag_ready = false, flag_finished = false;
+	mutable std::mutex mtx_ready; mutable std::condition_variable cond_ready;
+	void set_ready(bool ready, bool finished = false);
+	bool wait_ready(bool ready, std::chrono::milliseconds timeout = std::chrono::milliseconds::max()) const;
+	
 	Gtk::FileChooserDialog* file_dialog;
 	Gtk::Button* button_start_stop;
 	
@@ -36,6 +46,7 @@ class Frontend: public sigc::trackable
 	void create_file_dialog();
 	void app_run();
 	
+	void on_window_show();
 	void on_buffers_full();
 	void on_button_start_stop_clicked();
 	void on_button_open_clicked();
@@ -44,13 +55,13 @@ class Frontend: public sigc::trackable
 public:
 	std::string title = "Recorder";
 	
-	Frontend(); void init(std::vector<VariablePtr>& ptrs, unsigned int buf_size);
-	Frontend(std::vector<VariablePtr>& ptrs, unsigned int buf_size);
+	Frontend(); void init(std::vector<VariablePtr>& ptrs, uint64_t buf_size);
+	Frontend(std::vector<VariablePtr>& ptrs, uint64_t buf_size);
 	Frontend(const Frontend&) = delete;
 	Frontend& operator=(const Frontend&) = delete;
 	virtual ~Frontend();
 	
-	void open(); //create a new thread to run the frontend
+	void open(); //create a new thread to run the frontend. throws runtime_error if it exits before the window is shown
 	Recorder& recorder() const; //notice: don't keep the returned reference when closing the frontend
 	void run(); //run in current thread or join the existing frontend thread, blocks
 	void close();
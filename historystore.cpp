@@ -0,0 +1,477 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+// Licensed under LGPL version 2.1.
+
+#include <simple-cairo-plot/historystore.h>
+
+#include <cstring> //memcpy()
+#include <limits> //numeric_limits<float>
+
+using namespace SimpleCairoPlot;
+
+// maximum size of an encoded block: 78 bits for each double item in the worst case
+static const unsigned int Block_Encoded_Max = HistoryStore::Block_Size * 10 + 16;
+
+/*------------------------------ bit streams ------------------------------*/
+
+// bits are written and read from the most significant bit
+struct BitWriter {
+	unsigned char* p; uint64_t acc = 0; unsigned int n_acc = 0;
+	
+	BitWriter(unsigned char* out): p(out) {}
+	void put(uint64_t val, unsigned int n) {
+		if (n > 32) {
+			this->put(val >> 32, n - 32); n = 32;
+		}
+		this->acc = (this->acc << n) | (val & ((1ULL << n) - 1)); this->n_acc += n;
+		while (this->n_acc >= 8) {
+			this->n_acc -= 8; *this->p++ = (unsigned char)(this->acc >> this->n_acc);
+		}
+	}
+	void flush() {
+		if (this->n_acc > 0) *this->p++ = (unsigned char)(this->acc << (8 - this->n_acc));
+		this->n_acc = 0;
+	}
+};
+
+// never reads beyond the end, so corrupted data (read while being overwritten) is harmless
+struct BitReader {
+	const unsigned char* p, * p_end; uint64_t acc = 0; unsigned int n_acc = 0;
+	
+	BitReader(const unsigned char* data, unsigned int len): p(data), p_end(data + len) {}
+	uint64_t get(unsigned int n) {
+		if (n > 32) {
+			uint64_t high = this->get(n - 32);
+			return (high << 32) | this->get(32);
+		}
+		while (this->n_acc < n) {
+			this->acc = (this->acc << 8) | (this->p < this->p_end? *this->p++ : 0);
+			this->n_acc += 8;
+		}
+		this->n_acc -= n;
+		return (this->acc >> this->n_acc) & ((1ULL << n) - 1);
+	}
+};
+
+static inline unsigned int count_leading_zeros(uint64_t x, unsigned int bits) //x != 0
+{
+#ifdef __GNUC__
+	return __builtin_clzll(x) - (64 - bits);
+#else
+	unsigned int n = 0;
+	for (uint64_t m = 1ULL << (bits - 1); !(x & m); m >>= 1) n++;
+	return n;
+#endif
+}
+
+static inline unsigned int count_trailing_zeros(uint64_t x) //x != 0
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	unsigned int n = 0;
+	for (; !(x & 1); x >>= 1) n++;
+	return n;
+#endif
+}
+
+/*------------------------------ HistoryStore functions ------------------------------*/
+
+HistoryStore::HistoryStore(std::size_t capacity, SampleType type): type(type)
+{
+	switch (type) {
+		case Sample_Int16: this->item_size = sizeof(int16_t); break;
+		case Sample_Int32: this->item_size = sizeof(int32_t); break;
+		case Sample_Float: this->item_size = sizeof(float); break;
+		default:           this->item_size = sizeof(double); this->type = Sample_Double; break;
+	}
+	
+	// a block of slowly changing items takes about 128 bytes of data
+	std::size_t blocks_size = capacity / (sizeof(Block) + 128);
+	if (blocks_size > 0xFFFFFFFFUL) throw std::bad_alloc(); //blocks are indexed by unsigned int
+	if (blocks_size < 2) blocks_size = 2;
+	this->blocks_size = blocks_size;
+	this->data_size = (capacity > blocks_size * sizeof(Block))? capacity - blocks_size * sizeof(Block) : 0;
+	if (this->data_size < Block_Encoded_Max) this->data_size = Block_Encoded_Max;
+	
+	this->seq_write = 0;
+	bool except_caught = false;
+	try {
+		this->blocks = new Block[this->blocks_size];
+		this->data = new unsigned char[this->data_size];
+	} catch (std::bad_alloc&) {
+		except_caught = true;
+	}
+	if (except_caught || this->blocks == NULL || this->data == NULL) {
+		if (this->blocks) delete[] this->blocks;
+		if (this->data) delete[] this->data;
+		throw std::bad_alloc();
+	}
+}
+
+HistoryStore::~HistoryStore()
+{
+	delete[] this->blocks; delete[] this->data;
+}
+
+void HistoryStore::set_scale(float scale, float offset)
+{
+	this->write_begin();
+	this->scale = scale; this->offset = offset;
+	this->write_end();
+}
+
+std::size_t HistoryStore::size_compressed() const
+{
+	unsigned int seq; std::size_t sz;
+	do {
+		seq = this->read_begin(); sz = 0;
+		for (unsigned int i = 0; i < this->block_cnt; i++)
+			sz += this->block(i).len;
+	} while (this->read_retry(seq));
+	return sz;
+}
+
+void HistoryStore::append(uint64_t i_abs, const unsigned char* items, unsigned int cnt)
+{
+	if (cnt == 0 || cnt > Block_Size) return;
+	
+	unsigned char enc[Block_Encoded_Max];
+	Block blk; blk.i_abs = i_abs; blk.cnt = cnt;
+	blk.len = this->encode(items, cnt, enc);
+	
+	// summaries of the block
+	double val[Block_Size], sum = 0, sq_sum = 0;
+	blk.min = std::numeric_limits<float>::max(); blk.max = std::numeric_limits<float>::lowest();
+	for (unsigned int i = 0; i < cnt; i++) {
+		double v;
+		switch (this->type) {
+			case Sample_Int16: v = ((const int16_t*)items)[i]; break;
+			case Sample_Int32: v = ((const int32_t*)items)[i]; break;
+			case Sample_Float: v = ((const float*)items)[i]; break;
+			default:           v = ((const double*)items)[i]; break;
+		}
+		val[i] = v * this->scale + this->offset;
+		if (val[i] < blk.min) blk.min = val[i];
+		if (val[i] > blk.max) blk.max = val[i];
+		sum += val[i]; sq_sum += val[i] * val[i];
+	}
+	
+	this->write_begin();
+	
+	if (this->block_cnt > 0) {
+		const Block& last = this->block(this->block_cnt - 1);
+		if (last.i_abs + last.cnt != i_abs) { //not continuous
+			this->block_cnt = 0; this->block_first = 0; this->data_end = 0;
+			this->sum_begin = this->sq_sum_begin = this->sum_comp = this->sq_sum_comp = 0;
+		}
+	}
+	
+	// the oldest blocks are located after data_end in the data ring
+	std::size_t pos = this->data_end;
+	if (pos + blk.len > this->data_size) {
+		while (this->block_cnt > 0 && this->block(0).offset >= this->data_end)
+			this->block_drop_first();
+		pos = 0;
+	}
+	while (this->block_cnt > 0
+	&& (this->block_cnt == this->blocks_size
+	    || (this->block(0).offset >= pos && this->block(0).offset < pos + blk.len)))
+		this->block_drop_first();
+	
+	memcpy(this->data + pos, enc, blk.len);
+	blk.offset = pos;
+	
+	// compensated prefix sums
+	double sum_prev, sq_sum_prev;
+	this->block_sums_begin(this->block_cnt, sum_prev, sq_sum_prev);
+	double y = sum - this->sum_comp, t = sum_prev + y;
+	this->sum_comp = (t - sum_prev) - y; blk.sum_end = t;
+	y = sq_sum - this->sq_sum_comp; t = sq_sum_prev + y;
+	this->sq_sum_comp = (t - sq_sum_prev) - y; blk.sq_sum_end = t;
+	
+	this->block(this->block_cnt) = blk;
+	this->block_cnt = this->block_cnt + 1;
+	this->data_end = pos + blk.len;
+	
+	this->write_end();
+}
+
+void HistoryStore::truncate(uint64_t i_abs_end)
+{
+	this->write_begin();
+	while (this->block_cnt > 0 && this->block(this->block_cnt - 1).i_abs >= i_abs_end)
+		this->block_cnt = this->block_cnt - 1;
+	
+	if (this->block_cnt > 0) {
+		Block& last = this->block(this->block_cnt - 1);
+		if (last.i_abs + last.cnt > i_abs_end) {
+			last.cnt = i_abs_end - last.i_abs;
+			float min = std::numeric_limits<float>::max(), max = std::numeric_limits<float>::lowest();
+			double sum = 0, sq_sum = 0, sum_prev, sq_sum_prev;
+			this->decode_values(last, IndexRange(last.i_abs, i_abs_end - 1), min, max, sum, sq_sum);
+			this->block_sums_begin(this->block_cnt - 1, sum_prev, sq_sum_prev);
+			last.min = min; last.max = max;
+			last.sum_end = sum_prev + sum; last.sq_sum_end = sq_sum_prev + sq_sum;
+			this->sum_comp = this->sq_sum_comp = 0;
+		}
+	}
+	if (this->block_cnt == 0) {
+		this->block_first = 0; this->data_end = 0;
+		this->sum_begin = this->sq_sum_begin = this->sum_comp = this->sq_sum_comp = 0;
+	}
+	this->write_end();
+}
+
+void HistoryStore::clear()
+{
+	this->truncate(0);
+}
+
+ValueRange HistoryStore::get_value_range(IndexRange range_abs) const
+{
+	float min, max; unsigned int seq;
+	do {
+		seq = this->read_begin();
+		min = std::numeric_limits<float>::max(); max = std::numeric_limits<float>::lowest();
+		
+		IndexRange range = this->range().cut_range(range_abs); if (! range) continue;
+		unsigned int bl = this->block_find(range.min()), br = this->block_find(range.max());
+		for (unsigned int i = bl; i <= br; i++) {
+			const Block& blk = this->block(i);
+			if (range.contain(IndexRange(blk.i_abs, blk.i_abs + blk.cnt - 1))) {
+				if (blk.min < min) min = blk.min;
+				if (blk.max > max) max = blk.max;
+			} else {
+				double sum, sq_sum;
+				this->decode_values(blk, range, min, max, sum, sq_sum);
+			}
+		}
+	} while (this->read_retry(seq));
+	
+	if (min > max) return ValueRange(0, 0);
+	return ValueRange(min, max);
+}
+
+void HistoryStore::get_sums(IndexRange range_abs, double& sum, double& sq_sum) const
+{
+	unsigned int seq;
+	do {
+		seq = this->read_begin();
+		sum = sq_sum = 0;
+		
+		IndexRange range = this->range().cut_range(range_abs); if (! range) continue;
+		unsigned int bl = this->block_find(range.min()), br = this->block_find(range.max());
+		float min, max;
+		
+		// blocks partially covered are decoded, blocks in [bl, br] are covered completely
+		const Block& blk_l = this->block(bl);
+		if (range.min() > blk_l.i_abs || range.max() < blk_l.i_abs + blk_l.cnt - 1) {
+			this->decode_values(blk_l, range, min, max, sum, sq_sum);
+			if (bl == br) continue;
+			bl++;
+		}
+		const Block& blk_r = this->block(br);
+		if (range.max() < blk_r.i_abs + blk_r.cnt - 1) {
+			this->decode_values(blk_r, range, min, max, sum, sq_sum);
+			if (bl == br) continue;
+			br--;
+		}
+		
+		double sum_begin, sq_sum_begin;
+		this->block_sums_begin(bl, sum_begin, sq_sum_begin);
+		sum += this->block(br).sum_end - sum_begin;
+		sq_sum += this->block(br).sq_sum_end - sq_sum_begin;
+	} while (this->read_retry(seq));
+}
+
+uint64_t HistoryStore::copy(IndexRange range_abs, float* out) const
+{
+	uint64_t cnt_cpy; unsigned int seq; double val[Block_Size];
+	do {
+		seq = this->read_begin(); cnt_cpy = 0;
+		
+		IndexRange range = this->range().cut_range(range_abs); if (! range) continue;
+		unsigned int bl = this->block_find(range.min()), br = this->block_find(range.max());
+		for (unsigned int i = bl; i <= br; i++) {
+			const Block& blk = this->block(i);
+			unsigned int n = this->decode(blk, val);
+			IndexRange r = range.cut_range(IndexRange(blk.i_abs, blk.i_abs + n - 1));
+			if (! r) continue;
+			for (uint64_t j = r.min(); j <= r.max(); j++)
+				out[cnt_cpy++] = val[j - blk.i_abs];
+		}
+	} while (this->read_retry(seq));
+	
+	return cnt_cpy;
+}
+
+/*------------------------------ private functions ------------------------------*/
+
+unsigned int HistoryStore::block_find(uint64_t i_abs) const
+{
+	// the last block beginning at or before i_abs
+	unsigned int l = 0, r = this->block_cnt, m;
+	if (r == 0) return 0;
+	while (r - l > 1) {
+		m = l + (r - l) / 2;
+		if (this->block(m).i_abs <= i_abs)
+			l = m;
+		else
+			r = m;
+	}
+	return l;
+}
+
+void HistoryStore::block_drop_first()
+{
+	this->sum_begin = this->block(0).sum_end; this->sq_sum_begin = this->block(0).sq_sum_end;
+	this->block_first = (this->block_first + 1 < this->blocks_size)? this->block_first + 1 : 0;
+	this->block_cnt = this->block_cnt - 1;
+}
+
+void HistoryStore::block_sums_begin(unsigned int i, double& sum, double& sq_sum) const
+{
+	if (i == 0) {
+		sum = this->sum_begin; sq_sum = this->sq_sum_begin;
+	} else {
+		sum = this->block(i - 1).sum_end; sq_sum = this->block(i - 1).sq_sum_end;
+	}
+}
+
+unsigned int HistoryStore::encode(const unsigned char* items, unsigned int cnt, unsigned char* out) const
+{
+	BitWriter bw(out);
+	
+	if (this->type == Sample_Float || this->type == Sample_Double) {
+		// Gorilla: XOR with the previous item; if meaningful bits of the result fit in the
+		// previous window, only they are written, otherwise the new window is written before
+		unsigned int bits = this->item_size * 8, bits_lead = (bits == 32)? 5 : 6;
+		uint64_t cur = 0, prev = 0, x;
+		unsigned int lead_prev = bits, trail_prev = 0, lead, trail, len;
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (bits == 32) {
+				uint32_t u; memcpy(&u, items + i*sizeof(u), sizeof(u));
+				cur = u;
+			} else
+				memcpy(&cur, items + i*sizeof(cur), sizeof(cur));
+			if (i == 0) {
+				bw.put(cur, bits); prev = cur; continue;
+			}
+			x = cur ^ prev; prev = cur;
+			if (x == 0) {
+				bw.put(0, 1); continue;
+			}
+			lead = count_leading_zeros(x, bits); trail = count_trailing_zeros(x);
+			if (lead > (1U << bits_lead) - 1) lead = (1U << bits_lead) - 1;
+			if (lead_prev < bits && lead >= lead_prev && trail >= trail_prev) {
+				bw.put(2, 2); bw.put(x >> trail_prev, bits - lead_prev - trail_prev);
+			} else {
+				len = bits - lead - trail;
+				bw.put(3, 2); bw.put(lead, bits_lead); bw.put(len - 1, bits_lead);
+				bw.put(x >> trail, len);
+				lead_prev = lead; trail_prev = trail;
+			}
+		}
+	} else {
+		// delta-of-delta, zigzag-encoded, with variable-length prefixes
+		int64_t cur, prev = 0, delta, delta_prev = 0, dod; uint64_t zz;
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (this->type == Sample_Int16)
+				cur = ((const int16_t*)items)[i];
+			else
+				cur = ((const int32_t*)items)[i];
+			if (i == 0) {
+				bw.put((uint32_t)cur, 32); prev = cur; continue;
+			}
+			delta = cur - prev; dod = delta - delta_prev;
+			prev = cur; delta_prev = delta;
+			zz = ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63);
+			if (zz == 0)
+				bw.put(0, 1);
+			else if (zz < (1U << 7)) {
+				bw.put(2, 2); bw.put(zz, 7);
+			} else if (zz < (1U << 9)) {
+				bw.put(6, 3); bw.put(zz, 9);
+			} else if (zz < (1U << 12)) {
+				bw.put(14, 4); bw.put(zz, 12);
+			} else {
+				bw.put(15, 4); bw.put(zz, 36);
+			}
+		}
+	}
+	
+	bw.flush();
+	return bw.p - out;
+}
+
+unsigned int HistoryStore::decode(const Block& blk, double* out) const
+{
+	unsigned int cnt = blk.cnt;
+	if (cnt > Block_Size) cnt = Block_Size;
+	if (blk.offset > this->data_size || blk.len > this->data_size - blk.offset) return 0;
+	BitReader br(this->data + blk.offset, blk.len);
+	
+	if (this->type == Sample_Float || this->type == Sample_Double) {
+		unsigned int bits = this->item_size * 8, bits_lead = (bits == 32)? 5 : 6;
+		uint64_t cur = 0, x;
+		unsigned int lead = 0, len = bits, trail = 0;
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (i == 0)
+				cur = br.get(bits);
+			else if (br.get(1) == 1) {
+				if (br.get(1) == 1) {
+					lead = br.get(bits_lead); len = br.get(bits_lead) + 1;
+					if (lead + len > bits) lead = bits - len;
+					trail = bits - lead - len;
+				}
+				x = br.get(len) << trail;
+				cur ^= x;
+			}
+			if (bits == 32) {
+				uint32_t u = cur; float f; memcpy(&f, &u, sizeof(f));
+				out[i] = f;
+			} else {
+				double d; memcpy(&d, &cur, sizeof(d));
+				out[i] = d;
+			}
+		}
+	} else {
+		int64_t cur = 0, delta = 0, dod; uint64_t zz;
+		for (unsigned int i = 0; i < cnt; i++) {
+			if (i == 0)
+				cur = (int32_t)br.get(32);
+			else {
+				if (br.get(1) == 0) zz = 0;
+				else if (br.get(1) == 0) zz = br.get(7);
+				else if (br.get(1) == 0) zz = br.get(9);
+				else if (br.get(1) == 0) zz = br.get(12);
+				else zz = br.get(36);
+				dod = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+				delta += dod; cur += delta;
+			}
+			out[i] = cur;
+		}
+	}
+	
+	for (unsigned int i = 0; i < cnt; i++)
+		out[i] = out[i] * this->scale + this->offset;
+	return cnt;
+}
+
+void HistoryStore::decode_values(const Block& blk, IndexRange range_abs, float& min, float& max,
+                                 double& sum, double& sq_sum) const
+{
+	double val[Block_Size];
+	unsigned int n = this->decode(blk, val);
+	if (n == 0) return;
+	IndexRange r = range_abs.cut_range(IndexRange(blk.i_abs, blk.i_abs + n - 1));
+	if (! r) return;
+	
+	for (uint64_t j = r.min(); j <= r.max(); j++) {
+		double v = val[j - blk.i_abs];
+		if (v < min) min = v;
+		if (v > max) max = v;
+		sum += v; sq_sum += v * v;
+	}
+}
@@ -0,0 +1,138 @@
+// by wuwbobo2021 <https://github.com/wuwbobo2021>, <wuwbobo@outlook.com>
+// If you have found bugs in this program, please pull an issue, or contact me.
+// Licensed under LGPL version 2.1.
+
+#ifndef SIMPLE_CAIRO_PLOT_HISTORY_STORE_H
+#define SIMPLE_CAIRO_PLOT_HISTORY_STORE_H
+
+#include <simple-cairo-plot/circularbuffer.h>
+
+namespace SimpleCairoPlot
+{
+// compressed storage of items overwritten in a CircularBuffer (the cold tier, see
+// CircularBuffer::set_history_capacity()). items are appended in blocks of Block_Size:
+// float and double items are encoded by XOR with the previous item (Gorilla encoding),
+// integer items by delta-of-delta encoding. min/max and prefix sums of each block are
+// kept uncompressed, so a query only decodes blocks partially covered by the range.
+// the oldest blocks are dropped when the capacity is exceeded. indexes are absolute.
+// only one thread may append; readers retry if a block is dropped during reading.
+class HistoryStore
+{
+public:
+	enum {Block_Size = 256};
+	
+	// capacity in bytes. throws bad_alloc, also if it needs more than 2^32 - 1 blocks
+	HistoryStore(std::size_t capacity, SampleType type);
+	HistoryStore(const HistoryStore&) = delete;
+	HistoryStore& operator=(const HistoryStore&) = delete;
+	~HistoryStore();
+	
+	void set_scale(float scale, float offset); //must be the same as the buffer's
+	
+	IndexRange range() const;
+	std::size_t capacity() const;
+	std::size_t size_compressed() const; //bytes used by compressed data
+	
+	// items must be of the storage type; cnt <= Block_Size. if i_abs isn't the end of the
+	// range, existing blocks are dropped
+	void append(uint64_t i_abs, const unsigned char* items, unsigned int cnt);
+	void truncate(uint64_t i_abs_end); //drops items from i_abs_end
+	void clear();
+	
+	ValueRange get_value_range(IndexRange range_abs) const; //range_abs must be available
+	void get_sums(IndexRange range_abs, double& sum, double& sq_sum) const;
+	uint64_t copy(IndexRange range_abs, float* out) const; //returns amount of items copied
+	
+private:
+	SampleType type; unsigned int item_size;
+	float scale = 1, offset = 0;
+	
+	struct Block {
+		uint64_t i_abs; unsigned int cnt;
+		std::size_t offset; unsigned int len; //position in the data ring, in bytes
+		float min, max; //values
+		double sum_end, sq_sum_end; //prefix sums at the end of the block
+	};
+	Block* blocks = NULL; unsigned int blocks_size = 0; //ring of blocks
+	volatile unsigned int block_first = 0, block_cnt = 0;
+	
+	unsigned char* data = NULL; std::size_t data_size = 0; //ring of compressed data
+	volatile std::size_t data_end = 0; //where the next block should be written
+	double sum_begin = 0, sq_sum_begin = 0; //prefix sums before the first block
+	double sum_comp = 0, sq_sum_comp = 0; //compensation of the latest prefix sums
+	
+	std::atomic_uint seq_write; //odd while blocks are being changed (seqlock)
+	
+	void write_begin();
+	void write_end();
+	unsigned int read_begin() const;
+	bool read_retry(unsigned int seq) const;
+	
+	Block& block(unsigned int i) const; //i-th block from the oldest
+	unsigned int block_find(uint64_t i_abs) const; //binary search
+	void block_drop_first();
+	void block_sums_begin(unsigned int i, double& sum, double& sq_sum) const;
+	
+	unsigned int encode(const unsigned char* items, unsigned int cnt, unsigned char* out) const;
+	unsigned int decode(const Block& blk, double* out) const; //returns amount of items decoded
+	void decode_values(const Block& blk, IndexRange range_abs, float& min, float& max,
+	                   double& sum, double& sq_sum) const;
+};
+
+inline IndexRange HistoryStore::range() const
+{
+	unsigned int seq; IndexRange range;
+	do {
+		seq = this->read_begin();
+		if (this->block_cnt > 0)
+			range.set(this->block(0).i_abs,
+			          this->block(this->block_cnt - 1).i_abs + this->block(this->block_cnt - 1).cnt - 1);
+		else
+			range = IndexRange();
+	} while (this->read_retry(seq));
+	return range;
+}
+
+inline std::size_t HistoryStore::capacity() const
+{
+	return this->blocks_size * sizeof(Block) + this->data_size;
+}
+
+/*------------------------------ private functions ------------------------------*/
+
+inline void HistoryStore::write_begin()
+{
+	this->seq_write.store(this->seq_write.load(std::memory_order_relaxed) + 1,
+	                      std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void HistoryStore::write_end()
+{
+	this->seq_write.store(this->seq_write.load(std::memory_order_relaxed) + 1,
+	                      std::memory_order_release);
+}
+
+inline unsigned int HistoryStore::read_begin() const
+{
+	unsigned int seq;
+	while ((seq = this->seq_write.load(std::memory_order_acquire)) & 1)
+		std::this_thread::yield();
+	return seq;
+}
+
+inline bool HistoryStore::read_retry(unsigned int seq) const
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return this->seq_write.load(std::memory_order_relaxed) != seq;
+}
+
+inline HistoryStore::Block& HistoryStore::block(unsigned int i) const
+{
+	i += this->block_first;
+	if (i >= this->blocks_size) i -= this->blocks_size;
+	return this->blocks[i];
+}
+
+}
+#endif
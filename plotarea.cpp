@@ -20,9 +20,13 @@ PlotArea::PlotArea(CircularBuffer* buf)
 void PlotArea::init(CircularBuffer* buf)
 {
 	if (this->flag_auto_refresh) this->set_refresh_mode(false);
+	if (this->flag_render_thread) this->set_render_mode(false);
 	
 	if (! buf)
 		throw std::invalid_argument("PlotArea::init(): the buffer pointer is null.");
+	if (this->source && this->window_id >= 0)
+		this->source->window_unregister(this->window_id);
+	this->window_id = -1; this->window_width = 0;
 	this->source = buf;
 	
 	unsigned int limit_max = 2 * this->get_screen()->get_monitor_workarea().get_width();
@@ -41,7 +45,9 @@ void PlotArea::init(CircularBuffer* buf)
 
 PlotArea::~PlotArea()
 {
-	this->set_refresh_mode(false); //make sure the thread is ended
+	this->set_refresh_mode(false); //make sure the threads are ended
+	this->set_render_mode(false);
+	if (this->window_id >= 0) this->source->window_unregister(this->window_id);
 }
 
 bool PlotArea::set_refresh_mode(bool auto_refresh, unsigned int interval)
@@ -73,6 +79,35 @@ bool PlotArea::set_refresh_mode(bool auto_refresh, unsigned int interval)
 	}
 }
 
+bool PlotArea::set_render_mode(bool render_thread)
+{
+	if (this->source == NULL && render_thread)
+		throw std::runtime_error("PlotArea::set_render_mode(): pointer of source data buffer is not set.");
+	
+	if (render_thread == this->flag_render_thread) return true;
+	if (render_thread) {
+		this->flag_render_thread = true;
+		try {
+			this->thread_render = new std::thread(&PlotArea::render_loop, this);
+		} catch (std::exception&) {
+			this->flag_render_thread = false;
+			this->thread_render = NULL;
+			return false;
+		}
+		this->render_request();
+	} else {
+		this->mutex_render_req.lock();
+		this->flag_render_thread = false;
+		this->cond_render_req.notify_one();
+		this->mutex_render_req.unlock();
+		if (this->thread_render) {
+			this->thread_render->join();
+			delete(this->thread_render); this->thread_render = NULL;
+		}
+	}
+	return true;
+}
+
 void PlotArea::refresh(bool forced_check_range_y, bool forced_adapt, bool forced_sync)
 {
 	if (! this->source)
@@ -81,31 +116,38 @@ void PlotArea::refresh(bool forced_check_range_y, bool forced_adapt, bool forced
 	if (forced_sync) this->flag_sync = true;
 	if (flag_drawing) return;
 	
-	if (this->option_auto_goto_end) {
-		if (this->option_auto_extend_range_x)
-			this->range_x_extend();
-		else
-			this->range_x_goto_end();
-	}
-	
-	if (this->option_auto_set_range_y) {
-		if (forced_check_range_y) this->flag_check_range_y = true;
-		else if (++this->counter1 > 5) {
-			this->flag_check_range_y = true; this->counter1 = 0;
+	{ //the render thread waits while the range and flags are updated
+		std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+		if (this->option_auto_goto_end) {
+			if (this->option_auto_extend_range_x)
+				this->range_x_extend();
+			else
+				this->range_x_goto_end();
 		}
-	}
-	if (this->flag_check_range_y) {
-		if (forced_adapt) this->flag_adapt = true;
-		else if (++this->counter2 > 5) {
-			this->flag_adapt = true; this->counter2 = 0;
+		
+		if (this->option_auto_set_range_y) {
+			if (forced_check_range_y) this->flag_check_range_y = true;
+			else if (++this->counter1 > 5) {
+				this->flag_check_range_y = true; this->counter1 = 0;
+			}
+		}
+		if (this->flag_check_range_y) {
+			if (forced_adapt) this->flag_adapt = true;
+			else if (++this->counter2 > 5) {
+				this->flag_adapt = true; this->counter2 = 0;
+			}
 		}
 	}
 	
-	this->dispatcher.emit(); //let the main thread draw the frame
+	if (this->flag_render_thread)
+		this->render_request();
+	else
+		this->dispatcher.emit(); //let the main thread draw the frame
 }
 
 bool PlotArea::set_range_x(IndexRange range)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	if (!range || range.count() < 2) return false;
 	if (! this->source->is_valid_range(range)) return false;
 	
@@ -116,6 +158,7 @@ bool PlotArea::set_range_x(IndexRange range)
 
 bool PlotArea::set_range_y_length_min(float length_min)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	if (length_min < 0) return false;
 	this->range_y_length_min = length_min;
 	return true;
@@ -123,24 +166,29 @@ bool PlotArea::set_range_y_length_min(float length_min)
 
 void PlotArea::set_option_auto_goto_end(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->option_auto_goto_end = set;
 }
 void PlotArea::set_option_auto_extend_range_x(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->option_auto_extend_range_x = set;
 }
 void PlotArea::set_option_auto_set_range_y(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->option_auto_set_range_y = set;
 	if (! set) this->flag_check_range_y = false;
 }
 void PlotArea::set_option_auto_set_zero_bottom(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->option_auto_set_zero_bottom = set;
 }
 
 void PlotArea::range_x_goto_end()
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	if (this->source->count() >= this->range_x.count())
 		this->range_x.max_move_to(this->source->count() - 1);
 	else
@@ -149,6 +197,7 @@ void PlotArea::range_x_goto_end()
 
 void PlotArea::range_x_extend(bool remain_space)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	if (this->range_x.contain(this->source->range())) return;
 	
 	if (remain_space) {
@@ -167,6 +216,7 @@ void PlotArea::range_x_extend(bool remain_space)
 
 bool PlotArea::set_range_y(ValueRange range)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	if (range.length() == 0) return false;
 	if (! this->option_auto_set_range_y) {
 		this->param.range_y = range; return true;
@@ -175,42 +225,24 @@ bool PlotArea::set_range_y(ValueRange range)
 
 void PlotArea::range_y_auto_set(bool adapt)
 {
-	if (this->source->count() <= 1) {
-		this->param.range_y.set(0, 10); return;
-	}
-	
-	ValueRange range_tight = this->source->get_value_range(this->range_x, this->param.index_step);
-	if (adapt == false && this->param.range_y.contain(range_tight)) return;
-	
-	float min = range_tight.min(), max = range_tight.max();
-	
-	if (min < 0 || this->option_auto_set_zero_bottom == false) {
-		if (max > min) {
-			this->param.range_y.set(min, max); this->param.range_y.scale(1.2);
-		} else
-			this->param.range_y.set(min - 0.2*min, min + 0.2*min); //max = min < 0, rare
-		
-		if (this->param.range_y.length() < this->range_y_length_min)
-			this->param.range_y.scale(this->range_y_length_min / this->param.range_y.length());
-		
-		if (min >= 0 && this->param.range_y.min() < 0)
-			this->param.range_y.min_move_to(0);
-	} else {
-		// without any minus value, always set lower bound to 0
-		if (max > 0)
-			this->param.range_y.set(0, 1.2*max);
-		else
-			this->param.range_y.set(0, 10); //min = max = 0, rare
-		
-		if (this->param.range_y.length() < this->range_y_length_min)
-			this->param.range_y.scale(this->range_y_length_min / this->param.range_y.length(), 0);
+	// the range is calculated from a copy of the state without holding the lock
+	FrameState st;
+	{
+		std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+		st.range_x = this->range_x; st.param.index_step = this->param.index_step;
+		st.param.range_y = this->param.range_y; st.adapt = adapt;
+		st.auto_set_zero_bottom = this->option_auto_set_zero_bottom;
+		st.range_y_length_min = this->range_y_length_min;
 	}
+	this->range_y_calc(st, false); //the window is only used in the drawing thread
 	
-	this->source->set_spike_check_ref_min(range_tight.center());
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+	this->param.range_y = st.param.range_y;
 }
 
 bool PlotArea::set_axis_divider(unsigned int x_div, unsigned int y_div)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	if (x_div == 0 && y_div == 0) return false;
 	if (x_div == 0) x_div = 1; if (y_div == 0) y_div = 1;
 	
@@ -221,6 +253,7 @@ bool PlotArea::set_axis_divider(unsigned int x_div, unsigned int y_div)
 
 bool PlotArea::set_axis_x_unit(float unit)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	if (unit <= 0) return false;
 	this->param.axis_x_unit = unit;
 	return true;
@@ -228,46 +261,81 @@ bool PlotArea::set_axis_x_unit(float unit)
 
 void PlotArea::set_axis_x_unit_name(std::string str_unit)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.axis_x_unit_name = str_unit;
 }
 
 void PlotArea::set_axis_y_unit_name(std::string str_unit)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.axis_y_unit_name = str_unit;
 }
 
 void PlotArea::set_option_fixed_scale(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.option_fixed_scale = set;
 }
 
 void PlotArea::set_option_show_axis_x_values(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.option_show_axis_x_values = set;
 }
 
 void PlotArea::set_option_axis_x_int_values(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.option_axis_x_int_values = set;
 }
 
 void PlotArea::set_option_show_axis_y_values(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.option_show_axis_y_values = set;
 }
 
 void PlotArea::set_option_show_average_line(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.option_show_average_line = set;
 }
 
+void PlotArea::set_option_show_std_dev_lines(bool set)
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+	this->param.option_show_std_dev_lines = set;
+}
+
+bool PlotArea::set_percentile_band(float q_lower, float q_upper)
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+	if (!(q_lower >= 0 && q_lower < q_upper && q_upper <= 1)) return false;
+	this->pct_lower = q_lower; this->pct_upper = q_upper;
+	return true;
+}
+
+void PlotArea::set_option_show_percentile_band(bool set)
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+	this->param.option_show_percentile_band = set;
+}
+
+void PlotArea::set_option_show_histogram(bool set)
+{
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+	this->param.option_show_histogram = set;
+}
+
 void PlotArea::set_plot_color(Gdk::RGBA color)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.color_plot = color;
 }
 
 void PlotArea::set_option_anti_alias(bool set)
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.option_anti_alias = set;
 }
 
@@ -276,8 +344,14 @@ void PlotArea::set_option_anti_alias(bool set)
 void PlotArea::on_style_updated()
 {
 	if (! flag_set_colors) return;
-	
-	Gdk::RGBA color_fore = this->get_style_context()->get_color();
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+	this->color_fore = this->get_style_context()->get_color();
+	this->flag_color_fore = true; //colors are set at the beginning of the next frame
+	flag_set_colors = false;
+}
+
+void PlotArea::colors_set(const Gdk::RGBA& color_fore)
+{
 	this->color_text = color_fore;
 	
 	if ((color_fore.get_red() + color_fore.get_green() + color_fore.get_blue()) / 3 < 0.5) { //light background
@@ -287,18 +361,20 @@ void PlotArea::on_style_updated()
 		this->color_back.set_rgba(0.1, 0.1, 0.1); //black
 		this->color_grid.set_rgba(0.4, 0.4, 0.4); //deep gray
 	}
-	flag_set_colors = false;
+	this->flag_render_all = true;
 }
 
 void PlotArea::on_size_allocation(Gtk::Allocation& allocation)
 {	
 	// param.alloc is the area for plotting; alloc_outer might contain tick values.
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	this->param.alloc_outer = Gtk::Allocation(0, 0, allocation.get_width(), allocation.get_height());
 	unsigned int border_x_left = (this->param.option_show_axis_y_values? this->Border_X_Left : 0);
 	this->param.alloc = Gtk::Allocation(border_x_left, this->Border_Y,
                                         allocation.get_width() - border_x_left,
                                         allocation.get_height() - 2*this->Border_Y);
 	this->adjust_index_step();
+	if (this->flag_render_thread) this->render_request();
 }
 
 void PlotArea::adjust_index_step()
@@ -306,9 +382,38 @@ void PlotArea::adjust_index_step()
 	unsigned int plot_data_amount_max =
 		this->plot_data_amount_max_range.fit_value(2 * this->param.alloc.get_width());
 	
-	this->param.index_step = 1;
-	while (ceil(this->range_x.count() / this->param.index_step) > plot_data_amount_max)
-		this->param.index_step++;
+	// all items are plotted if they are not too many. otherwise, M4 values of each group of
+	// index_step items are plotted in a column: the minimum step making count / step <
+	// plot_data_amount_max / 2 + 1, which is about the width, so that a group fits in a pixel.
+	// there are at most plot_data_amount_max / 2 + 1 groups, PlotBuffer is sized for them
+	if (this->range_x.count() <= plot_data_amount_max)
+		this->param.index_step = 1;
+	else
+		this->param.index_step = this->range_x.count() / (plot_data_amount_max / 2 + 1) + 1;
+}
+
+bool PlotArea::window_sync(const FrameState& st)
+{
+	// the window is registered when range_x follows the end of the buffer in goto-end mode
+	// (not extended automatically, otherwise its width changes too frequently)
+	IndexRange range_data = this->source->range(); uint64_t width = st.range_x.count();
+	bool at_end = (range_data.count() <= width)? st.range_x.min() == 0
+	                                           : st.range_x.max() == range_data.max();
+	bool use = st.follow_end && at_end;
+	
+	if (this->window_id >= 0 && (!use || width != this->window_width)) {
+		this->source->window_unregister(this->window_id);
+		this->window_id = -1; this->window_width = 0;
+	}
+	if (use && this->window_id < 0) {
+		try {
+			this->window_id = this->source->window_register(width);
+		} catch (std::bad_alloc&) {
+			this->window_id = -1;
+		}
+		if (this->window_id >= 0) this->window_width = width;
+	}
+	return use && this->window_id >= 0;
 }
 
 bool PlotArea::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
@@ -329,69 +434,318 @@ void PlotArea::refresh_loop() //in the timer thread
 	}
 }
 
+void PlotArea::render_loop() //in the render thread
+{
+	std::unique_lock<std::mutex> lock(this->mutex_render_req);
+	while (true) {
+		while (this->flag_render_thread && !this->flag_render_req)
+			this->cond_render_req.wait(lock);
+		if (! this->flag_render_thread) break;
+		this->flag_render_req = false;
+		
+		lock.unlock();
+		if (this->render_frame())
+			this->dispatcher.emit(); //let the main thread paint the frame
+		lock.lock();
+	}
+}
+
+void PlotArea::render_request()
+{
+	std::lock_guard<std::mutex> lock(this->mutex_render_req);
+	this->flag_render_req = true;
+	this->cond_render_req.notify_one();
+}
+
 static inline void set_cr_color(const Cairo::RefPtr<Cairo::Context>& cr, const Gdk::RGBA& color)
 {
 	cr->set_source_rgb(color.get_red(), color.get_green(), color.get_blue());
 }
 
-void PlotArea::draw(Cairo::RefPtr<Cairo::Context> cr)
+void PlotArea::range_y_calc(FrameState& st, bool use_window)
 {
-	Gtk::Allocation alloc = this->param.alloc_outer;
-	if (alloc.get_width() < 10 || alloc.get_height() < 10) return;
+	ValueRange& range_y = st.param.range_y;
+	if (this->source->count() <= 1) {
+		range_y.set(0, 10); return;
+	}
+	
+	ValueRange range_tight(0, 0);
+	if (use_window && this->window_sync(st))
+		range_tight = this->source->get_window_value_range(this->window_id);
+	else
+		range_tight = this->source->get_value_range(st.range_x, st.param.index_step);
+	if (st.adapt == false && range_y.contain(range_tight)) return;
+	
+	float min = range_tight.min(), max = range_tight.max();
+	
+	if (min < 0 || st.auto_set_zero_bottom == false) {
+		if (max > min) {
+			range_y.set(min, max); range_y.scale(1.2);
+		} else
+			range_y.set(min - 0.2*min, min + 0.2*min); //max = min < 0, rare
+		
+		if (range_y.length() < st.range_y_length_min)
+			range_y.scale(st.range_y_length_min / range_y.length());
+		
+		if (min >= 0 && range_y.min() < 0)
+			range_y.min_move_to(0);
+	} else {
+		// without any minus value, always set lower bound to 0
+		if (max > 0)
+			range_y.set(0, 1.2*max);
+		else
+			range_y.set(0, 10); //min = max = 0, rare
+		
+		if (range_y.length() < st.range_y_length_min)
+			range_y.scale(st.range_y_length_min / range_y.length(), 0);
+	}
 	
+	this->source->set_spike_check_ref_min(range_tight.center());
+}
+
+bool PlotArea::render_frame()
+{
+	// the state set by the GUI thread is copied with the lock held, then the frame is rendered
+	// from the copy without it, so that setters and getters don't wait for a slow frame
+	FrameState& st = this->frame; PlotParam& param = this->frame.param;
+	bool flag_colors = false; Gdk::RGBA color_fore;
+	{
+		std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+		Gtk::Allocation alloc = this->param.alloc_outer;
+		if (alloc.get_width() < 10 || alloc.get_height() < 10) return false;
+		
+		param = this->param; st.range_x = this->range_x;
+		st.check_range_y = this->flag_check_range_y; st.adapt = this->flag_adapt;
+		this->flag_adapt = this->flag_check_range_y = false; //these flags can be set by refresh()
+		st.auto_set_zero_bottom = this->option_auto_set_zero_bottom;
+		st.range_y_length_min = this->range_y_length_min;
+		st.follow_end = this->option_auto_goto_end && !this->option_auto_extend_range_x;
+		st.pct_lower = this->pct_lower; st.pct_upper = this->pct_upper;
+		if (this->flag_color_fore) {
+			flag_colors = true; color_fore = this->color_fore;
+			this->flag_color_fore = false;
+		}
+	}
 	this->flag_drawing = true;
+	st.sync = this->flag_sync.exchange(false);
+	if (flag_colors) this->colors_set(color_fore);
 	
 	// update PlotParam
-	this->param.data_cnt = this->source->count();
-	this->param.data_cnt_overall = this->source->count_overall();
-	this->param.range_x = this->source->range_to_abs(this->range_x);
-	if (this->flag_check_range_y) { //this flag can be set by refresh()
-		this->range_y_auto_set(this->flag_adapt);
-		this->flag_adapt = this->flag_check_range_y = false;
+	param.data_cnt = this->source->count();
+	param.data_cnt_overall = this->source->count_overall();
+	param.data_generation = this->source->generation();
+	param.range_x = this->source->range_to_abs(st.range_x);
+	param.range_x_samples.set(this->source->sample_index(st.range_x.min()),
+	                          this->source->sample_index(st.range_x.max()));
+	if (st.check_range_y) {
+		this->range_y_calc(st, true);
+		std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
+		if (this->option_auto_set_range_y) //not changed to manual mode while calculating
+			this->param.range_y = param.range_y; //kept for the next frame and get_range_y()
+	}
+	if (param.option_show_average_line || param.option_show_std_dev_lines) {
+		float av = this->source->get_average(st.range_x);
+		param.y_av_alloc = param.range_y.map_reverse(av, param.alloc_y());
+		if (param.option_show_std_dev_lines) {
+			float sd = this->source->get_std_dev(st.range_x);
+			param.y_sd_alloc_upper = param.range_y.map_reverse(av + sd, param.alloc_y());
+			param.y_sd_alloc_lower = param.range_y.map_reverse(av - sd, param.alloc_y());
+		}
+	}
+	if (param.option_show_percentile_band) {
+		float q[3] = {st.pct_lower, 0.5, st.pct_upper}, val[3];
+		param.pct_valid = this->source->get_quantiles(st.range_x, q, 3, val);
+		if (param.pct_valid)
+			for (unsigned int k = 0; k < 3; k++)
+				param.y_pct_alloc[k] = param.range_y.map_reverse(val[k], param.alloc_y());
 	}
-	if (this->param.option_show_average_line) {
-		float av = this->source->get_average(this->range_x, this->param.index_step);
-		this->param.y_av_alloc = this->param.range_y.map_reverse(av, this->param.alloc_y());
+	if (param.option_show_histogram) {
+		// the longest bar takes 1/5 of the width
+		unsigned int bins = this->source->histogram_bins();
+		this->hist_counts.resize(bins); param.hist_bars.clear();
+		if (bins > 0 && this->source->get_histogram(st.range_x, this->hist_counts.data())) {
+			uint64_t cnt_max = 0;
+			for (unsigned int b = 0; b < bins; b++)
+				if (this->hist_counts[b] > cnt_max) cnt_max = this->hist_counts[b];
+			float len_max = param.alloc.get_width() / 5.0;
+			param.hist_bars.resize(bins);
+			for (unsigned int b = 0; b < bins; b++)
+				param.hist_bars[b] = round(len_max * this->hist_counts[b] / cnt_max);
+			param.hist_range = this->source->histogram_range();
+		}
 	}
 	
-	bool flag_clean = (bool)cr; //if cr is valid, it's passed from on_draw()
-	bool flag_redraw = (   flag_clean || this->flag_sync
-	                    || !this->param.reuse_graph(this->buf_plot.get_param()));
+	bool flag_done = this->surface_alloc();
+	if (flag_done)
+		this->render();
+	else if (st.sync)
+		this->flag_sync = true; //synced on the next frame
+	this->flag_drawing = false;
+	return flag_done;
+}
+
+void PlotArea::draw(Cairo::RefPtr<Cairo::Context> cr)
+{
+	if (! this->flag_render_thread) this->render_frame(); //otherwise it's rendered in the render thread
+	
+	std::lock_guard<std::mutex> lock(this->mutex_frame);
+	if (! this->surface_front) {
+		if (this->flag_render_thread) this->render_request();
+		return;
+	}
+	cairo_rectangle_int_t rect = this->rect_damage;
+	this->rect_damage.width = this->rect_damage.height = 0;
 	
 	Glib::RefPtr<Gdk::DrawingContext> drawing_context;
-	if (! flag_clean) {
-		// create cairo context (optimized). the frame isn't double-buffered because this
-		// is not a top-level Gdk::Window (see reference of Gdk::Window::begin_draw_frame()).
+	if (! cr) { //if cr is valid, it's passed from on_draw()
+		// only the damaged part is painted. the frame isn't double-buffered by GDK because
+		// this is not a top-level Gdk::Window, but it's complete in surface_front
+		if (rect.width <= 0 || rect.height <= 0) return;
 		Glib::RefPtr<Gdk::Window> gdk_window = this->get_window();
 		if (! gdk_window) return; //trying to avoid occasional segfault on Windows
-		cairo_rectangle_int_t rect = {0, 0, (int)alloc.get_width(), (int)alloc.get_height()};
 		drawing_context = gdk_window->begin_draw_frame(Cairo::Region::create(rect));
-		if (drawing_context) cr = drawing_context->get_cairo_context();
+		if (! drawing_context) return;
+		cr = drawing_context->get_cairo_context();
+		cr->rectangle(rect.x, rect.y, rect.width, rect.height); cr->clip();
 	}
-	if (! cr) return;
+	cr->set_source(this->surface_front, 0, 0); cr->paint();
 	
-	if (flag_clean || this->flag_sync) {
-		// fill back color even if flag_clean is set, because the widget's default color isn't known...
-		set_cr_color(cr, this->color_back); cr->paint();
-	} else if (flag_redraw) {
-		// do erasing instead of filling with back color to reduce CPU usage
-		set_cr_color(cr, this->color_back); cr->set_antialias(Cairo::ANTIALIAS_NONE);
-		cr->set_line_width(this->buf_plot.get_param().option_anti_alias? 2.0 : 1.0);
-		this->buf_plot.cairo_load(cr, true); cr->stroke();
-		this->draw_grid(cr, this->buf_plot.get_param(), false);
+	if (drawing_context) this->get_window()->end_draw_frame(drawing_context);
+}
+
+bool PlotArea::surface_alloc()
+{
+	const PlotParam& param = this->frame.param;
+	int width = param.alloc_outer.get_width(), height = param.alloc_outer.get_height(),
+	    width_plot = param.alloc.get_width(), height_plot = param.alloc.get_height();
+	if (width_plot < 1) width_plot = 1;
+	if (height_plot < 1) height_plot = 1;
+	try {
+		if (!this->surface_back || this->surface_back->get_width() != width
+		||  this->surface_back->get_height() != height) {
+			this->surface_back = Cairo::ImageSurface::create(Cairo::FORMAT_RGB24, width, height);
+			this->rect_stale = {0, 0, width, height}; //the whole frame should be composed
+		}
+		if (!this->surface_grid || this->surface_grid->get_width() != width
+		||  this->surface_grid->get_height() != height) {
+			this->surface_grid = Cairo::ImageSurface::create(Cairo::FORMAT_RGB24, width, height);
+			this->flag_grid_valid = false;
+		}
+		if (!this->surface_plot || this->surface_plot->get_width() != width_plot
+		||  this->surface_plot->get_height() != height_plot) {
+			this->surface_plot = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, width_plot, height_plot);
+			this->flag_render_all = true;
+		}
+	} catch (std::bad_alloc&) {
+		this->surface_back = this->surface_grid = this->surface_plot = Cairo::RefPtr<Cairo::ImageSurface>();
+		return false;
+	}
+	return true;
+}
+
+void PlotArea::surface_scroll(int dx)
+{
+	// moved in place, cairo doesn't support a surface being the source of itself
+	this->surface_plot->flush();
+	unsigned char* data = this->surface_plot->get_data();
+	int stride = this->surface_plot->get_stride(), width = this->surface_plot->get_width();
+	for (int y = 0; y < this->surface_plot->get_height(); y++) {
+		unsigned char* row = data + (std::size_t)y * stride;
+		memmove(row, row + 4*dx, 4*(width - dx)); //4 bytes per pixel in ARGB32 format
+		memset(row + 4*(width - dx), 0, 4*dx);
+	}
+	this->surface_plot->mark_dirty();
+}
+
+static inline cairo_rectangle_int_t rect_union(const cairo_rectangle_int_t& r1, const cairo_rectangle_int_t& r2)
+{
+	if (r1.width <= 0 || r1.height <= 0) return r2;
+	if (r2.width <= 0 || r2.height <= 0) return r1;
+	int x1 = std::min(r1.x, r2.x), x2 = std::max(r1.x + r1.width, r2.x + r2.width),
+	    y1 = std::min(r1.y, r2.y), y2 = std::max(r1.y + r1.height, r2.y + r2.height);
+	return {x1, y1, x2 - x1, y2 - y1};
+}
+
+void PlotArea::render()
+{
+	const PlotParam& param = this->frame.param;
+	const Gtk::Allocation& alloc = param.alloc;
+	int width_plot = this->surface_plot->get_width(), height_plot = this->surface_plot->get_height();
+	
+	bool flag_all = this->flag_render_all || this->frame.sync
+	             || !param.reuse_plot(this->buf_plot.get_param());
+	bool flag_synced = this->buf_plot.sync(param, this->frame.sync);
+	if (!flag_synced || !this->buf_plot.is_data_reused() || this->buf_plot.count_shift() < 0)
+		flag_all = true;
+	
+	// the graph is drawn in coordinates of the widget
+	Cairo::RefPtr<Cairo::Context> cr = Cairo::Context::create(this->surface_plot);
+	cr->translate(-alloc.get_x(), -alloc.get_y());
+	set_cr_color(cr, param.color_plot); cr->set_line_width(1.0);
+	cr->set_antialias(param.option_anti_alias? Cairo::ANTIALIAS_GRAY : Cairo::ANTIALIAS_NONE);
+	
+	int x_clear = 0; //the graph is drawn from here (relative to alloc) if it's scrolled
+	if (! flag_all) {
+		double x_step = param.alloc_x_step(),
+		       dist = this->buf_plot.count_shift() * x_step + this->scroll_err;
+		int64_t dx = lround(dist);
+		if (dx < width_plot) {
+			this->scroll_err = dist - dx;
+			if (dx > 0) this->surface_scroll(dx);
+			
+			// the last group kept (before the new groups) is the first one fully drawn;
+			// segments reaching the cleared part from the left are drawn as well
+			unsigned int cnt = this->buf_plot.count(), cnt_new = this->buf_plot.count_new();
+			if (cnt_new + 1 < cnt)
+				x_clear = floor((cnt - cnt_new - 1) * x_step) + 1;
+			if (x_clear > width_plot) x_clear = width_plot;
+			
+			cr->save();
+			cr->rectangle(alloc.get_x() + x_clear, alloc.get_y(), width_plot - x_clear, height_plot);
+			cr->clip();
+			cr->save(); cr->set_operator(Cairo::OPERATOR_CLEAR); cr->paint(); cr->restore();
+			this->buf_plot.cairo_load_tail(cr, cnt_new + 2 + ceil(2 / x_step)); cr->stroke();
+			cr->restore();
+		} else
+			flag_all = true;
+	}
+	if (flag_all) {
+		this->scroll_err = 0; x_clear = 0;
+		cr->save(); cr->set_operator(Cairo::OPERATOR_CLEAR); cr->paint(); cr->restore();
+		if (flag_synced) {
+			this->buf_plot.cairo_load(cr); cr->stroke();
+		}
 	}
 	
-	if (flag_redraw)
-		this->draw_grid(cr, this->param);
-	
-	set_cr_color(cr, this->param.color_plot); cr->set_line_width(1.0);
-	cr->set_antialias(this->param.option_anti_alias? Cairo::ANTIALIAS_GRAY : Cairo::ANTIALIAS_NONE);
-	this->buf_plot.sync(this->param, this->flag_sync);
-	this->buf_plot.cairo_load(cr, flag_redraw); cr->stroke();
+	// compose the frame. only the new part of the graph is changed if the grid isn't changed
+	cairo_rectangle_int_t rect = {0, 0, this->surface_back->get_width(), this->surface_back->get_height()};
+	if (!flag_all && param.reuse_graph(param_back)) {
+		if (x_clear >= width_plot) return; //nothing is changed
+		rect.x = alloc.get_x() + x_clear; rect.y = alloc.get_y();
+		rect.width = width_plot - x_clear; rect.height = height_plot;
+	}
 	
-	if (! flag_clean) this->get_window()->end_draw_frame(drawing_context);
-	this->flag_sync = false;
-	this->flag_drawing = false;
+	// surface_back is older than surface_front in rect_stale
+	cairo_rectangle_int_t rect_compose = rect_union(rect, this->rect_stale);
+	if (!this->flag_grid_valid || this->flag_render_all || !param.reuse_grid(param_grid)) {
+		Cairo::RefPtr<Cairo::Context> cr_grid = Cairo::Context::create(this->surface_grid);
+		this->draw_grid(cr_grid, param);
+		param_grid = param; this->flag_grid_valid = true;
+	}
+	Cairo::RefPtr<Cairo::Context> cr_back = Cairo::Context::create(this->surface_back);
+	cr_back->rectangle(rect_compose.x, rect_compose.y, rect_compose.width, rect_compose.height);
+	cr_back->clip();
+	cr_back->set_source(this->surface_grid, 0, 0); cr_back->paint();
+	this->draw_marks(cr_back, param);
+	cr_back->set_source(this->surface_plot, alloc.get_x(), alloc.get_y()); cr_back->paint();
+	
+	param_back = param;
+	this->flag_render_all = !flag_synced; //loaded data may not be drawn in surface_plot
+	
+	std::lock_guard<std::mutex> lock(this->mutex_frame);
+	std::swap(this->surface_back, this->surface_front);
+	this->rect_damage = rect_union(this->rect_damage, rect);
+	this->rect_stale = rect;
 }
 
 static inline unsigned int get_precision(float len_seg)
@@ -402,13 +756,25 @@ static inline unsigned int get_precision(float len_seg)
 	return i;
 }
 
-static inline std::string float_to_str(float val, std::ostringstream& oss)
+static inline std::string float_to_str(double val, std::ostringstream& oss)
 {
 	oss.str(""); oss << val;
 	return oss.str();
 }
 
-void PlotArea::draw_grid(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& param, bool not_erase)
+const std::string& PlotArea::label_str(LabelCache& cache, double val, unsigned int precision)
+{
+	if ((int)precision != cache.precision || cache.strs.size() >= Label_Cache_Size) {
+		cache.strs.clear(); cache.precision = precision;
+	}
+	std::map<double, std::string>::iterator it = cache.strs.find(val);
+	if (it != cache.strs.end()) return it->second;
+	
+	this->oss.precision(precision);
+	return cache.strs[val] = float_to_str(val, this->oss);
+}
+
+void PlotArea::draw_grid(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& param)
 {
 	float inner_x1 = param.alloc.get_x(),
 	      inner_y1 = param.alloc.get_y();
@@ -418,13 +784,15 @@ void PlotArea::draw_grid(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& para
 	AxisRange alloc_x(inner_x1, inner_x2),
 			  alloc_y(inner_y1, inner_y2);
 	
-	AxisRange range_val_x = param.range_x;
-	range_val_x.scale(param.axis_x_unit, 0);
+	// x-axis values are relative to the first sample, float can't hold large sample indexes
+	double origin_x = (double)param.range_x_samples.min() * param.axis_x_unit;
+	AxisRange range_val_x(0, (double)param.range_x_samples.length() * param.axis_x_unit);
 	
-	AxisValues axis_x_values(range_val_x,   param.axis_x_divider, !param.option_fixed_scale),
+	AxisValues axis_x_values(range_val_x,   param.axis_x_divider, !param.option_fixed_scale, origin_x),
 			   axis_y_values(param.range_y, param.axis_y_divider, !param.option_fixed_scale);
 	
-	set_cr_color(cr, not_erase? this->color_grid : this->color_back);
+	set_cr_color(cr, this->color_back); cr->paint();
+	set_cr_color(cr, this->color_grid);
 	cr->set_antialias(Cairo::ANTIALIAS_NONE);
 	
 	// draw border
@@ -447,86 +815,124 @@ void PlotArea::draw_grid(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& para
 	}
 	cr->stroke();
 	
-	if (param.option_show_average_line) {
-		y = param.y_av_alloc;
-		if (not_erase) {
-			set_cr_color(cr, this->color_text);
-			cr->set_dash(this->dash_pattern, 0);
-		}
-		cr->move_to(inner_x1, y);
-		cr->line_to(inner_x2, y);
-		cr->stroke(); cr->unset_dash();
-	}
-	
 	// print value labels for axis x, y
 	
-	if (not_erase && (param.option_show_axis_x_values || param.option_show_axis_y_values)) {
-		oss.clear(); cr->set_font_size(12); set_cr_color(cr, this->color_text);
+	if (param.option_show_axis_x_values || param.option_show_axis_y_values) {
+		cr->set_font_size(12); set_cr_color(cr, this->color_text);
 	}
 	
 	if (param.option_show_axis_x_values) {
-		if (not_erase) {
-			if (param.option_axis_x_int_values)
-				oss.precision(0);
-			else
-				oss.precision(get_precision(range_val_x.length() / param.axis_x_divider));
-			
-			float val; std::string str_x_val, str_x_val_prev = "";
-			for (unsigned int i = 0; i < axis_x_values.count(); i++) {
-				val = axis_x_values[i];
-				x = range_val_x.map(val, alloc_x);
-				if (inner_x2 - x < 50) break;
-				str_x_val = float_to_str(val, this->oss);
-				if (!param.option_axis_x_int_values || str_x_val != str_x_val_prev) {
-					cr->move_to(x, inner_y2 + 12);
-					cr->show_text(str_x_val);
-				}
-				if (param.option_axis_x_int_values) str_x_val_prev = str_x_val;
-			}
-			
-			// show axis x unit name
-			if (param.axis_x_unit_name.length() > 0) {
-				cr->move_to(inner_x2 - (param.axis_x_unit_name.length() + 2) * 5, inner_y2 + 12);
-				cr->show_text('(' + param.axis_x_unit_name + ')');
+		unsigned int precision = param.option_axis_x_int_values?
+			0 : get_precision(range_val_x.length() / param.axis_x_divider);
+		
+		std::string str_x_val, str_x_val_prev = "";
+		for (unsigned int i = 0; i < axis_x_values.count(); i++) {
+			x = range_val_x.map(axis_x_values[i], alloc_x);
+			if (inner_x2 - x < 50) break;
+			str_x_val = this->label_str(this->labels_x, axis_x_values.value(i), precision);
+			if (!param.option_axis_x_int_values || str_x_val != str_x_val_prev) {
+				cr->move_to(x, inner_y2 + 12);
+				cr->show_text(str_x_val);
 			}
-		} else {
-			cr->rectangle(inner_x1, inner_y2, alloc_x.length(), Border_Y); cr->fill();
+			if (param.option_axis_x_int_values) str_x_val_prev = str_x_val;
+		}
+		
+		// show axis x unit name
+		if (param.axis_x_unit_name.length() > 0) {
+			cr->move_to(inner_x2 - (param.axis_x_unit_name.length() + 2) * 5, inner_y2 + 12);
+			cr->show_text('(' + param.axis_x_unit_name + ')');
 		}
 	}
 	
 	if (param.option_show_axis_y_values) {
 		float outer_x1 = param.alloc_outer.get_x();
-		if (not_erase)
-			oss.precision(get_precision(param.range_y.length() / param.axis_y_divider));
+		unsigned int precision = get_precision(param.range_y.length() / param.axis_y_divider);
 		float val;
 		for (unsigned int i = 0; i < axis_y_values.count(); i++) {
 			val = axis_y_values[i];
 			y = param.range_y.map_reverse(val, alloc_y);
 			
-			if (! not_erase) {
-				cr->rectangle(outer_x1, y - 12, Border_X_Left + 30, 14);
-				cr->fill(); continue;
-			}
 			cr->move_to(outer_x1, y);
 			if (i < axis_y_values.count() - 1 || param.axis_y_unit_name.length() == 0)
-				cr->show_text(float_to_str(val, this->oss));
+				cr->show_text(this->label_str(this->labels_y, val, precision));
 			else { // print topmost value with axis y unit name added
 				y -= 2; cr->move_to(outer_x1, y);
-				cr->show_text(float_to_str(val, this->oss) + '(' + param.axis_y_unit_name + ')');
+				cr->show_text(this->label_str(this->labels_y, val, precision) + '(' + param.axis_y_unit_name + ')');
 			}
 		}
 	}
 }
 
+void PlotArea::draw_marks(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& param)
+{
+	float inner_x1 = param.alloc.get_x(),
+	      inner_y1 = param.alloc.get_y();
+	float inner_x2 = inner_x1 + param.alloc.get_width(),
+	      inner_y2 = inner_y1 + param.alloc.get_height();
+	AxisRange alloc_y(inner_y1, inner_y2);
+	
+	cr->set_antialias(Cairo::ANTIALIAS_NONE); cr->set_line_width(1.0);
+	float y;
+	
+	if (param.option_show_average_line) {
+		y = param.y_av_alloc;
+		set_cr_color(cr, this->color_text);
+		cr->set_dash(this->dash_pattern, 0);
+		cr->move_to(inner_x1, y);
+		cr->line_to(inner_x2, y);
+		cr->stroke(); cr->unset_dash();
+	}
+	
+	if (param.option_show_std_dev_lines) {
+		set_cr_color(cr, this->color_text);
+		cr->set_dash(this->dash_pattern_sd, 0);
+		cr->move_to(inner_x1, param.y_sd_alloc_upper);
+		cr->line_to(inner_x2, param.y_sd_alloc_upper);
+		cr->move_to(inner_x1, param.y_sd_alloc_lower);
+		cr->line_to(inner_x2, param.y_sd_alloc_lower);
+		cr->stroke(); cr->unset_dash();
+	}
+	
+	if (param.option_show_percentile_band && param.pct_valid) {
+		set_cr_color(cr, this->color_text);
+		cr->set_dash(this->dash_pattern_pct, 0);
+		for (unsigned int k = 0; k < 3; k++) {
+			cr->move_to(inner_x1, param.y_pct_alloc[k]);
+			cr->line_to(inner_x2, param.y_pct_alloc[k]);
+		}
+		cr->stroke(); cr->unset_dash();
+	}
+	
+	if (param.option_show_histogram && !param.hist_bars.empty()) {
+		// bars begin at the right border, each of them covers the y range of its bin
+		set_cr_color(cr, this->color_grid);
+		unsigned int bins = param.hist_bars.size();
+		float bin_len = param.hist_range.length() / bins, y1, y2;
+		for (unsigned int b = 0; b < bins; b++) {
+			if (param.hist_bars[b] == 0) continue;
+			y1 = param.range_y.map_reverse(param.hist_range.min() + (b + 1) * bin_len, alloc_y);
+			y2 = param.range_y.map_reverse(param.hist_range.min() + b * bin_len, alloc_y);
+			if (y1 < inner_y1) y1 = inner_y1;
+			if (y2 > inner_y2) y2 = inner_y2;
+			if (y2 <= y1) continue;
+			cr->rectangle(inner_x2 - param.hist_bars[b], y1, param.hist_bars[b], y2 - y1);
+		}
+		cr->fill();
+	}
+}
+
 /*------------------------------ PlotParam functions ------------------------------*/
 
 bool PlotParam::reuse_graph(const PlotParam& prev) const
 {
 	return this->data_cnt           >= prev.data_cnt          //buffer has not been cleared
 	    && this->data_cnt_overall   >= prev.data_cnt_overall
+	    && this->data_generation    == prev.data_generation
 	    && this->alloc.get_width()  == prev.alloc.get_width()
 	    && this->alloc.get_height() == prev.alloc.get_height()
 	    && this->y_av_alloc         == prev.y_av_alloc
+	    && this->y_sd_alloc_upper   == prev.y_sd_alloc_upper
+	    && this->y_sd_alloc_lower   == prev.y_sd_alloc_lower
 	    && this->range_x            == prev.range_x
 	    && this->range_y            == prev.range_y
 	    && this->index_step         == prev.index_step
@@ -540,19 +946,70 @@ bool PlotParam::reuse_graph(const PlotParam& prev) const
 	    && this->option_show_axis_x_values == prev.option_show_axis_x_values
 	    && this->option_show_axis_y_values == prev.option_show_axis_y_values
 	    && this->option_show_average_line  == prev.option_show_average_line
-
+	    && this->option_show_std_dev_lines == prev.option_show_std_dev_lines
+	    && this->option_show_percentile_band == prev.option_show_percentile_band
+	    && this->option_show_histogram     == prev.option_show_histogram
+	
+	    && (   !this->option_show_percentile_band
+	        || (   this->pct_valid == prev.pct_valid
+	            && this->y_pct_alloc[0] == prev.y_pct_alloc[0]
+	            && this->y_pct_alloc[1] == prev.y_pct_alloc[1]
+	            && this->y_pct_alloc[2] == prev.y_pct_alloc[2]))
+	    && (   !this->option_show_histogram
+	        || (   this->hist_bars == prev.hist_bars
+	            && this->hist_range == prev.hist_range))
 	    && (   !this->option_show_axis_x_values
 	        || (   this->option_axis_x_int_values == prev.option_axis_x_int_values
 	            && this->axis_x_unit == prev.axis_x_unit
+	            && this->range_x_samples == prev.range_x_samples
+	            && this->axis_x_unit_name == prev.axis_x_unit_name))
+	    && (   !this->option_show_axis_y_values
+	        ||  this->axis_y_unit_name == prev.axis_y_unit_name);
+}
+
+bool PlotParam::reuse_grid(const PlotParam& prev) const
+{
+	// with fixed scale, grid lines don't move with the ranges, only tick values are changed
+	return this->alloc.get_x()            == prev.alloc.get_x()
+	    && this->alloc.get_y()            == prev.alloc.get_y()
+	    && this->alloc.get_width()        == prev.alloc.get_width()
+	    && this->alloc.get_height()       == prev.alloc.get_height()
+	    && this->alloc_outer.get_width()  == prev.alloc_outer.get_width()
+	    && this->alloc_outer.get_height() == prev.alloc_outer.get_height()
+	    && this->axis_x_divider     == prev.axis_x_divider
+	    && this->axis_y_divider     == prev.axis_y_divider
+	    && this->axis_x_unit        == prev.axis_x_unit
+	    && this->option_fixed_scale == prev.option_fixed_scale
+	    && this->option_show_axis_x_values == prev.option_show_axis_x_values
+	    && this->option_show_axis_y_values == prev.option_show_axis_y_values
+	    && this->range_x_samples.length() == prev.range_x_samples.length()
+	    && (   (this->option_fixed_scale && !this->option_show_axis_x_values)
+	        ||  this->range_x_samples.min() == prev.range_x_samples.min())
+	    && (   (this->option_fixed_scale && !this->option_show_axis_y_values)
+	        ||  this->range_y == prev.range_y)
+	    && (   !this->option_show_axis_x_values
+	        || (   this->option_axis_x_int_values == prev.option_axis_x_int_values
 	            && this->axis_x_unit_name == prev.axis_x_unit_name))
 	    && (   !this->option_show_axis_y_values
 	        ||  this->axis_y_unit_name == prev.axis_y_unit_name);
 }
 
+bool PlotParam::reuse_plot(const PlotParam& prev) const
+{
+	return this->reuse_data(prev)
+	    && this->alloc.get_x()      == prev.alloc.get_x()
+	    && this->alloc.get_y()      == prev.alloc.get_y()
+	    && this->alloc.get_width()  == prev.alloc.get_width()
+	    && this->range_x.count()    == prev.range_x.count()
+	    && this->color_plot         == prev.color_plot
+	    && this->option_anti_alias  == prev.option_anti_alias;
+}
+
 bool PlotParam::reuse_data(const PlotParam& prev) const
 {
 	return this->data_cnt >= prev.data_cnt
 	    && this->data_cnt_overall >= prev.data_cnt_overall
+	    && this->data_generation == prev.data_generation
 	    && this->index_step == prev.index_step
 		&& this->range_y == prev.range_y
 		&& this->alloc.get_height() == prev.alloc.get_height()
@@ -565,59 +1022,35 @@ PlotBuffer::PlotBuffer() {}
 
 PlotBuffer::PlotBuffer(CircularBuffer* src, unsigned int cnt_limit)
 {
-	this->init(src);
+	this->init(src, cnt_limit);
 }
 
 void PlotBuffer::init(CircularBuffer* src, unsigned int cnt_limit)
 {
+	// path buffers are allocated on the first sync. PlotArea plots at most cnt_limit items, or
+	// cnt_limit / 2 + 1 groups of M4_Values points (see PlotArea::adjust_index_step()); one more
+	// group is kept for the loaded range which may begin before range x after step alignment
+	this->buf_free();
 	this->source = src;
-	this->buf_cr_cnt_max = cnt_limit;
-	
-	this->buf_cr_size = 2 * cnt_limit;
-	unsigned int buf_cr_spike_size = 4 * src->spike_buffer_size();
-	bool except_caught = false;
-	try {
-		this->buf_spike = new unsigned long int[src->spike_buffer_size()];
-		this->buf_cr = new cairo_path_data_t[this->buf_cr_size + buf_cr_spike_size];
-	} catch (std::bad_alloc) {
-		except_caught = true;
-	}
-	if (except_caught || this->buf_spike == NULL || this->buf_cr == NULL) {
-		if (this->buf_spike) {delete[] this->buf_spike; this->buf_spike = NULL;}
-		throw std::bad_alloc();
-	}
-	
-	this->buf_cr_spike = this->buf_cr + this->buf_cr_size;
-	
-	// initialize the cairo path buffer
-	cairo_path_data_t data_head;
-	data_head.header.type = CAIRO_PATH_LINE_TO; data_head.header.length = 2;
-	for (unsigned int i = 0; i < this->buf_cr_size; i += 2)
-		this->buf_cr[i] = data_head;
-	
-	// initialize the spike segment of the cairo path buffer
-	data_head.header.type = CAIRO_PATH_MOVE_TO;
-	for (unsigned int i = 0; i < buf_cr_spike_size; i += 4)
-		this->buf_cr_spike[i] = data_head;
-	data_head.header.type = CAIRO_PATH_LINE_TO;
-	for (unsigned int i = 2; i < buf_cr_spike_size; i += 4)
-		this->buf_cr_spike[i] = data_head;
+	this->buf_cr_pts_max = CircularBuffer::M4_Values * (cnt_limit / 2 + 2);
+	this->buf_cr_size = 2 * this->buf_cr_pts_max;
+	this->grp_pts = 1; this->buf_cr_cnt_max = this->buf_cr_pts_max;
 }
 
 PlotBuffer::~PlotBuffer()
 {
-	if (this->buf_spike) delete[] this->buf_spike;
-	if (this->buf_cr) delete[] this->buf_cr;
+	this->buf_free();
 }
 
 bool PlotBuffer::sync(const PlotParam& param, bool forced_sync)
 {
-	unsigned int step = param.index_step;
+	unsigned int step = param.index_step, grp_pts = (step > 1)? CircularBuffer::M4_Values : 1;
 	if (! param) return false;
-	if (param.range_x.count_by_step(step) > this->buf_cr_cnt_max) return false;
-	this->source->lock();
+	if (! this->buf_cr && ! this->buf_cr_alloc()) return false;
+	if (param.range_x.count_by_step(step) > this->buf_cr_pts_max / grp_pts) return false;
+	if (this->flag_torn) forced_sync = true;
 	
-	this->flag_redraw = forced_sync || !param.reuse_graph(this->param);
+	bool flag_redraw = forced_sync || !param.reuse_graph(this->param);
 	
 	IndexRange range_data = param.data_range_x();
 	range_data.step_align_with(this->range_data, step);
@@ -626,94 +1059,111 @@ bool PlotBuffer::sync(const PlotParam& param, bool forced_sync)
 	bool flag_reuse_data = true;
 	
 	// calculate the ranges of new data to be loaded
-	if (this->flag_redraw || range_data.max() > this->range_data.max()) {
-		if (param.alloc_x_step() != this->param.alloc_x_step())
-			this->buf_cr_refresh_x(param.alloc_x_step());
-		
-		// check if y-axis data can be reused
+	if (flag_redraw || range_data.max() > this->range_data.max()) {
+		// check if y-axis data can be reused (index_step and the layout are not changed)
 		if (!forced_sync && param.reuse_data(this->param)) {
 			if (range_data.min() < this->range_data.min()) {
 				range_data_l.set(range_data.min(), this->range_data.min() - 1);
 				cur_buf_l = this->cur_move
-					(this->cur_buf_cr, -(long int)range_data_l.count_by_step(step));
+					(this->cur_buf_cr, -(int64_t)range_data_l.count_by_step(step));
+			}
+			if (grp_pts == 1) {
+				range_data_r.set(this->range_data.max() + 1, range_data.max());
+				if (range_data_r) cur_buf_r = this->cur_move(this->cur_buf_cr, this->cnt_buf_cr);
+			} else { //the last group may have got new items
+				range_data_r.set(this->range_data.max(), range_data.max());
+				if (range_data_r) cur_buf_r = this->cur_move(this->cur_buf_cr, this->cnt_buf_cr - 1);
 			}
-			range_data_r.set(this->range_data.max() + 1, range_data.max());
-			if (range_data_r) cur_buf_r = this->cur_move(this->cur_buf_cr, this->cnt_buf_cr);
 		} else {
 			flag_reuse_data = false;
 			cur_buf_l = 0; range_data_l = range_data;
+			this->buf_cr_set_layout(grp_pts);
 		}
+		this->buf_cr_refresh_x(param.alloc_x_step()); //returns if the step isn't changed
 	}
 	
 	this->param = param;
-	if (param.index_step > 1 && (flag_redraw || range_data_r))
-		this->buf_cr_spike_sync();
 	
-	this->source->unlock();
+	this->flag_torn = false; //reload all data on next sync if it's set
+	if (range_data_l && !this->buf_cr_load(cur_buf_l, range_data_l)) this->flag_torn = true;
+	if (range_data_r && !this->buf_cr_load(cur_buf_r, range_data_r)) this->flag_torn = true;
 	
-	if (range_data_l) this->buf_cr_load(cur_buf_l, range_data_l);
-	if (range_data_r) this->buf_cr_load(cur_buf_r, range_data_r);
-	
-	if (flag_reuse_data)
-		this->cur_buf_cr = this->cur_move(this->cur_buf_cr,
-			subtract(range_data.min(), this->range_data.min()) / (int)this->param.index_step);
-	else
-		this->cur_buf_cr = 0;
+	this->flag_reused = flag_reuse_data && this->range_data;
+	if (this->flag_reused) {
+		this->shift_cnt = subtract(range_data.min(), this->range_data.min()) / (int)this->param.index_step;
+		this->cur_buf_cr = this->cur_move(this->cur_buf_cr, this->shift_cnt);
+	} else {
+		this->shift_cnt = 0; this->cur_buf_cr = 0;
+	}
 	this->cnt_buf_cr = range_data.count_by_step(this->param.index_step);
+	this->cnt_new = range_data_r.count_by_step(this->param.index_step); //0 if range_data_r is empty
 	
-	if (! this->flag_redraw) {
-		this->cur_ext = cur_buf_r;
-		this->cnt_ext = range_data_r.count_by_step(this->param.index_step); //0 if range_data_r is empty
+	this->range_data = range_data;
+	return true;
+}
+
+bool PlotBuffer::buf_cr_alloc()
+{
+	try {
+		this->buf_cr = new cairo_path_data_t[this->buf_cr_size];
+	} catch (std::bad_alloc&) {
+		this->buf_cr = NULL;
 	}
+	if (this->buf_cr == NULL) return false; //tried again on the next sync
 	
-	this->range_data = range_data;
+	cairo_path_data_t data_head;
+	data_head.header.type = CAIRO_PATH_LINE_TO; data_head.header.length = 2;
+	for (unsigned int i = 0; i < this->buf_cr_size; i += 2)
+		this->buf_cr[i] = data_head;
+	this->buf_cr_x_step = 0; //point x values are not set
 	return true;
 }
 
+void PlotBuffer::buf_free()
+{
+	if (this->buf_cr) {delete[] this->buf_cr; this->buf_cr = NULL;}
+	this->i_buf_cr = 1;
+	this->cnt_buf_cr = this->cnt_new = 0; this->flag_reused = false;
+}
+
+void PlotBuffer::buf_cr_set_layout(unsigned int grp_pts)
+{
+	if (grp_pts == this->grp_pts) return;
+	this->grp_pts = grp_pts;
+	this->buf_cr_cnt_max = this->buf_cr_pts_max / grp_pts;
+	this->buf_cr_x_step = 0; //point x values should be set again
+}
+
 void PlotBuffer::buf_cr_refresh_x(float x_step)
 {
 	if (x_step == 0 || x_step == this->buf_cr_x_step) return;
 	
-	float x = 0;
-	for (unsigned int i = 0, i_buf = 1; i < buf_cr_cnt_max; i++, i_buf += 2) {
-		this->buf_cr[i_buf].point.x = x; x += x_step;
-	}
+	// points of a group are in the same column
+	for (unsigned int i = 0, i_buf = 1; i < this->buf_cr_cnt_max; i++)
+		for (unsigned int k = 0; k < this->grp_pts; k++, i_buf += 2)
+			this->buf_cr[i_buf].point.x = i * (double)x_step; //not accumulated, no rounding drift
 	this->buf_cr_x_step = x_step;
 }
 
-void PlotBuffer::buf_cr_load(unsigned int cur_buf_cr, IndexRange range_data)
+bool PlotBuffer::buf_cr_load(unsigned int cur_buf_cr, IndexRange range_data)
 {
-	AxisRange alloc_y = this->param.alloc_y();
 	this->i_buf_cr = this->cur_to_i(cur_buf_cr);
-	for (unsigned int i = range_data.min(); i <= range_data.max(); i += this->param.index_step)
-		this->buf_cr_add(this->param.range_y.map_reverse(this->source->abs_index_item(i), alloc_y));
+	unsigned int step = this->param.index_step;
+	if (step > 1) {
+		// the last group may contain items after range_data.max()
+		IndexRange range_m4(range_data.min(), range_data.min() + range_data.count_by_step(step) * step - 1);
+		this->source->copy_range_m4(range_m4, step, &PlotBuffer::buf_cr_load_values, this);
+	} else
+		this->source->copy_range(range_data, 1, &PlotBuffer::buf_cr_load_values, this);
+	return this->source->check_intact(range_data.min());
 }
 
-void PlotBuffer::buf_cr_spike_sync()
+void PlotBuffer::buf_cr_load_values(void* obj, const float* vals, unsigned int cnt)
 {
-	unsigned int cnt_sp = this->source->get_spikes
-		(this->source->range_to_rel(this->param.range_x), this->buf_spike);
-	
-	this->i_buf_cr_spike = 1; //clears buf_cr_spike
-	if (cnt_sp < 2) return;
-	
-	AxisRange alloc_x = this->param.alloc_x(), alloc_y = this->param.alloc_y();
-	float x_step = alloc_x.length() / this->param.range_x.length();
-	
-	unsigned long int i; float x, y;
-	for (unsigned int i_sp = 0; i_sp < cnt_sp - 2; i_sp++) {
-		i = this->buf_spike[i_sp];
-		x = this->param.range_x.map(i, alloc_x);
-		y = this->param.range_y.map_reverse(this->source->abs_index_item(i), alloc_y);
-		
-		// "spikes" are actually turning points, don't draw if it wouldn't turn back soon
-		if (this->buf_spike[i_sp + 2] >= i + 2*this->param.index_step) continue;
-		this->buf_cr_spike_add(x, y);
-		
-		x += x_step;
-		y = this->param.range_y.map_reverse(this->source->abs_index_item(i + 1), alloc_y);
-		this->buf_cr_spike_add(x, y);
-	}
+	PlotBuffer* buf = static_cast<PlotBuffer*>(obj);
+	AxisRange alloc_y = buf->param.alloc_y();
+	for (unsigned int i = 0; i < cnt; i++)
+		buf->buf_cr_add(buf->param.range_y.map_reverse(vals[i], alloc_y));
 }
 
 static inline void cr_append(const Cairo::RefPtr<Cairo::Context>& cr, cairo_path_data_t* data, int num_data)
@@ -733,35 +1183,33 @@ static inline void cr_append(const Cairo::RefPtr<Cairo::Context>& cr, cairo_path
 		data->header.type = CAIRO_PATH_LINE_TO;
 }
 
-void PlotBuffer::cairo_load(const Cairo::RefPtr<Cairo::Context>& cr, bool forced_redraw)
+void PlotBuffer::cairo_load(const Cairo::RefPtr<Cairo::Context>& cr)
 {
-	if (! this->cnt_buf_cr) return;
-	if (forced_redraw) this->flag_redraw = true;
-	if (!this->flag_redraw && !this->cnt_ext) return;
-	
-	unsigned int cur, cnt; float x_cur = this->param.alloc.get_x();
-	if (this->flag_redraw) {
-		cur = this->cur_buf_cr; cnt = this->cnt_buf_cr;
-	} else {
-		cur = this->cur_move(this->cur_ext, -1); cnt = this->cnt_ext + 1; //start from the end of previous segment
-		x_cur += (this->cnt_buf_cr - cnt)*this->param.alloc_x_step();
-	}
+	this->cairo_load_groups(cr, this->cur_buf_cr, this->cnt_buf_cr, this->param.alloc.get_x());
+}
+
+void PlotBuffer::cairo_load_tail(const Cairo::RefPtr<Cairo::Context>& cr, unsigned int cnt)
+{
+	if (cnt > this->cnt_buf_cr) cnt = this->cnt_buf_cr;
+	this->cairo_load_groups(cr, this->cur_move(this->cur_buf_cr, this->cnt_buf_cr - cnt), cnt,
+	                        this->param.alloc.get_x() + (this->cnt_buf_cr - cnt)*this->param.alloc_x_step());
+}
+
+void PlotBuffer::cairo_load_groups(const Cairo::RefPtr<Cairo::Context>& cr, unsigned int cur, unsigned int cnt, float x_cur)
+{
+	if (cnt == 0) return;
 	BufRangeMap map(IndexRange(0, cnt - 1), this->buf_cr_cnt_max, cur);
 	
 	Cairo::Matrix matrix_org = cr->get_matrix(); //this is useful if cr is provided by on_draw()
 	cr->translate(-(float)map.former.min()*this->param.alloc_x_step() + x_cur, 0);
-	cr_append(cr, this->buf_cr + this->cur_to_i(map.former.min()) - 1, 2*map.former.count());
+	cr_append(cr, this->buf_cr + this->cur_to_i(map.former.min()) - 1, 2*this->grp_pts*map.former.count());
 	
 	if (map.latter) {
 		cr->set_matrix(matrix_org);
 		cr->translate(x_cur + map.former.count()*this->param.alloc_x_step(), 0);
-		cr_append(cr, this->buf_cr + this->cur_to_i(map.latter.min()) - 1, 2*map.latter.count());
+		cr_append(cr, this->buf_cr + this->cur_to_i(map.latter.min()) - 1, 2*this->grp_pts*map.latter.count());
 	}
 	
 	cr->set_matrix(matrix_org);
-	if (this->param.index_step > 1)
-		cr_append(cr, this->buf_cr_spike, this->i_buf_cr_spike - 1);
-	
-	flag_redraw = false;
 }
 
@@ -6,11 +6,16 @@
 #define SIMPLE_CAIRO_PLOT_AREA_H
 
 #include <sstream>
+#include <map>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include <gdkmm/color.h>
 #include <cairo.h>
 #include <cairomm/context.h>
+#include <cairomm/surface.h>
 #include <glibmm/dispatcher.h>
 #include <gtkmm/drawingarea.h>
 
@@ -28,11 +33,16 @@ using PlottingArea = PlotArea; //v1.0.x name
 struct PlotParam
 {
 	// current conditions
-	unsigned int data_cnt = 0; unsigned long int data_cnt_overall = 0;
+	uint64_t data_cnt = 0, data_cnt_overall = 0;
+	unsigned int data_generation = 0; //see CircularBuffer::generation()
 	Gtk::Allocation alloc, alloc_outer; //topleft point of alloc_outer is always (0, 0)
 	unsigned int y_av_alloc = 0; //don't care if option_show_average_line is not set
+	unsigned int y_sd_alloc_upper = 0, y_sd_alloc_lower = 0; //don't care if option_show_std_dev_lines is not set
+	unsigned int y_pct_alloc[3] = {0, 0, 0}; bool pct_valid = false; //lower, median, upper; see option_show_percentile_band
+	std::vector<unsigned int> hist_bars; ValueRange hist_range = ValueRange(0, 0); //bar lengths of bins, empty if the histogram isn't available
 	
 	IndexRange range_x; //different from PlotArea::range_x, it's the "absolute" index range of plotting data
+	IndexRange range_x_samples; //sample indexes of range_x, shown on the x-axis (see CircularBuffer::sample_index())
 	ValueRange range_y = ValueRange(0, 10);
 	unsigned int index_step = 1; //it will be adjusted when range_x is too wide
 	
@@ -44,6 +54,9 @@ struct PlotParam
 	bool option_show_axis_x_values = true; bool option_axis_x_int_values = false;
 	bool option_show_axis_y_values = true;
 	bool option_show_average_line = false;
+	bool option_show_std_dev_lines = false;
+	bool option_show_percentile_band = false;
+	bool option_show_histogram = false;
 	float axis_x_unit = 1;
 	std::string axis_x_unit_name = "", axis_y_unit_name = "";
 	
@@ -52,6 +65,8 @@ struct PlotParam
 	bool operator!=(const PlotParam& prev) = delete;
 	bool reuse_graph(const PlotParam& prev) const;
 	bool reuse_data(const PlotParam& prev) const;
+	bool reuse_plot(const PlotParam& prev) const; //whether the graph drawn with prev can be scrolled
+	bool reuse_grid(const PlotParam& prev) const; //whether the grid layer (with tick values) can be reused
 	
 	IndexRange data_range_x() const; //the part of range_x currently available
 	
@@ -69,30 +84,43 @@ public:
 	
 	const PlotParam& get_param() const;
 	bool sync(const PlotParam& param, bool forced_sync = false);
-	void cairo_load(const Cairo::RefPtr<Cairo::Context>& cr, bool forced_redraw = false);
+	
+	// groups loaded by the latest sync(). if loaded data is reused, it's moved left by
+	// count_shift() groups, and count_new() groups are loaded at the right side (including
+	// the previous last group in M4 mode), so that the graph drawn before can be scrolled
+	unsigned int count() const;
+	bool is_data_reused() const;
+	int64_t count_shift() const;
+	unsigned int count_new() const;
+	
+	void cairo_load(const Cairo::RefPtr<Cairo::Context>& cr); //all groups
+	void cairo_load_tail(const Cairo::RefPtr<Cairo::Context>& cr, unsigned int cnt); //the last cnt groups
 	
 private:
 	CircularBuffer* source;
 	
-	unsigned long int* buf_spike = NULL;
-	
-	unsigned int buf_cr_cnt_max;
-	cairo_path_data_t* buf_cr = NULL; unsigned int buf_cr_size, i_buf_cr = 1;
-	cairo_path_data_t* buf_cr_spike = NULL; unsigned int buf_cr_spike_size, i_buf_cr_spike = 1;
+	// a "cur" is a group of index_step items, plotted as grp_pts points: the item itself, or
+	// M4 values (see CircularBuffer::copy_range_m4()) if index_step > 1
+	unsigned int buf_cr_pts_max = 0; //buffers are allocated on demand
+	unsigned int grp_pts = 1, buf_cr_cnt_max = 0; //buf_cr_cnt_max = buf_cr_pts_max / grp_pts
+	cairo_path_data_t* buf_cr = NULL; unsigned int buf_cr_size = 0, i_buf_cr = 1;
 	
-	IndexRange range_data; //loaded data range in the buffer (absolute index)
+	IndexRange range_data; //loaded data range in the buffer (absolute index), groups begin at its items
 	unsigned int cur_buf_cr = 0, cnt_buf_cr = 0;
-	unsigned int cur_ext = 0, cnt_ext = 0; //don't care if flag_redraw or forced_redraw is set
+	bool flag_reused = false; int64_t shift_cnt = 0; unsigned int cnt_new = 0; //set by sync()
 	
 	PlotParam param;
-	bool flag_redraw = true; //set by sync(), cleared by cairo_stroke()
+	bool flag_torn = false; //set by sync() if loaded data has been overwritten (lock-free mode)
 	float buf_cr_x_step = 0; //set by buf_cr_refresh_x()
 	
+	bool buf_cr_alloc(); //returns false on failure
+	void buf_free();
+	void buf_cr_set_layout(unsigned int grp_pts); //loaded data becomes invalid if it's changed
 	void buf_cr_refresh_x(float x_step); //set all point x values (need to be translated) in the buffer
-	void buf_cr_load(unsigned int cur_buf_cr, IndexRange range_data);
-	void buf_cr_spike_sync();
+	bool buf_cr_load(unsigned int cur_buf_cr, IndexRange range_data); //returns false on torn read
+	static void buf_cr_load_values(void* obj, const float* vals, unsigned int cnt); //see CopyFuncPtr
 	void buf_cr_add(float y); //it expects i_buf_cr to be an odd index (see cairo_path_data_t reference)
-	void buf_cr_spike_add(float x, float y);
+	void cairo_load_groups(const Cairo::RefPtr<Cairo::Context>& cr, unsigned int cur, unsigned int cnt, float x_cur);
 	
 	unsigned int cur_move(unsigned int cur, int offset) const;
 	unsigned int i_to_cur(unsigned int i) const;
@@ -118,6 +146,11 @@ public:
 	void refresh(bool forced_check_range_y = false, bool forced_adapt = false, bool forced_sync = false);
 	bool set_refresh_mode(bool auto_refresh = true, unsigned int interval = 0); //in milliseconds
 	
+	// in render thread mode, frames are rendered (syncing with the buffer, auto-setting range y,
+	// stroking the graph) in a background thread, and the main thread only paints the latest
+	// complete frame, so that slow frames don't block the GUI. default: false
+	bool set_render_mode(bool render_thread = true); //returns false if the thread can't be created
+	
 	// range control
 	bool set_range_x(IndexRange range); //the only way to change index range width
 	bool set_range_y_length_min(float length_min); //minimum range length of y-axis range in auto-set mode
@@ -137,7 +170,13 @@ public:
 	void set_option_show_axis_x_values(bool set); //show tick values at the bottom, default: true
 	void set_option_axis_x_int_values(bool set); //remove decimal digits in x-axis tick values, default: false
 	void set_option_show_axis_y_values(bool set); //show tick values left of y-axis, default: true
-	void set_option_show_average_line(bool set); //this requires extra calculation (optimized), default: false
+	void set_option_show_average_line(bool set); //the average is calculated in O(1) time, default: false
+	void set_option_show_std_dev_lines(bool set); //show lines of average +/- standard deviation, default: false
+	
+	// these require the histogram of the source buffer (see CircularBuffer::set_histogram())
+	bool set_percentile_band(float q_lower, float q_upper); //quantiles of the band, default: 0.05, 0.95
+	void set_option_show_percentile_band(bool set); //show lines of the median and the band, default: false
+	void set_option_show_histogram(bool set); //show the histogram of range x at the right side, default: false
 	
 	// plotting style options
 	void set_plot_color(Gdk::RGBA color);
@@ -149,6 +188,8 @@ private:
 	
 	UIntRange plot_data_amount_max_range = UIntRange(Plot_Data_Amount_Limit_Min, 2048); //adjust range
 	
+	// range_x, param and the options below are set by the GUI thread under mutex_param. the
+	// drawing thread copies them into frame at the beginning of a frame (see render_frame())
 	IndexRange range_x = IndexRange(0, 100);
 	float range_y_length_min = 0;
 	PlotParam param;
@@ -159,40 +200,102 @@ private:
 	bool option_auto_set_range_y = true;
 	bool option_auto_set_zero_bottom = true;
 	
+	// sliding window of the source registered for auto-setting range y in goto-end mode,
+	// see CircularBuffer::window_register(). only used in the drawing thread
+	int window_id = -1; uint64_t window_width = 0;
+	
+	float pct_lower = 0.05, pct_upper = 0.95;
+	std::vector<uint64_t> hist_counts; //got from the source, only used in the drawing thread
+	
 	// used for controlling the interval of range y auto setting
 	unsigned int counter1 = 0, counter2 = 0;
-	volatile bool flag_check_range_y = false, flag_adapt = false, flag_sync = false;
+	bool flag_check_range_y = false, flag_adapt = false; //protected by mutex_param
+	std::atomic_bool flag_sync{false}; //can be set by refresh() while a frame is being rendered
+	
+	// the state of a frame, copied from the members above with the lock held only for copying,
+	// so that the frame is rendered without blocking the GUI thread. only used in the drawing thread
+	struct FrameState {
+		PlotParam param; IndexRange range_x;
+		bool check_range_y = false, adapt = false, sync = false;
+		bool auto_set_zero_bottom = true; float range_y_length_min = 0;
+		bool follow_end = false; //goto-end mode without auto-extending, see window_sync()
+		float pct_lower = 0.05, pct_upper = 0.95;
+	};
+	FrameState frame;
 	
 	std::ostringstream oss; //used for printing value labels for the grid
+	
+	// tick value labels are formatted once for each value, the cache is cleared when the
+	// precision is changed or it becomes too large. only used in the drawing thread
+	enum {Label_Cache_Size = 256};
+	struct LabelCache {std::map<double, std::string> strs; int precision = -1;};
+	LabelCache labels_x, labels_y;
 	const std::vector<double> dash_pattern = {10, 2, 2, 2}; //used for drawing average line
+	const std::vector<double> dash_pattern_sd = {2, 2}; //used for drawing standard deviation lines
+	const std::vector<double> dash_pattern_pct = {6, 3}; //used for drawing percentile lines
 	bool flag_set_colors = true; //set background/grid/text colors on first signal_size_allocation
-	Gdk::RGBA color_back, color_grid, color_text;
+	Gdk::RGBA color_fore; bool flag_color_fore = false; //set by on_style_updated(), protected by mutex_param
+	Gdk::RGBA color_back, color_grid, color_text; //derived from color_fore in the drawing thread
+	
+	// frames are rendered into surface_back, which is swapped with surface_front when it's
+	// complete, then the damaged part of surface_front is painted on the window. the graph is
+	// kept in surface_plot (transparent, of the size of param.alloc), which is scrolled when
+	// range_x moves right, so only the new part of it is drawn
+	Cairo::RefPtr<Cairo::ImageSurface> surface_front, surface_back, surface_plot;
+	Cairo::RefPtr<Cairo::ImageSurface> surface_grid; //border, grid and tick values, see PlotParam::reuse_grid()
+	PlotParam param_grid; bool flag_grid_valid = false; //param_grid is of the layer in surface_grid
+	cairo_rectangle_int_t rect_stale = {0, 0, 0, 0}; //surface_back is older than surface_front here
+	cairo_rectangle_int_t rect_damage = {0, 0, 0, 0}; //not yet painted on the window
+	std::mutex mutex_frame; //protects surface_front and rect_damage
+	// held for reading or writing the state set by the GUI thread, never while rendering. it's
+	// recursive because refresh() calls range_x_goto_end() and range_x_extend() with it held
+	mutable std::recursive_mutex mutex_param;
+	PlotParam param_back; //of the frame in surface_back
+	bool flag_render_all = true; //set when surfaces are created or colors are changed
+	double scroll_err = 0; //exact scrolling distance minus pixels scrolled, kept within 0.5
 	
 	Glib::Dispatcher dispatcher; //used for accepting refresh request from another thread
-	volatile bool flag_drawing = false;
+	std::atomic_bool flag_drawing{false}; //checked by refresh() without waiting for mutex_param
 	// used for auto-refresh mode
 	std::thread* thread_timer;
 	volatile bool flag_auto_refresh = false;
 	unsigned int refresh_interval = 40; //25 Hz
+	// used for render thread mode
+	std::thread* thread_render = NULL;
+	volatile bool flag_render_thread = false;
+	bool flag_render_req = false; std::mutex mutex_render_req; std::condition_variable cond_render_req;
 	
 	void on_style_updated() override;
 	void on_size_allocation(Gtk::Allocation& allocation);
 	void adjust_index_step();
+	void colors_set(const Gdk::RGBA& color_fore); //in the drawing thread
+	void range_y_calc(FrameState& st, bool use_window); //sets st.param.range_y without the lock
+	bool window_sync(const FrameState& st); //returns whether st.range_x is the window at the end of the buffer
 	bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr) override;
 	
 	void refresh_loop(); //for auto-refresh mode
-	
-	void draw(Cairo::RefPtr<Cairo::Context> cr = (Cairo::RefPtr<Cairo::Context>)nullptr);
-	void draw_grid(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& param, bool not_erase = true);
+	void render_loop(); //for render thread mode
+	void render_request();
+	
+	bool render_frame(); //copies the state into frame and renders it, returns false if it's not rendered
+	void draw(Cairo::RefPtr<Cairo::Context> cr = (Cairo::RefPtr<Cairo::Context>)nullptr); //in the GUI thread
+	bool surface_alloc(); //creates surfaces if the size is changed, returns false on failure
+	void surface_scroll(int dx); //moves the graph in surface_plot left by dx pixels
+	void render(); //renders the frame into surface_back, then swaps it with surface_front
+	void draw_grid(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& param); //fills the back color first
+	void draw_marks(Cairo::RefPtr<Cairo::Context> cr, const PlotParam& param); //average, percentile lines and the histogram
+	const std::string& label_str(LabelCache& cache, double val, unsigned int precision);
 };
 
 inline IndexRange PlotArea::get_range_x() const
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	return this->range_x;
 }
 
 inline ValueRange PlotArea::get_range_y() const
 {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex_param);
 	return this->param.range_y;
 }
 
@@ -236,19 +339,32 @@ inline const PlotParam& PlotBuffer::get_param() const
 	return this->param;
 }
 
-inline void PlotBuffer::buf_cr_add(float y)
+inline unsigned int PlotBuffer::count() const
 {
-	this->buf_cr[this->i_buf_cr].point.y = y;
-	this->i_buf_cr += 2;
-	if (this->i_buf_cr >= this->buf_cr_size)
-		this->i_buf_cr -= this->buf_cr_size;
+	return this->cnt_buf_cr;
 }
 
-inline void PlotBuffer::buf_cr_spike_add(float x, float y)
+inline bool PlotBuffer::is_data_reused() const
 {
-	this->buf_cr_spike[this->i_buf_cr_spike].point.x = x;
-	this->buf_cr_spike[this->i_buf_cr_spike].point.y = y;
-	this->i_buf_cr_spike += 2;
+	return this->flag_reused;
+}
+
+inline int64_t PlotBuffer::count_shift() const
+{
+	return this->shift_cnt;
+}
+
+inline unsigned int PlotBuffer::count_new() const
+{
+	return this->cnt_new;
+}
+
+inline void PlotBuffer::buf_cr_add(float y)
+{
+	this->buf_cr[this->i_buf_cr].point.y = y;
+	this->i_buf_cr += 2;
+	if (this->i_buf_cr >= 2 * this->grp_pts * this->buf_cr_cnt_max)
+		this->i_buf_cr -= 2 * this->grp_pts * this->buf_cr_cnt_max;
 }
 
 inline unsigned int PlotBuffer::cur_move(unsigned int cur, int offset) const
@@ -263,12 +379,12 @@ inline unsigned int PlotBuffer::cur_move(unsigned int cur, int offset) const
 
 inline unsigned int PlotBuffer::i_to_cur(unsigned int i) const
 {
-	return i / 2;
+	return i / (2 * this->grp_pts);
 }
 
 inline unsigned int PlotBuffer::cur_to_i(unsigned int cur) const
 {
-	return 2*cur + 1;
+	return 2 * this->grp_pts * cur + 1;
 }
 
 }
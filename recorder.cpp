@@ -20,6 +20,8 @@ using namespace SimpleCairoPlot;
 namespace SimpleCairoPlot {
 	const std::string Empty_Comment = "";
 	const unsigned int Line_Length_Max = 4096;
+	const unsigned int Csv_Load_Chunk = 4096; //rows read before loading values into the buffers
+	const unsigned int Csv_Save_Chunk = 4096; //rows copied from the buffers before writing
 }
 
 Recorder::Recorder():
@@ -29,7 +31,7 @@ Recorder::Recorder():
 	box_var_names(Gtk::ORIENTATION_HORIZONTAL, 20)
 {}
 
-Recorder::Recorder(std::vector<VariablePtr>& ptrs, unsigned int buf_size):
+Recorder::Recorder(std::vector<VariablePtr>& ptrs, uint64_t buf_size):
 	Box(Gtk::ORIENTATION_VERTICAL, 5),
 	scrollbox(Gtk::ORIENTATION_HORIZONTAL, PlotArea::Border_X_Left - 2),
 	scrollbar(Gtk::Adjustment::create(0, 0, 200, 1, 200, 200), Gtk::ORIENTATION_HORIZONTAL),
@@ -38,7 +40,7 @@ Recorder::Recorder(std::vector<VariablePtr>& ptrs, unsigned int buf_size):
 	this->init(ptrs, buf_size);
 }
 
-void Recorder::init(std::vector<VariablePtr>& ptrs, unsigned int buf_size)
+void Recorder::init(std::vector<VariablePtr>& ptrs, uint64_t buf_size)
 {
 	if (this->var_cnt) return;
 	
@@ -53,22 +55,25 @@ void Recorder::init(std::vector<VariablePtr>& ptrs, unsigned int buf_size)
 	bool except_caught = false;
 	try {
 		this->ptrs = new VariablePtr[var_cnt];
-		this->bufs = new CircularBuffer[var_cnt];
 		this->areas = new PlotArea[var_cnt];
 		this->eventboxes = new Gtk::EventBox[var_cnt];
 		this->var_labels = new Gtk::Label[var_cnt];
 		
+		std::vector<SampleType> types(this->var_cnt);
 		for (unsigned int i = 0; i < this->var_cnt; i++) {
-			this->ptrs[i] = ptrs[i];
-			this->bufs[i].init(buf_size);
+			this->ptrs[i] = ptrs[i]; types[i] = ptrs[i].sample_type;
+		}
+		this->bufs.init(this->var_cnt, buf_size, types.data());
+		
+		for (unsigned int i = 0; i < this->var_cnt; i++) {
+			this->bufs[i].set_scale(this->ptrs[i].sample_scale, this->ptrs[i].sample_offset);
 			this->areas[i].init(& this->bufs[i]);
 		}
-	} catch (std::bad_alloc) {
+	} catch (std::bad_alloc&) {
 		except_caught = true;
 	}
-	if (except_caught || !this->ptrs || !bufs || !areas || !eventboxes || !var_labels) {
+	if (except_caught || !this->ptrs || !areas || !eventboxes || !var_labels) {
 		if (this->ptrs) {delete[] this->ptrs; this->ptrs = NULL;}
-		if (this->bufs) {delete[] bufs; bufs = NULL;}
 		if (this->areas) {delete[] areas; areas = NULL;}
 		if (this->eventboxes) {delete[] eventboxes; eventboxes = NULL;}
 		this->var_cnt = 0;
@@ -79,6 +84,7 @@ void Recorder::init(std::vector<VariablePtr>& ptrs, unsigned int buf_size)
 	sigc::slot<bool, GdkEventMotion*> slot_motion = sigc::mem_fun(*this, &Recorder::on_motion_notify);
 	sigc::slot<bool, GdkEventCrossing*> slot_leave = sigc::mem_fun(*this, &Recorder::on_leave_notify);
 	
+	this->bufs.set_option_lock_free(true); //record_loop() is the only writer while recording
 	for (unsigned int i = 0; i < this->var_cnt; i++) {
 		if (this->flag_spike_check)
 			this->bufs[i].set_spike_check_ref_min(100.0 * pow(0.1, this->ptrs[i].precision_csv));
@@ -127,6 +133,7 @@ void Recorder::init(std::vector<VariablePtr>& ptrs, unsigned int buf_size)
 	
 	this->dispatcher_refresh_indicators.connect(sigc::mem_fun(*this, &Recorder::refresh_indicators));
 	this->dispatcher_sig_full.connect(sigc::mem_fun(this->sig_full, &sigc::signal<void()>::emit));
+	this->dispatcher_sig_alloc_failed.connect(sigc::mem_fun(this->sig_alloc_failed, &sigc::signal<void()>::emit));
 	
 	this->set_interval(10);
 	this->set_axis_x_range(200 - 1);
@@ -144,7 +151,6 @@ Recorder::~Recorder()
 	delete[] this->var_labels;
 	delete[] this->eventboxes;
 	delete[] this->areas;
-	delete[] this->bufs;
 	delete[] this->ptrs;
 	this->var_cnt = 0;
 }
@@ -191,8 +197,7 @@ void Recorder::clear()
 {
 	this->flag_full = false;
 	this->flag_sync_buf_plot = true;
-	for (unsigned int i = 0; i < this->var_cnt; i++)
-		this->bufs[i].clear(true);
+	this->bufs.clear(true);
 }
 
 sigc::signal<void()> Recorder::signal_full()
@@ -200,19 +205,25 @@ sigc::signal<void()> Recorder::signal_full()
 	return this->sig_full;
 }
 
+sigc::signal<void()> Recorder::signal_alloc_failed()
+{
+	return this->sig_alloc_failed;
+}
+
 bool Recorder::open_csv(const std::string& file_path)
 {
 	if (! this->var_cnt) return false;
 	
 	std::ifstream ifs(file_path, std::ios_base::in);
 	if (! ifs.is_open()) return false;
-
+	
 	if (this->flag_recording) this->stop();
 	
 	char str[Line_Length_Max] = "\0";
 	unsigned int var_cnt_csv = 1;
 	bool flag_head = true, suc = true;
 	char* cur_str_num; char* aft; float cur_val;
+	std::vector< std::vector<float> > vals(this->var_cnt); //loaded by CircularBuffer::load()
 	
 	while (ifs && !ifs.eof()) {
 		ifs.getline(str, Line_Length_Max); //'\n' is not stored into str 
@@ -238,12 +249,21 @@ bool Recorder::open_csv(const std::string& file_path)
 				if (! flag_head) suc = false; //non-numeric character in the middle
 				if (i == 0) break;
 			}
-			this->bufs[i].push(cur_val, this->flag_spike_check);
+			vals[i].push_back(cur_val);
 			cur_str_num = aft; if (*aft != '\0') cur_str_num++;
 		}
 		
 		if (flag_head) flag_head = false;
+		
+		if (vals[0].size() < Csv_Load_Chunk) continue;
+		for (unsigned int i = 0; i < var_cnt_csv; i++) {
+			this->bufs[i].load(vals[i].data(), vals[i].size(), this->flag_spike_check);
+			vals[i].clear();
+		}
 	}
+	for (unsigned int i = 0; i < var_cnt_csv; i++)
+		this->bufs[i].load(vals[i].data(), vals[i].size(), this->flag_spike_check);
+	this->bufs.sync_count();
 	
 	ifs.close();
 	if (flag_head) return false; //empty file, header is not parsed
@@ -270,7 +290,8 @@ bool Recorder::save_csv(const std::string& file_path, const std::string& str_com
 	if (str_comment.length() > 0) {
 		ofs << "# First Data: " << this->time_first_data()   << "\r\n"
 		    << "#  Last Data: " << this->time_last_data()    << "\r\n"
-		    << "#   Interval: " << this->data_interval() << " ms" << "\r\n";
+		    << "#   Interval: " << this->data_interval() * this->bufs.sample_stride() << " ms"
+		    << (this->bufs.sample_stride() > 1? " (compacted into min/max pairs)" : "") << "\r\n";
 		
 		std::istringstream ist; ist.str(str_comment);
 		char str_line[Line_Length_Max] = "\0";
@@ -287,14 +308,29 @@ bool Recorder::save_csv(const std::string& file_path, const std::string& str_com
 	}
 	ofs << "\r\n";
 	
+	// values are copied from each buffer for a chunk of lines
+	std::vector<float> vals;
+	try {
+		vals.resize((std::size_t)Csv_Save_Chunk * this->var_cnt);
+	} catch (std::bad_alloc&) {
+		ofs.close(); return false;
+	}
+	
 	ofs.setf(std::ios::fixed);
-	for (unsigned int i = 0; i < this->data_count(); i++) {
+	for (uint64_t i = 0, n; i < this->data_count(); i += n) {
+		n = this->data_count() - i; if (n > Csv_Save_Chunk) n = Csv_Save_Chunk;
 		for (unsigned int j = 0; j < this->var_cnt; j++) {
-			ofs.precision(this->ptrs[j].precision_csv);
-			ofs << this->bufs[j][i];
-			if (j + 1 < this->var_cnt) ofs << ',';
+			CircularBuffer& buf = this->bufs[j];
+			buf.copy_range(buf.range_to_abs(IndexRange(i, i + n - 1)), 1, &vals[(std::size_t)j * Csv_Save_Chunk]);
+		}
+		for (uint64_t k = 0; k < n; k++) {
+			for (unsigned int j = 0; j < this->var_cnt; j++) {
+				ofs.precision(this->ptrs[j].precision_csv);
+				ofs << vals[(std::size_t)j * Csv_Save_Chunk + k];
+				if (j + 1 < this->var_cnt) ofs << ',';
+			}
+			ofs << "\r\n";
 		}
-		ofs << "\r\n";
 	}
 	
 	ofs.close(); return true;
@@ -321,6 +357,41 @@ bool Recorder::set_redraw_interval(unsigned new_redraw_interval)
 	return true;
 }
 
+bool Recorder::set_buffer_size(uint64_t buf_size)
+{
+	if (! this->var_cnt) return false;
+	if (buf_size < 2) return false;
+	
+	if (this->flag_recording) {
+		this->buf_size_req = buf_size; return true;
+	}
+	if (! this->buffer_resize(buf_size)) return false;
+	
+	IndexRange range = this->axis_x_range();
+	if (range.count() > this->data_count_max())
+		range.set(0, this->data_count_max() - 1);
+	this->set_axis_x_range(range);
+	return true;
+}
+
+bool Recorder::set_history_capacity(std::size_t capacity)
+{
+	if (! this->var_cnt || this->flag_recording) return false;
+	
+	bool suc = true;
+	for (unsigned int i = 0; i < this->var_cnt; i++) {
+		try {
+			this->bufs[i].set_history_capacity(capacity);
+		} catch (std::bad_alloc&) {
+			suc = false; break;
+		}
+	}
+	if (! suc) //the history is either enabled for all variables, or disabled
+		for (unsigned int i = 0; i < this->var_cnt; i++)
+			this->bufs[i].set_history_capacity(0);
+	return suc;
+}
+
 static inline bool almost_equal(float val1, float val2) {
 	return fabs(val1 - val2) <= (val1 + val2) / 2.0 / 1000.0;
 }
@@ -389,6 +460,39 @@ bool Recorder::set_axis_x_range(IndexRange range)
 	return true;
 }
 
+bool Recorder::goto_data(uint64_t i)
+{
+	if (! this->var_cnt || i >= this->data_count()) return false;
+	
+	IndexRange range = this->axis_x_range(); uint64_t half = range.count() / 2;
+	range.min_move_to((i > half)? i - half : 0);
+	if (range.max() > this->data_range().max() && range.count() <= this->data_count())
+		range.max_move_to(this->data_range().max());
+	if (! this->set_axis_x_range(range)) return false;
+	
+	this->range_goto = this->axis_x_range(); this->i_goto = i;
+	return true;
+}
+
+bool Recorder::goto_next_above(unsigned int index, float thr, bool forward)
+{
+	return this->goto_next(index, thr, true, forward);
+}
+
+bool Recorder::goto_next_below(unsigned int index, float thr, bool forward)
+{
+	return this->goto_next(index, thr, false, forward);
+}
+
+bool Recorder::goto_next_crossing(unsigned int index, float thr, bool forward)
+{
+	if (index >= this->var_cnt || this->data_count() == 0) return false;
+	
+	uint64_t i = this->goto_origin();
+	if (! this->bufs[index].find_crossing(i, thr, i, forward)) return false;
+	return this->goto_data(i);
+}
+
 bool Recorder::set_axis_y_range(unsigned int index, ValueRange range)
 {
 	if (index > this->var_cnt - 1) return false;
@@ -420,6 +524,13 @@ void Recorder::set_option_stop_on_full(bool set)
 	this->option_stop_on_full = set;
 }
 
+void Recorder::set_option_compact_on_full(bool set)
+{
+	if (! this->var_cnt) return;
+	this->option_compact_on_full = set;
+	this->bufs.set_option_compact_on_full(set);
+}
+
 void Recorder::set_option_auto_extend_range_x(bool set)
 {
 	if (! this->var_cnt) return;
@@ -464,40 +575,89 @@ void Recorder::set_option_show_average_line(unsigned int index, bool set)
 	this->areas[index].set_option_show_average_line(set);
 }
 
+void Recorder::set_option_show_std_dev_lines(unsigned int index, bool set)
+{
+	if (index > this->var_cnt - 1) return;
+	this->areas[index].set_option_show_std_dev_lines(set);
+}
+
+bool Recorder::set_histogram(unsigned int index, ValueRange range, unsigned int bins)
+{
+	if (index > this->var_cnt - 1 || this->flag_recording) return false;
+	if (! this->bufs[index].set_histogram(range, bins)) return false;
+	this->refresh_areas(true);
+	return true;
+}
+
+bool Recorder::set_percentile_band(unsigned int index, float q_lower, float q_upper)
+{
+	if (index > this->var_cnt - 1) return false;
+	return this->areas[index].set_percentile_band(q_lower, q_upper);
+}
+
+void Recorder::set_option_show_percentile_band(unsigned int index, bool set)
+{
+	if (index > this->var_cnt - 1) return;
+	this->areas[index].set_option_show_percentile_band(set);
+}
+
+void Recorder::set_option_show_histogram(unsigned int index, bool set)
+{
+	if (index > this->var_cnt - 1) return;
+	this->areas[index].set_option_show_histogram(set);
+}
+
 void Recorder::set_option_anti_alias(bool set)
 {
 	for (unsigned int i = 0; i < this->var_cnt; i++)
 		this->areas[i].set_option_anti_alias(set);
 }
 
+bool Recorder::set_render_mode(bool render_thread)
+{
+	bool suc = true;
+	for (unsigned int i = 0; i < this->var_cnt; i++)
+		if (! this->areas[i].set_render_mode(render_thread)) suc = false;
+	return suc;
+}
+
 /*------------------------------ private functions ------------------------------*/
 
 void Recorder::record_loop()
 {
 	this->tp_start = system_clock::now();
 	
-	long int check_time_interval; //us
+	int64_t check_time_interval; //us
 	steady_clock::time_point t = steady_clock::now();
 	
+	std::vector<float> frame(this->var_cnt);
 	while (this->flag_recording) {
+		if (this->buf_size_req) {
+			this->buffer_resize(this->buf_size_req);
+			this->buf_size_req = 0;
+		}
+		
 		// read and record current values of variables
 		for (unsigned int i = 0; i < this->var_cnt; i++)
-			this->bufs[i].push(this->ptrs[i].read(), this->flag_spike_check);
+			frame[i] = this->ptrs[i].read();
+		this->bufs.push(frame.data(), this->flag_spike_check);
 		
-		if (!this->flag_full && this->bufs[0].is_full()) {
+		if (this->bufs.is_alloc_failed()) { //the frame is dropped, and so would be the next ones
+			this->dispatcher_refresh_indicators.emit();
+			this->record_end();
+			this->dispatcher_sig_alloc_failed.emit(); return;
+		}
+		if (!this->flag_full && !this->option_compact_on_full && this->bufs.is_full()) {
 			this->flag_full = true;
 			this->dispatcher_refresh_indicators.emit(); //for the last time
 			if (this->option_stop_on_full) {
-				this->flag_recording = false;
-				this->thread_refresh->join(); delete this->thread_refresh;
-				this->thread_record->detach(); delete this->thread_record;
-				this->thread_record = this->thread_refresh = NULL;
+				this->record_end();
 				this->dispatcher_sig_full.emit(); return;
 			} else
 				this->dispatcher_sig_full.emit();
 		}
 		
-		t += microseconds((unsigned long int)(this->interval * 1000.0));
+		t += microseconds((uint64_t)(this->interval * 1000.0));
 		if (t <= steady_clock::now()) continue; //rarely happens
 		
 		// better than this_thread::sleep_until() on Windows
@@ -511,9 +671,59 @@ void Recorder::record_loop()
 	}
 }
 
+void Recorder::record_end()
+{
+	this->flag_recording = false;
+	this->thread_refresh->join(); delete this->thread_refresh;
+	this->thread_record->detach(); delete this->thread_record;
+	this->thread_record = this->thread_refresh = NULL;
+}
+
+bool Recorder::buffer_resize(uint64_t buf_size) //called by the writer
+{
+	bool suc;
+	try {
+		suc = this->bufs.resize(buf_size);
+	} catch (std::bad_alloc&) {
+		suc = false;
+	}
+	if (! suc) return false;
+	
+	this->flag_full = this->bufs.is_full();
+	this->flag_sync_buf_plot = true;
+	this->flag_refresh_scroll = true;
+	this->dispatcher_refresh_indicators.emit();
+	return true;
+}
+
+uint64_t Recorder::goto_origin() const
+{
+	IndexRange range = this->axis_x_range();
+	uint64_t i = range.min() + range.count() / 2;
+	if (range == this->range_goto) i = this->i_goto;
+	return (i < this->data_count())? i : this->data_count() - 1;
+}
+
+bool Recorder::goto_next(unsigned int index, float thr, bool above, bool forward)
+{
+	if (index >= this->var_cnt || this->data_count() == 0) return false;
+	
+	uint64_t i = this->goto_origin(); IndexRange range;
+	if (forward)
+		range.set(i + 1, this->data_range().max());
+	else if (i > 0)
+		range.set(0, i - 1);
+	if (! range) return false;
+	
+	CircularBuffer& buf = this->bufs[index];
+	if (! (above? buf.find_above(range, thr, i, forward) : buf.find_below(range, thr, i, forward)))
+		return false;
+	return this->goto_data(i);
+}
+
 void Recorder::refresh_loop()
 {
-	long int check_time_interval = this->redraw_interval;
+	int64_t check_time_interval = this->redraw_interval;
 	if (this->redraw_interval > 200) check_time_interval = 200;
 	check_time_interval *= 1000; //us
 	
@@ -543,7 +753,7 @@ void Recorder::refresh_indicators() //not thread-safe
 	
 	Glib::RefPtr<Gtk::Adjustment> adj = this->scrollbar.get_adjustment();
 	IndexRange range_x = this->axis_x_range();
-	unsigned int val, upper = this->data_range().max();
+	uint64_t val, upper = this->data_range().max();
 	
 	if (this->flag_goto_end && !flag_extend && range_x.max() < upper)
 		val = upper - range_x.length(); //merely updates the scrollbar, not limited by redraw_interval
@@ -564,7 +774,7 @@ void Recorder::on_scroll() //on scrollbar.signal_value_changed()
 	
 	if (! this->auto_set_scroll_mode()) {
 		Glib::RefPtr<Gtk::Adjustment> adj = this->scrollbar.get_adjustment();
-		unsigned int val = adj->get_value();
+		uint64_t val = adj->get_value();
 		for (unsigned int i = 0; i < this->var_cnt; i++)
 			this->areas[i].set_range_x(IndexRange(val, val + adj->get_page_size()));
 	}
@@ -586,26 +796,30 @@ bool Recorder::on_mouse_click(GdkEventButton* event)
 	AxisRange range_scr_x(PlotArea::Border_X_Left,
 	                      this->areas[0].get_allocation().get_width());
 	
-	AxisRange range_x = this->axis_x_range();
-	unsigned int x = range_scr_x.map(event->x, range_x);
+	// float values are relative to the current range, float can't hold large indexes
+	int64_t org = this->axis_x_range().min();
+	AxisRange range_x = this->axis_x_range().to_axis(-org);
+	float x = range_scr_x.map(event->x, range_x);
 	
 	if (zoom_in) {
-		range_x.scale(0.5, x); range_x = UIntRange(range_x);
+		range_x.scale(0.5, x); range_x.set(round(range_x.min()), round(range_x.max()));
 		if (range_x.length() < 2) return true;
 	} else
 		range_x.scale(2, x);
 	
 	if (range_x.length() <= this->data_range().max()) {
-		range_x.fit_by_range(this->data_range());
+		range_x.fit_by_range(this->data_range().to_axis(-org));
 		if (this->flag_goto_end && range_scr_x.max() - event->x < 50)
-			range_x.max_move_to(this->data_range().max());
+			range_x.max_move_to(subtract(this->data_range().max(), org));
 	} else {
-		range_x.fit_by_range(this->data_range_max());
+		range_x.fit_by_range(this->data_range_max().to_axis(-org));
 		if (zoom_in)
-			range_x.min_move_to(0);
+			range_x.min_move_to(-org);
 	}
 	
-	this->set_axis_x_range(range_x);
+	int64_t min = org + round(range_x.min()), max = org + round(range_x.max());
+	if (min < 0) min = 0;
+	this->set_axis_x_range(IndexRange(min, max));
 	return true;
 }
 
@@ -631,7 +845,7 @@ bool Recorder::auto_set_scroll_mode(Glib::RefPtr<Gtk::Adjustment> adj) //default
 	return this->flag_goto_end;
 }
 
-static inline std::string float_to_str(float val, std::ostringstream& oss)
+static inline std::string float_to_str(double val, std::ostringstream& oss)
 {
 	oss.str(""); oss << val;
 	return oss.str();
@@ -654,21 +868,26 @@ bool Recorder::on_leave_notify(GdkEventCrossing* crossing_event)
 
 void Recorder::refresh_var_labels()
 {
-	float x; bool show_values = false;
+	uint64_t x = 0; bool show_values = false;
 	if (this->flag_cursor) {
 		AxisRange range_scr_x(PlotArea::Border_X_Left,
 		                      this->areas[0].get_allocation().get_width());
-		x = range_scr_x.map(this->cursor_x, this->axis_x_range());
-		show_values = this->data_range().contain(x);
+		IndexRange range_x = this->axis_x_range(); //float can't hold large indexes
+		x = range_x.min() + range_scr_x.map(this->cursor_x, ValueRange(0, range_x.length()));
+		show_values = range_x && this->data_range().contain(x);
 	}
 	
+	std::vector<float> frame(this->var_cnt);
+	if (show_values)
+		show_values = this->bufs.get_frame(x, frame.data()); //values of the same moment
+	
 	if (show_values) {
 		Glib::ustring str_label;
 		
 		for (unsigned int i = 0; i < this->var_cnt; i++) {
 			oss.precision(this->ptrs[i].precision_csv);
 			str_label = this->ptrs[i].name_friendly + ": "
-			          + float_to_str(this->bufs[i][x], oss);
+			          + float_to_str(frame[i], oss);
 			if (this->ptrs[i].unit_name.length() > 0)
 				str_label += ' ' + this->ptrs[i].unit_name;
 			this->var_labels[i].set_label(str_label);
@@ -15,6 +15,7 @@
 #include <gtkmm/scrollbar.h>
 #include <gtkmm/label.h>
 
+#include <simple-cairo-plot/buffergroup.h>
 #include <simple-cairo-plot/plotarea.h>
 
 namespace SimpleCairoPlot
@@ -34,6 +35,10 @@ public:
 	
 	unsigned int precision_csv = 3; //decimal digits (in .csv file)
 	
+	// storage of the buffer, e.g. Sample_Int16 with scale 0.01 for values of 2 decimal digits
+	// (range: -327.68 ~ 327.67) halves the memory usage. see CircularBuffer::set_scale()
+	SampleType sample_type = Sample_Float; float sample_scale = 1, sample_offset = 0;
+	
 	Gdk::RGBA color_plot;
 	
 	VariablePtr();
@@ -111,21 +116,22 @@ class Recorder: public Gtk::Box
 {
 public:
 	// note: some inline functions are NOT safe before initialization
-	Recorder(); void init(std::vector<VariablePtr>& ptrs, unsigned int buf_size);
-	Recorder(std::vector<VariablePtr>& ptrs, unsigned int buf_size);
+	Recorder(); void init(std::vector<VariablePtr>& ptrs, uint64_t buf_size);
+	Recorder(std::vector<VariablePtr>& ptrs, uint64_t buf_size);
 	virtual ~Recorder();
 	
 	bool is_recording() const;
 	float data_interval() const;
 	unsigned int var_count() const;
-	unsigned int data_count() const; IndexRange data_range() const;
-	unsigned int data_count_max() const; IndexRange data_range_max() const;
+	uint64_t data_count() const; IndexRange data_range() const;
+	uint64_t data_count_max() const; IndexRange data_range_max() const;
 	
-	float t_data(unsigned int i) const; //the unit is determined by set_index_unit() (default: s)
-	float t_first_data() const;
-	float t_last_data() const;
+	// after compaction (see set_option_compact_on_full()), data i stands for sample_stride() samples
+	double t_data(uint64_t i) const; //the unit is determined by set_index_unit() (default: s)
+	double t_first_data() const;
+	double t_last_data() const;
 	std::chrono::system_clock::time_point time_start() const;
-	std::chrono::system_clock::time_point time_data(unsigned int i) const;
+	std::chrono::system_clock::time_point time_data(uint64_t i) const;
 	std::chrono::system_clock::time_point time_first_data() const;
 	std::chrono::system_clock::time_point time_last_data() const;
 	
@@ -141,6 +147,7 @@ public:
 	void clear();
 	
 	sigc::signal<void()> signal_full();
+	sigc::signal<void()> signal_alloc_failed(); //recording is stopped, memory of the buffers can't be allocated
 	
 	bool open_csv(const std::string& file_path); //note: comments will not be loaded
 	bool save_csv(const std::string& file_path, const std::string& str_comment = Empty_Comment); //note: comment is unstandard
@@ -150,11 +157,37 @@ public:
 	bool set_interval(float new_interval); //interval of reading current values (ms). it sets index unit (multipier) to interval (s)
 	bool set_redraw_interval(unsigned int new_redraw_interval); //set manually if a slower redraw rate is required to reduce CPU usage
 	
+	// the buffers are resized without clearing (see CircularBuffer::resize()). while recording,
+	// the request is passed to the recording thread and takes effect before the next frame
+	bool set_buffer_size(uint64_t buf_size);
+	
+	// compressed history of data overwritten (see CircularBuffer::set_history_capacity()), taking
+	// `capacity` bytes of memory at most for each variable. it can't be set while recording.
+	// default: 0 (disabled). history_range() gives absolute indexes of data available, which
+	// are accepted by the queries below; data before data_range() are taken from the history
+	bool set_history_capacity(std::size_t capacity);
+	IndexRange history_range(unsigned int index) const;
+	ValueRange get_history_value_range(unsigned int index, IndexRange range_abs);
+	float get_history_average(unsigned int index, IndexRange range_abs);
+	uint64_t copy_history(unsigned int index, IndexRange range_abs, float* out); //returns amount of data copied
+	
 	bool set_index_unit(float unit); //note: set to interval in ms, s (default), min or h. index values are multiplied by the unit
 	
 	bool set_axis_x_range(IndexRange range); //range.width() + 1 is the amount of data shows in each area
-	bool set_axis_x_range(unsigned int range_width = 0); //equal to IndexRange(0, range_width) except in goto-end mode
-	bool set_axis_x_range(unsigned int min, unsigned int max); //equal to IndexRange(min, max)
+	bool set_axis_x_range(uint64_t range_width = 0); //equal to IndexRange(0, range_width) except in goto-end mode
+	bool set_axis_x_range(uint64_t min, uint64_t max); //equal to IndexRange(min, max)
+	
+	// moves the view to center on data i, keeping its width (goto-end mode is left)
+	bool goto_data(uint64_t i);
+	
+	// searches in the buffer of variable `index` (see CircularBuffer::find_above(), etc.) and
+	// moves the view to the data found. the search starts from the data found previously if
+	// the view hasn't been moved since then, otherwise from the center of the view.
+	bool goto_next_above(unsigned int index, float thr, bool forward = true);
+	bool goto_next_below(unsigned int index, float thr, bool forward = true);
+	bool goto_next_crossing(unsigned int index, float thr, bool forward = true);
+	bool goto_max(unsigned int index); //of all data
+	bool goto_min(unsigned int index);
 	bool set_axis_y_range(unsigned int index, ValueRange range); //useless when option_auto_set_range_y is set
 	bool set_axis_y_range_length_min(unsigned int index, float length_min); //minimum range length of y-axis range in auto-set mode
 	
@@ -162,6 +195,7 @@ public:
 	void set_option_fixed_axis_scale(bool set); //do not adjust scale values, default: true
 	
 	void set_option_stop_on_full(bool set); //stop recording when buffers become full, default: false
+	void set_option_compact_on_full(bool set); //compact data at half resolution instead of overwriting, see CircularBuffer. default: false
 	
 	void set_option_auto_extend_range_x(bool set); //extend index range to show all existing data. default: false
 	void set_option_auto_set_range_y(unsigned int index, bool set); //if not, the user must set the range for each area. default: true
@@ -171,15 +205,24 @@ public:
 	void set_option_axis_x_int_values(bool set); //don't show decimal digits for x-axis values. default: false
 	void set_option_show_axis_y_values(bool set); //shown in left border of each area. default: true
 	
-	void set_option_show_average_line(unsigned int index, bool set); //this requires extra calculation, though it was optimized
+	void set_option_show_average_line(unsigned int index, bool set); //the average is calculated in O(1) time. default: false
+	void set_option_show_std_dev_lines(unsigned int index, bool set); //show lines of average +/- standard deviation. default: false
+	
+	// the histogram of the buffer (see CircularBuffer::set_histogram()) can't be set while recording.
+	// percentile lines and the side histogram of an area are drawn only if it's set
+	bool set_histogram(unsigned int index, ValueRange range, unsigned int bins);
+	bool set_percentile_band(unsigned int index, float q_lower, float q_upper); //default: 0.05, 0.95
+	void set_option_show_percentile_band(unsigned int index, bool set); //lines of the median and the band. default: false
+	void set_option_show_histogram(unsigned int index, bool set); //histogram of the visible range at the right side. default: false
 	
 	void set_option_anti_alias(bool set); //font of x-axis, y-axis values are not influenced. default: false
+	bool set_render_mode(bool render_thread); //render areas in background threads, see PlotArea. default: false
 	
 private:
 	unsigned int var_cnt = 0;
 	
 	VariablePtr* ptrs = NULL;
-	CircularBuffer* bufs = NULL;
+	BufferGroup bufs; //frames are pushed into all buffers at once
 	PlotArea* areas = NULL; Gtk::EventBox* eventboxes = NULL; //DrawingArea can't handle button events anyway
 	
 	Gtk::Box scrollbox; Gtk::Scrollbar scrollbar; Gtk::Label space_left_of_scroll;
@@ -190,16 +233,20 @@ private:
 	           * thread_refresh = NULL;
 	volatile bool flag_recording = false;
 	bool flag_spike_check = false; //determined by buf_size > Plot_Data_Amount_Limit_Min
-	bool option_stop_on_full = false;
+	bool option_stop_on_full = false, option_compact_on_full = false;
 	float interval = 10; unsigned int redraw_interval = 40; //in milliseconds
 	std::chrono::system_clock::time_point tp_start;
 	
 	bool option_extend_index_range = false;
 	volatile bool flag_goto_end = false, flag_extend = false;
+	IndexRange range_goto; uint64_t i_goto = 0; //set by goto_data()
 	
 	volatile bool flag_full = false;
+	volatile uint64_t buf_size_req = 0; //handled by record_loop()
 	sigc::signal<void()> sig_full;
 	Glib::Dispatcher dispatcher_sig_full;
+	sigc::signal<void()> sig_alloc_failed;
+	Glib::Dispatcher dispatcher_sig_alloc_failed;
 	
 	volatile bool flag_sync_buf_plot = false;
 	
@@ -210,7 +257,11 @@ private:
 	std::ostringstream oss; //used to show x,y values at the cursor's location
 	
 	void record_loop();
+	void record_end(); //ends recording in the recording thread, which returns after this
 	void refresh_loop();
+	bool buffer_resize(uint64_t buf_size);
+	uint64_t goto_origin() const; //where the next search starts
+	bool goto_next(unsigned int index, float thr, bool above, bool forward);
 	
 	void on_scroll();
 	bool on_mouse_click(GdkEventButton* event);
@@ -240,37 +291,37 @@ inline unsigned int Recorder::var_count() const
 	return this->var_cnt;
 }
 
-inline unsigned int Recorder::data_count() const
+inline uint64_t Recorder::data_count() const
 {
-	return this->bufs[0].count();
+	return this->bufs.count();
 }
 
 inline IndexRange Recorder::data_range() const
 {
-	return this->bufs[0].range();
+	return this->bufs.range();
 }
 
-inline unsigned int Recorder::data_count_max() const
+inline uint64_t Recorder::data_count_max() const
 {
-	return this->bufs[0].size();
+	return this->bufs.size();
 }
 
 inline IndexRange Recorder::data_range_max() const
 {
-	return this->bufs[0].range_max();
+	return this->bufs.range_max();
 }
 
-inline float Recorder::t_data(unsigned int i) const
+inline double Recorder::t_data(uint64_t i) const
 {
-	return (this->bufs[0].count_overwritten() + i) * this->axis_x_unit;
+	return (double)this->bufs.sample_index(i) * this->axis_x_unit;
 }
 
-inline float Recorder::t_first_data() const
+inline double Recorder::t_first_data() const
 {
 	return this->t_data(0);
 }
 
-inline float Recorder::t_last_data() const
+inline double Recorder::t_last_data() const
 {
 	return this->t_data(this->data_count() - 1);
 }
@@ -280,12 +331,12 @@ inline std::chrono::system_clock::time_point Recorder::time_start() const
 	return this->tp_start;
 }
 
-inline std::chrono::system_clock::time_point Recorder::time_data(unsigned int i) const
+inline std::chrono::system_clock::time_point Recorder::time_data(uint64_t i) const
 {
-	unsigned long int i_abs = this->bufs[0].count_overwritten() + i;
-	unsigned long int t_s = ((double)i_abs * this->interval) / 1000.0;
+	uint64_t i_abs = this->bufs.sample_index(i);
+	uint64_t t_s = ((double)i_abs * this->interval) / 1000.0;
 	double i_rem = i_abs - 1000.0 * (double)t_s / this->interval;
-	unsigned long int t_us = i_rem * this->interval * 1000.0;
+	uint64_t t_us = i_rem * this->interval * 1000.0;
 	return this->tp_start + std::chrono::seconds(t_s) + std::chrono::microseconds(t_us);
 }
 
@@ -304,6 +355,30 @@ inline CircularBuffer& Recorder::buffer(unsigned int index) const
 	return this->bufs[index];
 }
 
+inline IndexRange Recorder::history_range(unsigned int index) const
+{
+	if (index > this->var_cnt - 1) return IndexRange();
+	return this->bufs[index].history_range();
+}
+
+inline ValueRange Recorder::get_history_value_range(unsigned int index, IndexRange range_abs)
+{
+	if (index > this->var_cnt - 1) return ValueRange(0, 0);
+	return this->bufs[index].get_history_value_range(range_abs);
+}
+
+inline float Recorder::get_history_average(unsigned int index, IndexRange range_abs)
+{
+	if (index > this->var_cnt - 1) return 0;
+	return this->bufs[index].get_history_average(range_abs);
+}
+
+inline uint64_t Recorder::copy_history(unsigned int index, IndexRange range_abs, float* out)
+{
+	if (index > this->var_cnt - 1) return 0;
+	return this->bufs[index].copy_history(range_abs, out);
+}
+
 inline IndexRange Recorder::axis_x_range() const
 {
 	return this->areas[0].get_range_x();
@@ -317,10 +392,11 @@ inline ValueRange Recorder::axis_y_range(unsigned int index) const
 
 inline void Recorder::refresh_view()
 {
+	this->bufs.sync_count();
 	this->set_axis_x_range();
 }
 
-inline bool Recorder::set_axis_x_range(unsigned int range_width)
+inline bool Recorder::set_axis_x_range(uint64_t range_width)
 {
 	IndexRange range(0, range_width);
 	if (this->flag_goto_end && range_width < this->data_range().max())
@@ -328,11 +404,25 @@ inline bool Recorder::set_axis_x_range(unsigned int range_width)
 	return this->set_axis_x_range(range);
 }
 
-inline bool Recorder::set_axis_x_range(unsigned int min, unsigned int max)
+inline bool Recorder::set_axis_x_range(uint64_t min, uint64_t max)
 {
 	return this->set_axis_x_range(IndexRange(min, max));
 }
 
+inline bool Recorder::goto_max(unsigned int index)
+{
+	uint64_t i;
+	if (index >= this->var_cnt || !this->bufs[index].find_max(this->data_range(), i)) return false;
+	return this->goto_data(i);
+}
+
+inline bool Recorder::goto_min(unsigned int index)
+{
+	uint64_t i;
+	if (index >= this->var_cnt || !this->bufs[index].find_min(this->data_range(), i)) return false;
+	return this->goto_data(i);
+}
+
 /*------------------------------ private functions ------------------------------*/
 
 inline bool Recorder::auto_set_scroll_mode()